@@ -17,6 +17,7 @@ to generate the POD document.
 use strict;
 use base qw(Smokeping::probes::base);
 use IPC::Open3;
+use IO::Handle;
 use Symbol;
 use Carp;
 
@@ -36,6 +37,11 @@ L<https://github.com/mprovost/NFStash>
 In B<blazemode>, NFSping sends one more ping than requested, and discards
 the first RTT value returned as it's likely to be an outlier.
 
+Each probe instance starts a single nfsping process in batch mode (B<-B>)
+and keeps it running, writing the list of targets to it each round instead
+of starting a new process. The connections to the servers stay open between
+rounds. If the process exits it is started again for the next round.
+
 DOC
 		authors => <<'DOC',
 Tobias Oetiker <tobi@oetiker.ch>
@@ -80,41 +86,75 @@ sub testhost {
 	return "localhost";
 }
 
-sub ping ($){
+# start a resident nfsping that reads batches of targets on stdin
+sub start_nfsping {
     my $self = shift;
-    # do NOT call superclass ... the ping method MUST be overwriten
-
-    # increment the internal 'rounds' counter
-    $self->increment_rounds_count;
-
-    my %upd;
     my $inh = gensym;
     my $outh = gensym;
-    my $errh = gensym;
-    # pinging nothing is pointless
-    return unless @{$self->addresses};
 
     my @params = () ;
     push @params, "-t" . int(1000 * $self->{properties}{timeout}) if $self->{properties}{timeout};
     push @params, "-i" . int(1000 * $self->{properties}{mininterval});
     push @params, "-H" . int($self->{properties}{hertz}) if $self->{properties}{hertz};
     push @params, "-T" if $self->{properties}{tcp} eq 'true';
-    
 
     my $pings =  $self->pings;
     if (($self->{properties}{blazemode} || '') eq 'true'){
         $pings++;
     }
+    # -R keeps the connections open between batches
     my @cmd = (
         $self->binary,
-        '-C', $pings, '-q',
-        @params,
-        @{$self->addresses});
+        '-B', '-R', '-C', $pings,
+        @params);
     $self->do_debug("Executing @cmd");
-    my $pid = open3($inh,$outh,$errh, @cmd);
+    # errors from stderr are mixed in with the results and filtered out below
+    my $pid = open3($inh,$outh,undef, @cmd);
+    $inh->autoflush(1);
+
+    $self->{nfsping} = { pid => $pid, in => $inh, out => $outh };
+    return $self->{nfsping};
+}
+
+# stop the resident nfsping, it exits when its input is closed
+sub stop_nfsping {
+    my $self = shift;
+    my $nfsping = delete $self->{nfsping} or return;
+
+    close $nfsping->{in};
+    close $nfsping->{out};
+    waitpid $nfsping->{pid},0;
+}
+
+sub ping ($){
+    my $self = shift;
+    # do NOT call superclass ... the ping method MUST be overwriten
+
+    # increment the internal 'rounds' counter
+    $self->increment_rounds_count;
+
+    # pinging nothing is pointless
+    return unless @{$self->addresses};
+
+    my $nfsping = $self->{nfsping} || $self->start_nfsping;
     $self->{rtts}={};
-    while (<$errh>){
+
+    # a blank line ends the batch, the results end with a blank line too
+    local $SIG{PIPE} = 'IGNORE';
+    unless (print {$nfsping->{in}} map("$_\n", @{$self->addresses}), "\n"){
+        $self->do_log("nfsping exited, restarting it next round");
+        $self->stop_nfsping;
+        return;
+    }
+
+    my $done = 0;
+    my $outh = $nfsping->{out};
+    while (<$outh>){
         chomp;
+        if ($_ eq ''){
+            $done = 1;
+            last;
+        }
 	$self->do_debug("Got nfsping output: '$_'");
         next unless /^\S+\s+:\s+[-\d\.]/; #filter out error messages from nfsping
         my @times = split /\s+/;
@@ -126,10 +166,17 @@ sub ping ($){
         @times = map {sprintf "%.10e", $_ / $self->{pingfactor}} sort {$a <=> $b} grep /^\d/, @times;
         map { $self->{rtts}{$_} = [@times] } @{$self->{addrlookup}{$ip}} ;
     }
-    waitpid $pid,0;
-    close $inh;
-    close $outh;
-    close $errh;
+
+    # the output ended before the end of the batch
+    unless ($done){
+        $self->do_log("nfsping exited, restarting it next round");
+        $self->stop_nfsping;
+    }
+}
+
+sub DESTROY {
+    my $self = shift;
+    $self->stop_nfsping;
 }
 
 sub probevars {
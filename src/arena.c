@@ -0,0 +1,166 @@
+/*
+ * Arena (bump) allocator
+ *
+ * Directory listings make a few small allocations for every entry (the entry itself, its name and filehandle) which
+ * all live exactly as long as the listing. Carving them out of large chunks is much cheaper than calling malloc() for
+ * each one, and the whole listing can be thrown away by resetting the arena.
+ */
+
+#define _GNU_SOURCE /* for strnlen */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "arena.h"
+
+/* default chunk size */
+#define ARENA_CHUNK 65536
+
+/* local prototypes */
+static struct arena_chunk *arena_chunk_new(size_t);
+
+
+static struct arena_chunk *arena_chunk_new(size_t size) {
+    struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + size);
+
+    if (chunk) {
+        chunk->next = NULL;
+        chunk->size = size;
+        chunk->used = 0;
+    }
+
+    return chunk;
+}
+
+
+/* make a new empty arena, chunk_size = 0 uses the default */
+/* returns NULL if out of memory */
+struct arena *arena_new(size_t chunk_size) {
+    struct arena *arena = calloc(1, sizeof(struct arena));
+
+    if (arena) {
+        arena->chunk_size = chunk_size ? chunk_size : ARENA_CHUNK;
+    }
+
+    return arena;
+}
+
+
+/* allocate size bytes, aligned for any type */
+/* returns NULL if out of memory */
+void *arena_alloc(struct arena *arena, size_t size) {
+    struct arena_chunk *chunk = arena->chunks;
+    const size_t align = sizeof(union arena_align);
+    void *ptr;
+
+    /* round up so the next allocation stays aligned */
+    size = (size + align - 1) & ~(align - 1);
+
+    if (chunk == NULL || chunk->size - chunk->used < size) {
+        /* big allocations get a chunk to themselves */
+        /* put it behind the current chunk so the free space in that isn't wasted */
+        if (size > arena->chunk_size / 4 && chunk) {
+            chunk = arena_chunk_new(size);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk = arena_chunk_new(size > arena->chunk_size ? size : arena->chunk_size);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+
+    ptr = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    arena->allocated += size;
+
+    return ptr;
+}
+
+
+/* allocate zeroed memory */
+void *arena_calloc(struct arena *arena, size_t size) {
+    void *ptr = arena_alloc(arena, size);
+
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+
+    return ptr;
+}
+
+
+char *arena_strdup(struct arena *arena, const char *s) {
+    return arena_memdup(arena, s, strlen(s) + 1);
+}
+
+
+/* copy at most n characters of a string, always NUL terminated */
+char *arena_strndup(struct arena *arena, const char *s, size_t n) {
+    size_t len = strnlen(s, n);
+    char *copy = arena_alloc(arena, len + 1);
+
+    if (copy) {
+        memcpy(copy, s, len);
+        copy[len] = '\0';
+    }
+
+    return copy;
+}
+
+
+void *arena_memdup(struct arena *arena, const void *src, size_t size) {
+    void *copy = arena_alloc(arena, size);
+
+    if (copy) {
+        memcpy(copy, src, size);
+    }
+
+    return copy;
+}
+
+
+/* free everything that was allocated but keep the first chunk for reuse */
+void arena_reset(struct arena *arena) {
+    struct arena_chunk *chunk, *next;
+
+    if (arena->chunks == NULL) {
+        return;
+    }
+
+    /* keep the last chunk in the list, that's the first one that was allocated */
+    /* it's regular sized unless the first allocation was huge */
+    chunk = arena->chunks;
+    while (chunk->next) {
+        next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    if (chunk->size != arena->chunk_size) {
+        free(chunk);
+        chunk = NULL;
+    } else {
+        chunk->used = 0;
+    }
+
+    arena->chunks = chunk;
+    arena->allocated = 0;
+}
+
+
+/* free the arena and everything allocated from it */
+struct arena *arena_free(struct arena *arena) {
+    if (arena) {
+        arena_reset(arena);
+        free(arena->chunks);
+        free(arena);
+    }
+
+    return NULL;
+}
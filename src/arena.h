@@ -0,0 +1,44 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+/* the strictest alignment of the basic types, max_align_t is C11 */
+union arena_align {
+    long long ll;
+    long double ld;
+    double d;
+    void *p;
+};
+
+/* a block of memory that allocations are carved out of */
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    size_t used;
+    /* aligned for any type */
+    union arena_align data[];
+};
+
+/* bump allocator for lots of small objects that all get freed at the same time */
+/* there is no way to free a single allocation, reset or free the whole arena instead */
+/* not thread safe */
+struct arena {
+    /* the chunk currently being allocated from is first */
+    struct arena_chunk *chunks;
+    /* size of new chunks in bytes */
+    size_t chunk_size;
+    /* total bytes handed out, for debugging */
+    size_t allocated;
+};
+
+struct arena *arena_new(size_t);
+void *arena_alloc(struct arena *, size_t);
+void *arena_calloc(struct arena *, size_t);
+char *arena_strdup(struct arena *, const char *);
+char *arena_strndup(struct arena *, const char *, size_t);
+void *arena_memdup(struct arena *, const void *, size_t);
+void arena_reset(struct arena *);
+struct arena *arena_free(struct arena *);
+
+#endif /* ARENA_H */
@@ -1,25 +1,77 @@
 #include "nfsping.h"
 #include "rpc.h"
 #include "util.h"
+#include "crc32c.h"
+#include "fhdb.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/* a server's queue of files when reading in parallel */
+struct cat_server {
+    targets_t *target;
+    /* the next file to read from this server */
+    nfs_fh_list *next;
+    /* number of files currently being read, limited by the size of the target's connection pool */
+    unsigned int active;
+};
+
+/* shared state for all of the threads reading files in parallel */
+struct cat_job {
+    pthread_mutex_t lock;
+    /* signalled when a file finishes and a server might have a free slot */
+    pthread_cond_t done;
+    struct cat_server *servers;
+    unsigned int server_count;
+    /* servers are picked round robin so one server's files don't starve the others */
+    unsigned int next_server;
+    /* maximum number of files to read from each server at once */
+    unsigned int limit;
+    unsigned long blocksize;
+    struct timeval timeout;
+    /* time between requests for each file, zero to go as fast as possible */
+    struct timespec sleep_time;
+    /* directory to write files into */
+    char *output;
+    int checksum;
+    /* progress */
+    unsigned long files;
+    unsigned long files_done;
+    unsigned long errors;
+    unsigned long long bytes;
+    unsigned int running;
+};
 
 /* local prototypes */
 static void usage(void);
-static READ3res *do_read(CLIENT *, nfs_fh_list *, offset3, const unsigned long, unsigned long *);
+static int do_read(CLIENT *, char *, nfs_fh_list *, offset3, const unsigned long, struct timeval, READ3res *, unsigned long *);
+static void checksum_block(struct crc32c_stream *, offset3, READ3res *, unsigned long long *);
+static int unsafe_path(const char *);
+static int open_output(char *, char *, char *);
+static int cat_file(struct cat_job *, targets_t *, nfs_fh_list *);
+static void *cat_worker(void *);
+static int cat_parallel(targets_t *, struct addrinfo *, struct sockaddr_in, unsigned int, struct cat_job *);
 static void print_output(enum outputs format, char *prefix, char* host, char* path, count3 count, unsigned long min, unsigned long max, double avg, unsigned long sent, unsigned long received,  const struct timespec now, unsigned long us);
+static void print_checksum(char *, char *, struct crc32c_stream *, unsigned long long);
  
 
 /* globals */
+extern volatile sig_atomic_t quitting;
 int verbose = 0;
 
 void usage() {
     printf("Usage: nfscat [options]\n\
     -b n      blocksize (in bytes, default 8192)\n\
     -c n      count of read requests to send to target\n\
+    -C        print a CRC32C checksum of each file instead of the contents\n\
     -E        StatsD format output (default human readable)\n\
+    -F file   read filehandles from a database written by nfsmount -w instead of stdin\n\
     -g string prefix for Graphite/StatsD metric names (default \"nfsping\")\n\
     -G        Graphite format output (default human readable)\n\
     -h        display this help and exit\n\
     -H n      frequency in Hertz (requests per second, default %i)\n\
+    -L n      maximum number of files to read from each server at once (default same as -P)\n\
+    -o dir    write each file to its own file under dir\n\
+    -P n      number of files to read in parallel (default 1)\n\
     -S addr   set source address\n\
     -T        use TCP (default UDP)\n\
     -v        verbose output\n",
@@ -31,36 +83,91 @@ void usage() {
 
 /* the NFS READ call */
 /* read a file from offset with a size of blocksize */
-/* returns the RPC result, updates us with the time that the call took */
-READ3res *do_read(CLIENT *client, nfs_fh_list *dir, offset3 offset, const unsigned long blocksize, unsigned long *us) {
-    READ3res *res;
+/* the generated nfsproc3_read_3() returns a static result which isn't thread safe, so call clnt_call() directly */
+/* returns 0 on success and the caller has to xdr_free() the result, updates us with the time that the call took */
+int do_read(CLIENT *client, char *host, nfs_fh_list *dir, offset3 offset, const unsigned long blocksize, struct timeval timeout, READ3res *res, unsigned long *us) {
     READ3args args = {
         .file = dir->nfs_fh,
         .offset = 0,
         .count = blocksize,
     };
     const char *proc = "nfsproc3_read_3";
-    struct rpc_err clnt_err;
+    enum clnt_stat status;
     struct timeval call_start, call_end;
 
     args.offset = offset;
+    memset(res, 0, sizeof(READ3res));
 
     gettimeofday(&call_start, NULL);
-    res = nfsproc3_read_3(&args, client);
+    status = clnt_call(client, NFSPROC3_READ,
+        (xdrproc_t) xdr_READ3args, (caddr_t) &args,
+        (xdrproc_t) xdr_READ3res, (caddr_t) res,
+        timeout);
     gettimeofday(&call_end, NULL);
 
     *us = tv2us(call_end) - tv2us(call_start);
 
-    if (res) {
-        if (res->status != NFS3_OK) {
-            clnt_geterr(client, &clnt_err);
-            clnt_err.re_status ? clnt_perror(client, proc) : nfs_perror(res->status, proc);
+    if (status == RPC_SUCCESS) {
+        if (res->status == NFS3_OK) {
+            return 0;
         }
+
+        fprintf(stderr, "%s:%s: ", host, dir->path);
+        nfs_perror(res->status, proc);
+        xdr_free((xdrproc_t)xdr_READ3res, (char *)res);
     } else {
+        fprintf(stderr, "%s:%s: ", host, dir->path);
         clnt_perror(client, proc);
     }
 
-    return res;
+    return 1;
+}
+
+
+/* checksum a block as it arrives and add it to the file's running checksum */
+/* the stream puts the blocks back in order if they don't arrive sequentially */
+/* adds the time it took to ns */
+void checksum_block(struct crc32c_stream *stream, offset3 offset, READ3res *res, unsigned long long *ns) {
+    struct timespec hash_start, hash_end, hash_elapsed;
+    uint32_t crc;
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &hash_start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &hash_start);
+#endif
+
+    crc = crc32c(0, res->READ3res_u.resok.data.data_val, res->READ3res_u.resok.data.data_len);
+    crc32c_stream_add(stream, offset, res->READ3res_u.resok.data.data_len, crc);
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &hash_end);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &hash_end);
+#endif
+
+    timespecsub(&hash_end, &hash_start, &hash_elapsed);
+    *ns += ts2ns(hash_elapsed);
+}
+
+
+/* print the checksum of a file on stdout, in the same order as cksum: checksum, bytes, name */
+/* and the time spent checksumming on stderr */
+void print_checksum(char *host, char *path, struct crc32c_stream *stream, unsigned long long ns) {
+    printf("%08x %" PRIu64 " %s:%s\n", stream->crc, stream->next, host, path);
+    fflush(stdout);
+
+    if (stream->pending) {
+        fprintf(stderr, "%s:%s: checksum incomplete, missing data after byte %" PRIu64 "\n", host, path, stream->next);
+    }
+
+    fprintf(stderr, "%s:%s: checksummed %" PRIu64 " bytes in %.3f ms (%.2f MB/s, %s)\n",
+        host,
+        path,
+        stream->next,
+        ns / 1000000.0,
+        ns ? (stream->next / 1048576.0) / (ns / 1000000000.0) : 0,
+        crc32c_hardware() ? "sse4.2" : "table");
 }
 
 
@@ -95,15 +202,367 @@ void print_output(enum outputs format, char *prefix, char* host, char* path, cou
 }
 
 
+/* check for ".." components that would climb out of the output directory */
+/* returns 1 if the path can't be used */
+int unsafe_path(const char *path) {
+    const char *component = path;
+
+    while (*component) {
+        if (component[0] == '.' && component[1] == '.' && (component[2] == '/' || component[2] == '\0')) {
+            return 1;
+        }
+        component = strchrnul(component, '/');
+        while (*component == '/') {
+            component++;
+        }
+    }
+
+    return 0;
+}
+
+
+/* open a file under the output directory to write a file into */
+/* creates dir/host/path, including any subdirectories */
+/* returns the file descriptor or -1 on error */
+int open_output(char *output, char *host, char *path) {
+    char outpath[PATH_MAX];
+    char *slash;
+    int fd;
+
+    /* the names come from the server (or whatever made the filehandles) so don't trust them */
+    /* a leading slash is fine since the path always goes under the output directory and host */
+    if (strchr(host, '/') || unsafe_path(host) || unsafe_path(path)) {
+        fprintf(stderr, "%s:%s: refusing to write outside %s\n", host, path, output);
+        return -1;
+    }
+
+    if ((size_t)snprintf(outpath, sizeof(outpath), "%s/%s/%s", output, host, path) >= sizeof(outpath)) {
+        fprintf(stderr, "%s:%s: output path too long\n", host, path);
+        return -1;
+    }
+
+    /* create each directory in turn */
+    /* skip past the output directory, that has to exist already */
+    slash = outpath + strlen(output) + 1;
+    while ((slash = strchr(slash, '/'))) {
+        *slash = '\0';
+        if (mkdir(outpath, 0755) != 0 && errno != EEXIST) {
+            fprintf(stderr, "%s:%s: mkdir %s: %s\n", host, path, outpath, strerror(errno));
+            return -1;
+        }
+        *slash = '/';
+        /* collapse multiple slashes */
+        while (*slash == '/') {
+            slash++;
+        }
+    }
+
+    fd = open(outpath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "%s:%s: %s: %s\n", host, path, outpath, strerror(errno));
+    }
+
+    return fd;
+}
+
+
+/* read a whole file with one connection from the target's pool */
+/* returns 0 if the file was read successfully */
+int cat_file(struct cat_job *job, targets_t *target, nfs_fh_list *filehandle) {
+    CLIENT *client;
+    READ3res res;
+    offset3 offset = 0;
+    unsigned long us;
+    int fd = -1;
+    int eof = 0;
+    int failed = 0;
+    ssize_t written;
+    size_t len;
+    char *data;
+    struct crc32c_stream stream;
+    unsigned long long hash_ns = 0;
+    struct timespec loop_start, loop_end, loop_elapsed, sleepy;
+
+    if (job->output) {
+        fd = open_output(job->output, target->name, filehandle->path);
+        if (fd < 0) {
+            return 1;
+        }
+    }
+
+    client = rpc_pool_get(target->pool);
+    if (client == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
+    }
+
+    crc32c_stream_init(&stream);
+
+    while (eof == 0 && failed == 0 && quitting == 0) {
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &loop_start);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &loop_start);
+#endif
+
+        failed = do_read(client, target->name, filehandle, offset, job->blocksize, job->timeout, &res, &us);
+
+        if (failed) {
+            /* reconnect next time in case it was a broken TCP connection */
+            rpc_pool_put(target->pool, client, 1);
+            client = NULL;
+            break;
+        }
+
+        if (job->checksum) {
+            checksum_block(&stream, offset, &res, &hash_ns);
+        }
+
+        if (fd >= 0) {
+            data = res.READ3res_u.resok.data.data_val;
+            len = res.READ3res_u.resok.data.data_len;
+
+            while (len) {
+                written = write(fd, data, len);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    fprintf(stderr, "%s:%s: write: %s\n", target->name, filehandle->path, strerror(errno));
+                    failed = 1;
+                    break;
+                }
+                data += written;
+                len -= written;
+            }
+        }
+
+        __sync_fetch_and_add(&job->bytes, res.READ3res_u.resok.data.data_len);
+        offset += res.READ3res_u.resok.count;
+        eof = res.READ3res_u.resok.eof;
+
+        xdr_free((xdrproc_t)xdr_READ3res, (char *)&res);
+
+        /* only rate limit if a frequency was asked for */
+        if (eof == 0 && (job->sleep_time.tv_sec || job->sleep_time.tv_nsec)) {
+#ifdef CLOCK_MONOTONIC_RAW
+            clock_gettime(CLOCK_MONOTONIC_RAW, &loop_end);
+#else
+            clock_gettime(CLOCK_MONOTONIC, &loop_end);
+#endif
+            timespecsub(&loop_end, &loop_start, &loop_elapsed);
+            if (timespeccmp(&loop_elapsed, &job->sleep_time, <)) {
+                timespecsub(&job->sleep_time, &loop_elapsed, &sleepy);
+                nanosleep(&sleepy, NULL);
+            }
+        }
+    }
+
+    if (client) {
+        rpc_pool_put(target->pool, client, 0);
+    }
+
+    if (fd >= 0 && close(fd) != 0) {
+        fprintf(stderr, "%s:%s: close: %s\n", target->name, filehandle->path, strerror(errno));
+        failed = 1;
+    }
+
+    if (job->checksum) {
+        /* don't let the lines from different threads get mixed up */
+        pthread_mutex_lock(&job->lock);
+        print_checksum(target->name, filehandle->path, &stream, hash_ns);
+        pthread_mutex_unlock(&job->lock);
+        crc32c_stream_free(&stream);
+    }
+
+    return failed || eof == 0;
+}
+
+
+/* thread that keeps reading files until there are none left */
+/* picks the next server that has files waiting and isn't already at its limit */
+void *cat_worker(void *arg) {
+    struct cat_job *job = arg;
+    struct cat_server *server;
+    nfs_fh_list *filehandle;
+    unsigned int i;
+    int waiting;
+
+    pthread_mutex_lock(&job->lock);
+
+    while (quitting == 0) {
+        server = NULL;
+        waiting = 0;
+
+        for (i = 0; i < job->server_count; i++) {
+            struct cat_server *candidate = &job->servers[(job->next_server + i) % job->server_count];
+
+            if (candidate->next) {
+                waiting = 1;
+
+                if (candidate->active < job->limit) {
+                    server = candidate;
+                    job->next_server = (job->next_server + i + 1) % job->server_count;
+                    break;
+                }
+            }
+        }
+
+        if (server == NULL) {
+            /* nothing left to do */
+            if (waiting == 0) {
+                break;
+            }
+
+            /* every server with files left is busy, wait for one to finish */
+            pthread_cond_wait(&job->done, &job->lock);
+            continue;
+        }
+
+        filehandle = server->next;
+        server->next = filehandle->next;
+        server->active++;
+
+        pthread_mutex_unlock(&job->lock);
+
+        i = cat_file(job, server->target, filehandle);
+
+        pthread_mutex_lock(&job->lock);
+
+        server->active--;
+        job->files_done++;
+        job->errors += i;
+        pthread_cond_broadcast(&job->done);
+    }
+
+    job->running--;
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+
+/* read all of the files using a number of threads */
+/* each target gets a connection pool limited to job->limit connections */
+/* returns the number of files that couldn't be read */
+int cat_parallel(targets_t *targets, struct addrinfo *hints, struct sockaddr_in src_ip, unsigned int parallel, struct cat_job *job) {
+    targets_t *current;
+    nfs_fh_list *filehandle;
+    pthread_t *threads;
+    unsigned int i;
+    unsigned long long last_bytes = 0;
+    struct timespec start, now, elapsed, last, interval;
+    /* check for the threads finishing ten times a second, print progress once a second */
+    const struct timespec tick = { 0, 100000000 };
+    double seconds;
+
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    for (current = targets; current; current = current->next) {
+        job->server_count++;
+    }
+
+    job->servers = calloc(job->server_count, sizeof(struct cat_server));
+    threads = calloc(parallel, sizeof(pthread_t));
+    if (job->servers == NULL || threads == NULL) {
+        fatalx(3, "Couldn't allocate memory for threads!\n");
+    }
+
+    for (current = targets, i = 0; current; current = current->next, i++) {
+        current->pool = rpc_pool_new(current->client_sock, hints, NFS_PROGRAM, 3, job->timeout, src_ip, job->limit, 1);
+        job->servers[i].target = current;
+        job->servers[i].next = current->filehandles;
+
+        for (filehandle = current->filehandles; filehandle; filehandle = filehandle->next) {
+            job->files++;
+        }
+    }
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+    last = start;
+
+    job->running = parallel;
+    for (i = 0; i < parallel; i++) {
+        if (pthread_create(&threads[i], NULL, cat_worker, job) != 0) {
+            fatalx(3, "Couldn't create thread!\n");
+        }
+    }
+
+    /* progress report on stderr */
+    while (__sync_fetch_and_add(&job->running, 0)) {
+        nanosleep(&tick, NULL);
+
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+        timespecsub(&now, &last, &interval);
+
+        if (interval.tv_sec >= 1) {
+            unsigned long long bytes = __sync_fetch_and_add(&job->bytes, 0);
+
+            fprintf(stderr, "%lu/%lu files, %llu bytes, %.2f MB/s\n",
+                __sync_fetch_and_add(&job->files_done, 0),
+                job->files,
+                bytes,
+                (bytes - last_bytes) / 1048576.0 / (ts2us(interval) / 1000000.0));
+
+            last_bytes = bytes;
+            last = now;
+        }
+    }
+
+    for (i = 0; i < parallel; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    timespecsub(&now, &start, &elapsed);
+    seconds = ts2us(elapsed) / 1000000.0;
+
+    fprintf(stderr, "%lu/%lu files (%lu errors), %llu bytes in %.3f s = %.2f MB/s\n",
+        job->files_done,
+        job->files,
+        job->errors,
+        job->bytes,
+        seconds,
+        seconds > 0 ? job->bytes / 1048576.0 / seconds : 0);
+
+    for (current = targets; current; current = current->next) {
+        current->pool = rpc_pool_destroy(current->pool);
+    }
+
+    free(threads);
+    free(job->servers);
+    pthread_cond_destroy(&job->done);
+    pthread_mutex_destroy(&job->lock);
+
+    return job->errors + (job->files - job->files_done);
+}
+
+
 int main(int argc, char **argv) {
     int ch;
-    char *input_fh;
-    size_t n = 0; /* for getline() */
     targets_t dummy = { 0 };
     targets_t *targets = &dummy;
     targets_t *current = targets;
     nfs_fh_list *filehandle;
-    READ3res *res;
+    /* read filehandles from a database instead of stdin */
+    char *database = NULL;
+    READ3res res;
+    int failed = 0, eof = 0;
     struct addrinfo hints = {
         .ai_family = AF_INET,
         /* default to UDP */
@@ -116,6 +575,7 @@ int main(int argc, char **argv) {
     struct timespec wall_clock, loop_start, loop_end, loop_elapsed, sleepy;
     struct timespec sleep_time;
     unsigned long hertz = NFS_HERTZ;
+    int hertz_set = 0;
     struct timeval timeout = NFS_TIMEOUT;
     unsigned long us;
     enum outputs format = ping;
@@ -123,13 +583,22 @@ int main(int argc, char **argv) {
     unsigned long sent = 0, received = 0;
     unsigned long min = ULONG_MAX, max = 0;
     double avg = 0;
+    /* checksum the file instead of printing it */
+    int checksum = 0;
+    struct crc32c_stream stream;
+    unsigned long long hash_ns = 0;
+    /* reading files in parallel */
+    unsigned int parallel = 1;
+    struct cat_job job = {
+        .limit = 0,
+    };
     /* source ip address for packets */
     struct sockaddr_in src_ip = {
         .sin_family = AF_INET,
         .sin_addr = 0
     };
 
-    while ((ch = getopt(argc, argv, "b:c:Eg:GhH:S:Tv")) != -1) {
+    while ((ch = getopt(argc, argv, "b:c:CEF:g:GhH:L:o:P:S:Tv")) != -1) {
         switch(ch) {
             /* blocksize */
             case 'b':
@@ -142,10 +611,18 @@ int main(int argc, char **argv) {
                     fatal("Zero count, nothing to do!\n");
                 }
                 break;
+            /* checksum */
+            case 'C':
+                checksum = 1;
+                break;
             /* [E]tsy's StatsD output */
             case 'E':
                 format = statsd;
                 break;
+            /* filehandle database */
+            case 'F':
+                database = optarg;
+                break;
             /* prefix to use for graphite metrics */
             case 'g':
                 /*TODO: Find the real limit of graphite prefix. NAME_MAX 
@@ -166,6 +643,28 @@ int main(int argc, char **argv) {
             case 'H':
                 /* TODO check for reasonable values */
                 hertz = strtoul(optarg, NULL, 10);
+                if (hertz == 0) {
+                    fatal("Invalid frequency!\n");
+                }
+                hertz_set = 1;
+                break;
+            /* per server limit */
+            case 'L':
+                job.limit = strtoul(optarg, NULL, 10);
+                if (job.limit == 0) {
+                    fatal("Need to read at least one file from each server!\n");
+                }
+                break;
+            /* output directory */
+            case 'o':
+                job.output = optarg;
+                break;
+            /* number of files to read at once */
+            case 'P':
+                parallel = strtoul(optarg, NULL, 10);
+                if (parallel == 0) {
+                    fatal("Need to read at least one file at a time!\n");
+                }
                 break;
             /* source ip address for packets */
             case 'S':
@@ -199,34 +698,69 @@ int main(int argc, char **argv) {
         sleep_time.tv_nsec = 1000000000 / hertz;
     }
 
-    /* no arguments, use stdin */
-    while (getline(&input_fh, &n, stdin) != -1) {
-        /* don't allocate space for results */
-        current = parse_fh(targets, input_fh, 0, timeout, 0);
-    }
+    /* no database, use stdin */
+    /* don't allocate space for results */
+    fhdb_load_or_read_fhs(database, targets, 0, timeout, 0);
 
     targets = targets->next;
     current = targets;
 
+    if (parallel > 1 || job.output) {
+        if (count) {
+            fatal("Can't use -c when reading files in parallel!\n");
+        }
+
+        /* file contents from different threads would be mixed together on stdout */
+        if (job.output == NULL && checksum == 0) {
+            fatal("Need an output directory (-o) or checksums (-C) to read files in parallel!\n");
+        }
+
+        job.blocksize = blocksize;
+        job.timeout = timeout;
+        job.checksum = checksum;
+        if (job.limit == 0 || job.limit > parallel) {
+            job.limit = parallel;
+        }
+        /* bulk copies go as fast as possible unless a frequency was given */
+        if (hertz_set) {
+            job.sleep_time = sleep_time;
+        }
+
+        /* listen for ctrl-c */
+        quitting = 0;
+        signal(SIGINT, sigint_handler);
+
+        /* don't quit on (TCP) broken pipes */
+        signal(SIGPIPE, SIG_IGN);
+
+        return cat_parallel(targets, &hints, src_ip, parallel, &job) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     while (current) {
         /* no client connection */
         if (current->client == NULL) {
             /* connect to server */
             current->client = create_rpc_client(current->client_sock, &hints, NFS_PROGRAM, version, timeout, src_ip);
-            /* don't use default AUTH_NONE */
-            auth_destroy(current->client->cl_auth);
-            /* set up AUTH_SYS */
-            current->client->cl_auth = authunix_create_default();
+            if (current->client) {
+                /* don't use default AUTH_NONE */
+                auth_destroy(current->client->cl_auth);
+                /* set up AUTH_SYS */
+                current->client->cl_auth = authunix_create_default();
+            }
         }
 
         if (current->client) {
-            /* start at the beginning of the file */
-            offset = 0;
             sent = received = 0;
 
             filehandle = current->filehandles;
 
             while (filehandle) {
+                /* start at the beginning of the file */
+                offset = 0;
+                eof = 0;
+                crc32c_stream_init(&stream);
+                hash_ns = 0;
+
                 do {
                     /* grab the starting time of each loop */
     #ifdef CLOCK_MONOTONIC_RAW
@@ -239,9 +773,9 @@ int main(int argc, char **argv) {
                     /* the call_start timer is more important so do this first so we're not measuring the time this call takes */
                     clock_gettime(CLOCK_REALTIME, &wall_clock);
 
-                    res = do_read(current->client, filehandle, offset, blocksize, &us);
+                    failed = do_read(current->client, current->name, filehandle, offset, blocksize, timeout, &res, &us);
                     sent++;
-                    if (res && res->status == NFS3_OK) {
+                    if (failed == 0) {
                         received++;
                         /* TODO the final read could be short and take less time, discard? */
                         /* what about files that come back in a single RPC? */
@@ -250,16 +784,23 @@ int main(int argc, char **argv) {
                         /* calculate the average time */
                         avg = (avg * (received - 1) + us) / received;
 
+                        if (checksum) {
+                            checksum_block(&stream, offset, &res, &hash_ns);
+                        }
+
                         if (count) {
 
-                            print_output(format, prefix, current->name, filehandle->path, res->READ3res_u.resok.count, min, max, avg, sent, received, wall_clock, us);
+                            print_output(format, prefix, current->name, filehandle->path, res.READ3res_u.resok.count, min, max, avg, sent, received, wall_clock, us);
 
-                        } else {
+                        } else if (checksum == 0) {
                             /* write to stdout */
-                            fwrite(res->READ3res_u.resok.data.data_val, 1, res->READ3res_u.resok.data.data_len, stdout);
+                            fwrite(res.READ3res_u.resok.data.data_val, 1, res.READ3res_u.resok.data.data_len, stdout);
                         }
 
-                        offset += res->READ3res_u.resok.count;
+                        offset += res.READ3res_u.resok.count;
+                        eof = res.READ3res_u.resok.eof;
+
+                        xdr_free((xdrproc_t)xdr_READ3res, (char *)&res);
                     }
                     /* check count argument */
                     if (count && sent >= count) {
@@ -285,7 +826,12 @@ int main(int argc, char **argv) {
                         }
                     }
                 /* check for errors or end of file */
-                } while (res && res->status == NFS3_OK && res->READ3res_u.resok.eof == 0);
+                } while (failed == 0 && eof == 0);
+
+                if (checksum) {
+                    print_checksum(current->name, filehandle->path, &stream, hash_ns);
+                    crc32c_stream_free(&stream);
+                }
 
                 filehandle = filehandle->next;
             } /* while (filehandle) */
@@ -0,0 +1,256 @@
+/* CRC32C (Castagnoli) checksums of file data */
+/* uses the SSE4.2 crc32 instruction where the CPU has it, otherwise a slicing-by-8 table */
+
+#include "nfsping.h"
+#include "crc32c.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+/* reversed Castagnoli polynomial */
+#define POLY 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*crc32c_update)(uint32_t, const unsigned char *, size_t);
+
+static uint32_t crc32c_sw(uint32_t, const unsigned char *, size_t);
+static void crc32c_init(void);
+static uint32_t gf2_matrix_times(const uint32_t *, uint32_t);
+static void gf2_matrix_square(uint32_t *, const uint32_t *);
+
+
+/* slicing-by-8, handles 8 bytes per loop with eight table lookups */
+static uint32_t crc32c_sw(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t word;
+
+    /* align to 8 bytes */
+    while (len && ((uintptr_t)buf & 7)) {
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8) {
+        memcpy(&word, buf, sizeof(word));
+        /* the tables assume little endian byte order */
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        word = __builtin_bswap64(word);
+#endif
+        word ^= crc;
+        crc = crc32c_table[7][word & 0xff] ^
+              crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^
+              crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^
+              crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^
+              crc32c_table[0][word >> 56];
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        crc = crc32c_table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+
+#if defined(__x86_64__)
+/* SSE4.2 crc32 instruction, 8 bytes at a time */
+/* only called if the CPU supports it, the rest of the file is compiled for the baseline architecture */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t crc64, word;
+
+    while (len && ((uintptr_t)buf & 7)) {
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+        len--;
+    }
+
+    crc64 = crc;
+    while (len >= 8) {
+        memcpy(&word, buf, sizeof(word));
+        crc64 = __builtin_ia32_crc32di(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+    crc = crc64;
+
+    while (len--) {
+        crc = __builtin_ia32_crc32qi(crc, *buf++);
+    }
+
+    return crc;
+}
+#endif
+
+
+/* build the lookup tables and pick an implementation */
+static void crc32c_init(void) {
+    uint32_t crc;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        crc32c_table[0][i] = crc;
+    }
+
+    for (i = 0; i < 256; i++) {
+        crc = crc32c_table[0][i];
+        for (j = 1; j < 8; j++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[j][i] = crc;
+        }
+    }
+
+    crc32c_update = crc32c_sw;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc32c_update = crc32c_hw;
+    }
+#endif
+}
+
+
+/* returns 1 if checksums are calculated with the CPU's crc32 instruction */
+int crc32c_hardware(void) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return crc32c_update != crc32c_sw;
+}
+
+
+/* update a checksum with len bytes from buf, start with crc = 0 */
+/* the same convention as zlib's crc32() so the result can be passed back in to continue a running checksum */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_once, crc32c_init);
+    return ~crc32c_update(~crc, buf, len);
+}
+
+
+/* GF(2) matrix helpers for crc32c_combine, from zlib */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+
+    while (vec) {
+        if (vec & 1)
+            sum ^= *mat;
+        vec >>= 1;
+        mat++;
+    }
+
+    return sum;
+}
+
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    int n;
+
+    for (n = 0; n < 32; n++)
+        square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+
+/* return the checksum of two concatenated blocks given each block's checksum and the length of the second block */
+/* this is what lets blocks be checksummed as they arrive and then be stitched together in file order */
+uint32_t crc32c_combine(uint32_t crc1, uint32_t crc2, uint64_t len2) {
+    uint32_t even[32]; /* even-power-of-two zeros operator */
+    uint32_t odd[32];  /* odd-power-of-two zeros operator */
+    uint32_t row;
+    int n;
+
+    if (len2 == 0)
+        return crc1;
+
+    /* operator for one zero bit */
+    odd[0] = POLY;
+    row = 1;
+    for (n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    /* two zero bits */
+    gf2_matrix_square(even, odd);
+    /* four zero bits */
+    gf2_matrix_square(odd, even);
+
+    /* apply len2 zeros to crc1 (the first square puts the operator for one zero byte, eight zero bits, in even) */
+    do {
+        gf2_matrix_square(even, odd);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(even, crc1);
+        len2 >>= 1;
+
+        if (len2 == 0)
+            break;
+
+        gf2_matrix_square(odd, even);
+        if (len2 & 1)
+            crc1 = gf2_matrix_times(odd, crc1);
+        len2 >>= 1;
+    } while (len2);
+
+    return crc1 ^ crc2;
+}
+
+
+void crc32c_stream_init(struct crc32c_stream *stream) {
+    stream->crc = 0;
+    stream->next = 0;
+    stream->pending = NULL;
+}
+
+
+/* add the checksum of the block at offset to the running checksum */
+/* blocks that arrive before the data in front of them are held until the gap is filled */
+void crc32c_stream_add(struct crc32c_stream *stream, uint64_t offset, uint64_t len, uint32_t crc) {
+    struct crc32c_block *block, **prev;
+
+    if (offset == stream->next) {
+        stream->crc = crc32c_combine(stream->crc, crc, len);
+        stream->next += len;
+
+        /* see if this filled a gap */
+        while (stream->pending && stream->pending->offset == stream->next) {
+            block = stream->pending;
+            stream->crc = crc32c_combine(stream->crc, block->crc, block->len);
+            stream->next += block->len;
+            stream->pending = block->next;
+            free(block);
+        }
+    } else {
+        block = malloc(sizeof(struct crc32c_block));
+        if (block == NULL) {
+            fatalx(3, "Couldn't allocate memory for checksum!\n");
+        }
+        block->offset = offset;
+        block->len = len;
+        block->crc = crc;
+
+        /* keep the list sorted, usually there's only a few blocks waiting */
+        prev = &stream->pending;
+        while (*prev && (*prev)->offset < offset) {
+            prev = &(*prev)->next;
+        }
+        block->next = *prev;
+        *prev = block;
+    }
+}
+
+
+/* throw away any blocks still waiting, ie after a read error left a gap */
+void crc32c_stream_free(struct crc32c_stream *stream) {
+    struct crc32c_block *block;
+
+    while (stream->pending) {
+        block = stream->pending;
+        stream->pending = block->next;
+        free(block);
+    }
+}
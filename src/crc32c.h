@@ -0,0 +1,32 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* a block checksum that arrived ahead of the blocks before it */
+struct crc32c_block {
+    uint64_t offset;
+    uint64_t len;
+    uint32_t crc;
+    struct crc32c_block *next;
+};
+
+/* running checksum of a file assembled from blocks that can arrive in any order */
+/* not locked, callers that share one between threads need to serialise crc32c_stream_add() */
+struct crc32c_stream {
+    uint32_t crc;
+    /* the checksum covers bytes [0, next) */
+    uint64_t next;
+    /* out of order blocks, sorted by offset */
+    struct crc32c_block *pending;
+};
+
+uint32_t crc32c(uint32_t, const void *, size_t);
+uint32_t crc32c_combine(uint32_t, uint32_t, uint64_t);
+int crc32c_hardware(void);
+void crc32c_stream_init(struct crc32c_stream *);
+void crc32c_stream_add(struct crc32c_stream *, uint64_t, uint64_t, uint32_t);
+void crc32c_stream_free(struct crc32c_stream *);
+
+#endif /* CRC32C_H */
@@ -6,6 +6,8 @@
 #include "rpc.h"
 #include "util.h"
 #include "human.h"
+#include "fhdb.h"
+#include "serve.h"
 #include <sys/ioctl.h> /* for checking terminal size */
 
 
@@ -38,9 +40,92 @@ static const char *header_label[] = {
 /* let's assume 32 bits is enough for now to keep formatting under control until we see >4 billion inode filesystems in the wild */
 static const int max_inode_width = 10;
 
+/* one row of output, a single filesystem on a target */
+struct df_row {
+    targets_t *target;
+    nfs_fh_list *fh;
+    /* the result is only valid if status is RPC_SUCCESS */
+    enum clnt_stat status;
+    FSSTAT3res res;
+    unsigned long usec;
+    /* when the request was sent, for graphite timestamps */
+    struct timespec wall_clock;
+    /* set by the worker once the reply has arrived or the call has timed out */
+    int done;
+    /* start of the graphite metric names, "prefix.host.df.path" */
+    char *metric;
+    /* when the request was sent, for working out rates */
+    struct timespec sent;
+    /* for only printing changes, the values that were printed last time */
+    int printed;
+    size3 last_fbytes;
+    size3 last_ffiles;
+    struct timespec last_sent;
+    /* how fast the filesystem is filling up since the last printed values, negative if it's emptying */
+    double bytes_rate;
+    double files_rate;
+    /* the last successful result and its response time for -W, protected by metrics_lock */
+    int valid;
+    FSSTAT3resok last;
+    unsigned long last_usec;
+};
+
+/* a filesystem's results copied for a scrape, so the main loop only waits while they're copied */
+struct df_metrics {
+    const struct df_row *row;
+    unsigned long sent;
+    unsigned long received;
+    int valid;
+    FSSTAT3resok last;
+    unsigned long last_usec;
+    /* formatted label pairs for every line */
+    char *labels;
+    /* a copy of the target's histogram and its labels, only in the first row for each target */
+    struct hdr_histogram *histogram;
+    char *target_labels;
+};
+
+/* rows for filesystems on the same target that are sent together */
+/* with NFSv3 each batch is a single FSSTAT, with NFSv4 it's a COMPOUND of PUTFH+GETATTR pairs */
+struct df_batch {
+    unsigned int first;
+    unsigned int count;
+    /* the COMPOUND ops, these don't change so they're only built once */
+    nfs_argop4 *ops;
+    /* the most filesystems to send in one COMPOUND, lowered if the server runs out of resources */
+    unsigned int limit;
+};
+
+/* shared state for the threads sending all of the FSSTATs in a round */
+struct df_round {
+    pthread_mutex_t lock;
+    /* signalled when a row is done */
+    pthread_cond_t done;
+    struct df_row *rows;
+    unsigned int count;
+    struct df_batch *batches;
+    unsigned int batch_count;
+    /* the next batch to send */
+    unsigned int next;
+    /* deadline for each call */
+    struct timeval timeout;
+};
+
+/* the NFSv4 attributes that match the FSSTAT results */
+static uint32_t df_attrs[] = {
+    1 << FATTR4_FILES_AVAIL | 1 << FATTR4_FILES_FREE | 1 << FATTR4_FILES_TOTAL,
+    1 << (FATTR4_SPACE_AVAIL - 32) | 1 << (FATTR4_SPACE_FREE - 32) | 1 << (FATTR4_SPACE_TOTAL - 32),
+};
+
+/* NFSv4.0 doesn't have a way to ask the server for its maximum request size */
+/* so keep each COMPOUND and its reply under a size that any server should accept */
+static const unsigned int max_compound = 32768;
+
 /* globals */
 extern volatile sig_atomic_t quitting;
 int verbose = 0;
+/* the -W thread reads the counters, last results and histograms while the main loop updates them */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* global config "object" */
 static struct config {
@@ -52,6 +137,16 @@ static struct config {
     int inodes;
     int display_ips;
     int one_header;
+    unsigned int threads;
+    unsigned long version;
+    /* only print filesystems that have changed */
+    int changes;
+    /* seconds between printing filesystems that haven't changed, 0 = never */
+    unsigned long heartbeat;
+    /* read filehandles from a database instead of stdin */
+    char *database;
+    /* address and port for serving metrics over HTTP */
+    char *metrics_listen;
 } cfg;
 
 /* default config */
@@ -65,17 +160,32 @@ const struct config CONFIG_DEFAULT = {
     .inodes = 0,
     .display_ips = 0,
     .one_header = 0,
+    .threads = 256,
+    .version = 3,
+    .changes = 0,
+    .heartbeat = 0,
+    .database = NULL,
+    .metrics_listen = NULL,
 };
 
 
 /* local prototypes */
 static void usage(void);
-static FSSTAT3res *get_fsstat(CLIENT *, const char *, nfs_fh_list *);
+static enum clnt_stat get_fsstat(CLIENT *, const char *, nfs_fh_list *, struct timeval, FSSTAT3res *);
+static int fattr4_to_fsstat(fattr4 *, FSSTAT3res *);
+static enum clnt_stat get_compound(CLIENT *, struct timeval, struct df_row *, struct df_batch *);
+static void make_batches(struct df_round *);
+static void *df_worker(void *);
+static int df_changed(struct df_row *, const unsigned long);
+static double time_to_full(const struct df_row *);
+static void format_rates(const struct df_row *, const enum byte_prefix, char *, size_t);
 static void print_header(int, int, enum byte_prefix);
-static int print_df(int, char *, char *, FSSTAT3res *, const enum byte_prefix, const unsigned long);
-static void print_inodes(int, char *, char *, FSSTAT3res *, const unsigned long);
-static char *replace_char(const char *, const char *, const char *);
-static void print_format(enum outputs, char *, char *, char *, FSSTAT3res *, const unsigned long, const struct timespec);
+static int print_df(int, char *, char *, FSSTAT3res *, const enum byte_prefix, const unsigned long, const char *);
+static void print_inodes(int, char *, char *, FSSTAT3res *, const unsigned long, const char *);
+static char *metric_base(const char *, const char *, const char *);
+static void print_format(enum outputs, const struct df_row *, char *, size_t);
+static void free_snapshot(struct df_metrics *, unsigned int);
+static void serve_metrics(FILE *, void *);
 
 
 void usage() {
@@ -85,13 +195,14 @@ void usage() {
        -p for petabytes, but that is already used for the graphite prefix
        -g is already used for gigabytes so can't use that for graphite prefix
        -P for the port number (the filehandle comes from nfsmount which doesn't know which port NFS is listening on)
-       -V for NFS version
        -J for JSON output
      */
     printf("Usage: nfsdf [options]\n\
     -A         show IP addresses\n\
     -b         display sizes in bytes\n\
     -c n       count of requests to send for each filehandle\n\
+    -d n       only display filesystems that have changed, and unchanged ones every n seconds (0 = never)\n\
+    -F file    read filehandles from a database written by nfsmount -w instead of stdin\n\
     -g         display sizes in gigabytes\n\
     -G         Graphite format output (default human readable)\n\
     -h         display human readable sizes (default)\n\
@@ -103,37 +214,389 @@ void usage() {
     -n         only display the header once\n\
     -M         use the portmapper (default: %i)\n\
     -p string  prefix for graphite metric names\n\
+    -P n       number of requests to send in parallel (default %u)\n\
     -S addr    set source address\n\
     -t         display sizes in terabytes\n\
     -T         use TCP (default UDP)\n\
-    -v         verbose output\n",
-    NFS_HERTZ, NFS_PORT);
+    -v         verbose output\n\
+    -V n       NFS version (3 or 4, default 3)\n\
+    -W addr    serve Prometheus metrics over HTTP on [address:]port (implies -l without -c)\n",
+    NFS_HERTZ, NFS_PORT, CONFIG_DEFAULT.threads);
 
     exit(3);
 }
 
 
-FSSTAT3res *get_fsstat(CLIENT *client, const char *host, nfs_fh_list *fs) {
+/* the generated nfsproc3_fsstat_3() returns a static result which isn't thread safe, so call clnt_call() directly */
+/* returns the RPC status, if it's RPC_SUCCESS the caller has to xdr_free() the result */
+enum clnt_stat get_fsstat(CLIENT *client, const char *host, nfs_fh_list *fs, struct timeval timeout, FSSTAT3res *fsstatres) {
     FSSTAT3args fsstatarg = {
         .fsroot = fs->nfs_fh
     };
     const char *proc = "nfsproc3_fsstat_3";
-    struct rpc_err clnt_err;
+    enum clnt_stat status;
+
+    memset(fsstatres, 0, sizeof(FSSTAT3res));
 
-    FSSTAT3res *fsstatres = nfsproc3_fsstat_3(&fsstatarg, client);
+    status = clnt_call(client, NFSPROC3_FSSTAT,
+        (xdrproc_t) xdr_FSSTAT3args, (caddr_t) &fsstatarg,
+        (xdrproc_t) xdr_FSSTAT3res, (caddr_t) fsstatres,
+        timeout);
 
-    if (fsstatres) {
+    if (status == RPC_SUCCESS) {
         if (fsstatres->status != NFS3_OK) {
             fprintf(stderr, "%s:%s ", host, fs->path);
-            clnt_geterr(client, &clnt_err);
-            clnt_err.re_status ? clnt_perror(client, proc) : nfs_perror(fsstatres->status, proc);
+            nfs_perror(fsstatres->status, proc);
         }
     } else {
         fprintf(stderr, "%s:%s ", host, fs->path);
         clnt_perror(client, proc);
     }
 
-    return fsstatres;
+    return status;
+}
+
+
+/* turn the attributes from an NFSv4 GETATTR into an FSSTAT result so they can be printed the same way */
+/* the values are encoded in the order of their attribute numbers, and only the ones the server supports are included */
+int fattr4_to_fsstat(fattr4 *attrs, FSSTAT3res *fsstatres) {
+    FSSTAT3resok *resok = &fsstatres->FSSTAT3res_u.resok;
+    const struct {
+        unsigned int attr;
+        size3 *value;
+    } fields[] = {
+        { FATTR4_FILES_AVAIL, &resok->afiles },
+        { FATTR4_FILES_FREE,  &resok->ffiles },
+        { FATTR4_FILES_TOTAL, &resok->tfiles },
+        { FATTR4_SPACE_AVAIL, &resok->abytes },
+        { FATTR4_SPACE_FREE,  &resok->fbytes },
+        { FATTR4_SPACE_TOTAL, &resok->tbytes },
+    };
+    unsigned int i, word;
+    uint64_t value;
+    XDR xdr;
+    int ok = 1;
+
+    memset(fsstatres, 0, sizeof(FSSTAT3res));
+    xdrmem_create(&xdr, attrs->attr_vals.attrlist4_val, attrs->attr_vals.attrlist4_len, XDR_DECODE);
+
+    for (i = 0; i < sizeof(fields) / sizeof(fields[0]); i++) {
+        word = fields[i].attr / 32;
+        if (word < attrs->attrmask.bitmap4_len && attrs->attrmask.bitmap4_val[word] & (1 << (fields[i].attr % 32))) {
+            if (xdr_uint64_t(&xdr, &value)) {
+                *fields[i].value = value;
+            } else {
+                ok = 0;
+                break;
+            }
+        }
+    }
+
+    xdr_destroy(&xdr);
+
+    fsstatres->status = ok ? NFS3_OK : NFS3ERR_IO;
+
+    return ok;
+}
+
+
+/* send the filesystems in a batch as NFSv4 COMPOUNDs of PUTFH+GETATTR pairs */
+/* the server stops at the first op that fails, so anything after that is sent again in another COMPOUND */
+/* returns the status of the last RPC, if it failed all of the rows that hadn't been sent get that status */
+enum clnt_stat get_compound(CLIENT *client, struct timeval timeout, struct df_row *rows, struct df_batch *batch) {
+    const char *proc = "nfsproc4_compound_4";
+    COMPOUND4args args = { 0 };
+    COMPOUND4res res;
+    nfs_resop4 *resop;
+    struct df_row *row;
+    enum clnt_stat status = RPC_SUCCESS;
+    unsigned int sent = 0;
+    unsigned int count, failed, i;
+
+    while (sent < batch->count) {
+        count = batch->count - sent < batch->limit ? batch->count - sent : batch->limit;
+        args.argarray.argarray_len = 2 * count;
+        args.argarray.argarray_val = &batch->ops[2 * sent];
+
+        memset(&res, 0, sizeof(res));
+        debug("nfsproc4_compound_4(%s, %u filesystems)\n", rows[sent].target->name, count);
+        status = clnt_call(client, NFSPROC4_COMPOUND,
+            (xdrproc_t) xdr_COMPOUND4args, (caddr_t) &args,
+            (xdrproc_t) xdr_COMPOUND4res, (caddr_t) &res,
+            timeout);
+
+        if (status != RPC_SUCCESS) {
+            fprintf(stderr, "%s: ", rows[sent].target->name);
+            clnt_perror(client, proc);
+            for (i = sent; i < batch->count; i++) {
+                rows[i].status = status;
+            }
+            return status;
+        }
+
+        /* each filesystem is a pair of results */
+        for (i = 0; i < res.resarray.resarray_len; i++) {
+            resop = &res.resarray.resarray_val[i];
+            row = &rows[sent + i / 2];
+            row->status = RPC_SUCCESS;
+
+            if (resop->resop == OP_GETATTR && resop->nfs_resop4_u.opgetattr.status == NFS4_OK) {
+                if (fattr4_to_fsstat(&resop->nfs_resop4_u.opgetattr.GETATTR4res_u.resok4.obj_attributes, &row->res) == 0) {
+                    fprintf(stderr, "%s:%s %s: Can't decode attributes\n", row->target->name, row->fh->path, proc);
+                }
+            }
+        }
+
+        if (res.status == NFS4_OK) {
+            sent += count;
+        } else {
+            /* the last result is the one that failed */
+            failed = res.resarray.resarray_len ? (res.resarray.resarray_len - 1) / 2 : 0;
+
+            /* too many ops for the server, send smaller COMPOUNDs from now on */
+            if (res.status == NFS4ERR_RESOURCE && failed > 0) {
+                debug("%s: NFS4ERR_RESOURCE after %u filesystems\n", rows[sent].target->name, failed);
+                batch->limit = failed;
+            /* not even the first one fit, so there's nothing to go on, halve it and try the same filesystems again */
+            } else if (res.status == NFS4ERR_RESOURCE && count > 1) {
+                debug("%s: NFS4ERR_RESOURCE with %u filesystems\n", rows[sent].target->name, count);
+                batch->limit = count / 2;
+            } else {
+                row = &rows[sent + failed];
+                fprintf(stderr, "%s:%s %s: NFS4 error %i\n", row->target->name, row->fh->path, proc, res.status);
+                /* NFSv4 errors under 10000 are the same as NFSv3 */
+                row->res.status = res.status < 10000 ? (nfsstat3)res.status : NFS3ERR_SERVERFAULT;
+                failed++;
+            }
+
+            sent += failed;
+        }
+
+        xdr_free((xdrproc_t)xdr_COMPOUND4res, (char *)&res);
+    }
+
+    return status;
+}
+
+
+/* split the rows into batches to send in each request */
+/* with NFSv4 consecutive filesystems on the same target go in the same COMPOUND until it gets to the maximum size */
+void make_batches(struct df_round *round) {
+    /* tag length, minor version and number of ops */
+    const unsigned int header = 12;
+    /* the reply to PUTFH+GETATTR: op numbers, statuses, a two word bitmap, the attribute length and six 64 bit values */
+    const unsigned int reply = 4 + 4 + 4 + 4 + 12 + 4 + 6 * 8;
+    struct df_batch *batch = NULL;
+    struct df_row *row;
+    nfs_argop4 *op;
+    unsigned int size = 0;
+    unsigned int request;
+    unsigned int i;
+
+    round->batches = calloc(round->count, sizeof(struct df_batch));
+    if (round->batches == NULL) {
+        fatalx(3, "Couldn't allocate memory for batches!\n");
+    }
+    round->batch_count = 0;
+
+    for (i = 0; i < round->count; i++) {
+        row = &round->rows[i];
+        /* PUTFH and GETATTR op numbers, the filehandle padded to four bytes, and the two word bitmap */
+        request = 4 + 4 + ((row->fh->nfs_fh.data.data_len + 3) & ~3) + 4 + 12;
+
+        if (batch == NULL || cfg.version != 4 || row->target != round->rows[batch->first].target ||
+            size + (request > reply ? request : reply) > max_compound) {
+            batch = &round->batches[round->batch_count++];
+            batch->first = i;
+            batch->count = 0;
+            size = header;
+        }
+
+        batch->count++;
+        size += request > reply ? request : reply;
+    }
+
+    if (cfg.version == 4) {
+        for (i = 0; i < round->batch_count; i++) {
+            batch = &round->batches[i];
+            batch->limit = batch->count;
+            batch->ops = calloc(2 * batch->count, sizeof(nfs_argop4));
+            if (batch->ops == NULL) {
+                fatalx(3, "Couldn't allocate memory for COMPOUNDs!\n");
+            }
+            for (op = batch->ops, row = &round->rows[batch->first]; op < batch->ops + 2 * batch->count; row++) {
+                op->argop = OP_PUTFH;
+                op->nfs_argop4_u.opputfh.object.nfs_fh4_len = row->fh->nfs_fh.data.data_len;
+                op->nfs_argop4_u.opputfh.object.nfs_fh4_val = row->fh->nfs_fh.data.data_val;
+                op++;
+                op->argop = OP_GETATTR;
+                op->nfs_argop4_u.opgetattr.attr_request.bitmap4_len = sizeof(df_attrs) / sizeof(df_attrs[0]);
+                op->nfs_argop4_u.opgetattr.attr_request.bitmap4_val = df_attrs;
+                op++;
+            }
+        }
+    }
+}
+
+
+/* thread for sending FSSTATs in parallel */
+/* each thread takes the next row until they've all been sent, so a server that doesn't answer only holds up one thread */
+void *df_worker(void *arg) {
+    struct df_round *round = arg;
+    struct df_batch *batch;
+    struct df_row *row;
+    struct timespec wall_clock, call_start, call_end, call_elapsed;
+    unsigned long usec;
+    enum clnt_stat status;
+    CLIENT *client;
+    unsigned int i, j;
+
+    while ((i = __sync_fetch_and_add(&round->next, 1)) < round->batch_count) {
+        batch = &round->batches[i];
+        row = &round->rows[batch->first];
+
+        /* get the current timestamp */
+        clock_gettime(CLOCK_REALTIME, &wall_clock);
+
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &call_start);
+#endif
+        client = rpc_pool_get(row->target->pool);
+
+        if (client) {
+            if (cfg.version == 4) {
+                status = get_compound(client, round->timeout, row, batch);
+            } else {
+                status = row->status = get_fsstat(client, row->target->name, row->fh, round->timeout, &row->res);
+            }
+            /* reconnect next time in case it was a broken TCP connection */
+            rpc_pool_put(row->target->pool, client, status != RPC_SUCCESS);
+        } else {
+            for (j = 0; j < batch->count; j++) {
+                row[j].status = RPC_CANTSEND;
+            }
+        }
+
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &call_end);
+#endif
+        /* calculate elapsed microseconds */
+        timespecsub(&call_end, &call_start, &call_elapsed);
+        usec = ts2us(call_elapsed);
+
+        /* every filesystem in a batch gets the time for the whole batch */
+        pthread_mutex_lock(&round->lock);
+        for (j = 0; j < batch->count; j++) {
+            row[j].wall_clock = wall_clock;
+            row[j].sent = call_start;
+            row[j].usec = usec;
+            row[j].done = 1;
+        }
+        pthread_cond_signal(&round->done);
+        pthread_mutex_unlock(&round->lock);
+    }
+
+    return NULL;
+}
+
+
+/* in change only mode, check if a filesystem's free space or inodes have changed since they were last printed */
+/* or if it's been longer than the heartbeat, returns 1 if it should be printed */
+/* the rates are worked out over the whole time since the last printed values so quiet filesystems still get a sensible rate */
+int df_changed(struct df_row *row, const unsigned long heartbeat) {
+    FSSTAT3resok *resok = &row->res.FSSTAT3res_u.resok;
+    struct timespec elapsed;
+    double seconds;
+
+    if (row->printed) {
+        timespecsub(&row->sent, &row->last_sent, &elapsed);
+        seconds = elapsed.tv_sec + elapsed.tv_nsec / 1000000000.0;
+
+        if (resok->fbytes == row->last_fbytes && resok->ffiles == row->last_ffiles) {
+            if (heartbeat == 0 || seconds < heartbeat) {
+                return 0;
+            }
+        }
+
+        if (seconds > 0) {
+            /* free space going down means the filesystem is filling up */
+            row->bytes_rate = ((double)row->last_fbytes - resok->fbytes) / seconds;
+            row->files_rate = ((double)row->last_ffiles - resok->ffiles) / seconds;
+        }
+    }
+
+    row->printed = 1;
+    row->last_fbytes = resok->fbytes;
+    row->last_ffiles = resok->ffiles;
+    row->last_sent = row->sent;
+
+    return 1;
+}
+
+
+/* estimate how many seconds until a filesystem runs out of space or inodes at the current rate */
+/* returns a negative number if it isn't filling up */
+double time_to_full(const struct df_row *row) {
+    const FSSTAT3resok *resok = &row->res.FSSTAT3res_u.resok;
+    double seconds = -1;
+    double files;
+
+    if (row->bytes_rate > 0) {
+        seconds = resok->fbytes / row->bytes_rate;
+    }
+
+    if (row->files_rate > 0) {
+        files = resok->ffiles / row->files_rate;
+        if (seconds < 0 || files < seconds) {
+            seconds = files;
+        }
+    }
+
+    return seconds;
+}
+
+
+/* format the rate columns in change only mode */
+/* the bytes/s column uses the same units as the other columns */
+void format_rates(const struct df_row *row, const enum byte_prefix prefix, char *buf, size_t size) {
+    char bytes[max_prefix_width];
+    /* with a sign in front */
+    char signed_bytes[max_prefix_width + 1];
+    char full[16];
+    double seconds = time_to_full(row);
+    /* extra space for gap between columns */
+    int width = prefix_width[prefix] + 1;
+
+    if (prefix == HUMAN) {
+        width += 2;
+    }
+
+    prefix_print(row->bytes_rate < 0 ? -row->bytes_rate : row->bytes_rate, bytes, prefix);
+    if (row->bytes_rate < 0) {
+        snprintf(signed_bytes, sizeof(signed_bytes), "-%s", bytes);
+    } else if (row->bytes_rate > 0) {
+        snprintf(signed_bytes, sizeof(signed_bytes), "+%s", bytes);
+    } else {
+        strcpy(signed_bytes, bytes);
+    }
+
+    if (seconds < 0) {
+        strcpy(full, "-");
+    } else if (seconds < 120) {
+        snprintf(full, sizeof(full), "%.0fs", seconds);
+    } else if (seconds < 2 * 3600) {
+        snprintf(full, sizeof(full), "%.0fm", seconds / 60);
+    } else if (seconds < 2 * 86400) {
+        snprintf(full, sizeof(full), "%.1fh", seconds / 3600);
+    } else {
+        snprintf(full, sizeof(full), "%.1fd", seconds / 86400);
+    }
+
+    snprintf(buf, size, " %*s %10.0f %7s", width + 1, signed_bytes, row->files_rate, full);
 }
 
 
@@ -162,7 +625,7 @@ void print_header(int maxhost, int maxpath, enum byte_prefix prefix) {
 
     if (cfg.format == ping) {
         if (cfg.inodes) {
-            printf("%-*s %*s %*s %*s %%iused    ms\n",
+            printf("%-*s %*s %*s %*s %%iused    ms",
                 maxhost + maxpath + 1, "Filesystem", max_inode_width, "inodes", max_inode_width, "iused", max_inode_width, "ifree");
         } else {
             width = prefix_width[prefix];
@@ -175,7 +638,7 @@ void print_header(int maxhost, int maxpath, enum byte_prefix prefix) {
             }
 
             /* leave enough space for milliseconds */
-            printf("%-*s %*s %*s %*s capacity %*s %*s  %%iused    ms\n",
+            printf("%-*s %*s %*s %*s capacity %*s %*s  %%iused    ms",
                 /* host + export */
                 maxhost + maxpath + 1, "Filesystem",
                 /* size */
@@ -183,6 +646,16 @@ void print_header(int maxhost, int maxpath, enum byte_prefix prefix) {
                 /* inodes */
                 max_inode_width, "iused", max_inode_width, "ifree");
         }
+
+        if (cfg.changes) {
+            width = prefix_width[prefix] + 2;
+            if (prefix == HUMAN) {
+                width += 2;
+            }
+            printf(" %*s %10s %7s", width, "bytes/s", "files/s", "full");
+        }
+
+        printf("\n");
     }
 }
 
@@ -198,7 +671,7 @@ void print_header(int maxhost, int maxpath, enum byte_prefix prefix) {
    Filesystem      Size   Used  Avail Capacity  iused    ifree %iused  Mounted on
    /dev/disk0s2   112Gi   55Gi   57Gi    50% 14570638 14841730   50%   /
  */
-int print_df(int offset, char *host, char *path, FSSTAT3res *fsstatres, const enum byte_prefix prefix, unsigned long usec) {
+int print_df(int offset, char *host, char *path, FSSTAT3res *fsstatres, const enum byte_prefix prefix, unsigned long usec, const char *rates) {
     /* just use static string arrays, they're not big enough to allocate memory dynamically */
     char total[max_prefix_width];
     char used[max_prefix_width];
@@ -233,7 +706,7 @@ int print_df(int offset, char *host, char *path, FSSTAT3res *fsstatres, const en
         /* TODO check usec is less than 100000 (100ms) so column doesn't overflow
          * in that case start losing precision after decimal */
 
-        printf("%s:%-*s %*s %*s %*s %7.0f%% %*" PRIu64 " %*" PRIu64 "  %5.0f%% %#5.2f\n",
+        printf("%s:%-*s %*s %*s %*s %7.0f%% %*" PRIu64 " %*" PRIu64 "  %5.0f%% %#5.2f%s\n",
             host, offset, path,
             width, total, width, used, width, avail, capacity,
             /* calculate number of used inodes */
@@ -241,7 +714,8 @@ int print_df(int offset, char *host, char *path, FSSTAT3res *fsstatres, const en
             max_inode_width, fsstatres->FSSTAT3res_u.resok.ffiles,
             inode_capacity,
             /* RPC call time in milliseconds */
-            usec / 1000.0);
+            usec / 1000.0,
+            rates);
     } else {
         /* get_fsstat will print the rpc error */
         return EXIT_FAILURE;
@@ -262,13 +736,13 @@ int print_df(int offset, char *host, char *path, FSSTAT3res *fsstatres, const en
 
    (Except right justify columns)
  */
-void print_inodes(int offset, char *host, char *path, FSSTAT3res *fsstatres, const unsigned long usec) {
+void print_inodes(int offset, char *host, char *path, FSSTAT3res *fsstatres, const unsigned long usec, const char *rates) {
     double capacity;
 
     /* percent used */
     capacity = (1 - ((double)fsstatres->FSSTAT3res_u.resok.ffiles / fsstatres->FSSTAT3res_u.resok.tfiles)) * 100;
 
-    printf("%s:%-*s %*" PRIu64 " %*" PRIu64 " %*" PRIu64 " %5.0f%% %5.2f\n",
+    printf("%s:%-*s %*" PRIu64 " %*" PRIu64 " %*" PRIu64 " %5.0f%% %5.2f%s\n",
         host,
         offset, path,
         /* total number of inodes on filesystem */
@@ -278,81 +752,232 @@ void print_inodes(int offset, char *host, char *path, FSSTAT3res *fsstatres, con
         /* free inodes */
         max_inode_width, fsstatres->FSSTAT3res_u.resok.ffiles,
         capacity,
-        usec / 1000.0);
+        usec / 1000.0,
+        rates);
 }
 
 
-char *replace_char(const char *str, const char *old, const char *new)
-{
-    char *ret, *r;
-    const char *p, *q;
-    size_t oldlen = strlen(old);
-    size_t count = 0, retlen, newlen = strlen(new);
-    int samesize = (oldlen == newlen);
-
-    if (!samesize) {
-        for (count = 0, p = str; (q = strstr(p, old)) != NULL; p = q + oldlen)
-            count++;
-        /* This is undefined if p - str > PTRDIFF_MAX */
-        retlen = p - str + strlen(p) + count * (newlen - oldlen);
-    } else
-        retlen = strlen(str);
-
-    if ((ret = malloc(retlen + 1)) == NULL)
-        return NULL;
-
-    r = ret, p = str;
-    while (1) {
-        if (!samesize && !count--)
-            break;
-        if ((q = strstr(p, old)) == NULL)
-            break;
-        ptrdiff_t l = q - p;
-        memcpy(r, p, l);
-        r += l;
-        memcpy(r, new, newlen);
-        r += newlen;
-        p = q + oldlen;
+/* make the start of the graphite metric names for a filesystem */
+/* this is only done once at startup since the names don't change between polls */
+char *metric_base(const char *prefix, const char *ndqf, const char *path) {
+    char *metric;
+    size_t len;
+    char *p;
+
+    len = strlen(prefix) + strlen(ndqf) + strlen(path) + strlen("..df.") + 1;
+    metric = malloc(len);
+    if (metric == NULL) {
+        fatalx(3, "Couldn't allocate memory for metric names!\n");
     }
-    strcpy(r, p);
+    p = metric + snprintf(metric, len, "%s.%s.df.", prefix, ndqf);
+
+    /* graphite uses dots as separators so replace them (and anything else that doesn't belong in a metric name) in the path */
+    for (; *path; path++, p++) {
+        switch (*path) {
+            case ' ':
+            case '.':
+            case '-':
+            case '/':
+                *p = '_';
+                break;
+            default:
+                *p = *path;
+        }
+    }
+    *p = '\0';
 
-    return ret;
+    return metric;
 }
 
 /* formatted output ie graphite */
-/* TODO escape dots and spaces (replace with underscores) in paths */
-void print_format(enum outputs format, char *prefix, char *ndqf, char *path, FSSTAT3res *fsstatres, const unsigned long usec, const struct timespec now) {
-    char *bad_characters[] = {
-        " ", ".", "-", "/"
-    };
-    int index = 0;
-    int number_of_chars = sizeof(bad_characters) / sizeof(bad_characters[0]);
-
-    for (index = 0; index < number_of_chars; index++) {
-        path = replace_char(path, bad_characters[index], "_");
-    }
+/* all of the lines for a filesystem are formatted into buf and written at once */
+void print_format(enum outputs format, const struct df_row *row, char *buf, size_t size) {
+    const FSSTAT3resok *resok = &row->res.FSSTAT3res_u.resok;
+    const char *metric = row->metric;
+    const long now = row->wall_clock.tv_sec;
+    double seconds;
+    int len = 0;
 
     /* TODO round seconds up to next whole second? */
     switch (format) {
         case graphite:
-            /* TODO just one printf! */
-            printf("%s.%s.df.%s.tbytes %" PRIu64 " %li\n", prefix, ndqf, path, fsstatres->FSSTAT3res_u.resok.tbytes, now.tv_sec);
-            printf("%s.%s.df.%s.fbytes %" PRIu64 " %li\n", prefix, ndqf, path, fsstatres->FSSTAT3res_u.resok.fbytes, now.tv_sec);
-            printf("%s.%s.df.%s.tfiles %" PRIu64 " %li\n", prefix, ndqf, path, fsstatres->FSSTAT3res_u.resok.tfiles, now.tv_sec);
-            printf("%s.%s.df.%s.ffiles %" PRIu64 " %li\n", prefix, ndqf, path, fsstatres->FSSTAT3res_u.resok.ffiles, now.tv_sec);
-            printf("%s.%s.df.%s.usec %lu %li\n", prefix, ndqf, path, usec, now.tv_sec);
+            len = snprintf(buf, size,
+                "%s.tbytes %" PRIu64 " %li\n"
+                "%s.fbytes %" PRIu64 " %li\n"
+                "%s.tfiles %" PRIu64 " %li\n"
+                "%s.ffiles %" PRIu64 " %li\n"
+                "%s.usec %lu %li\n",
+                metric, resok->tbytes, now,
+                metric, resok->fbytes, now,
+                metric, resok->tfiles, now,
+                metric, resok->ffiles, now,
+                metric, row->usec, now);
+
+            if (cfg.changes && len > 0 && (size_t)len < size) {
+                len += snprintf(buf + len, size - len,
+                    "%s.bytes_rate %.0f %li\n"
+                    "%s.files_rate %.0f %li\n",
+                    metric, row->bytes_rate, now,
+                    metric, row->files_rate, now);
+
+                /* only send the time to full if it's filling up */
+                seconds = time_to_full(row);
+                if (seconds >= 0 && (size_t)len < size) {
+                    len += snprintf(buf + len, size - len, "%s.full_seconds %.0f %li\n", metric, seconds, now);
+                }
+            }
             break;
         default:
             fatal("Unsupported format\n");
     }
+
+    /* the buffer is sized for the longest metric name so this shouldn't be truncated */
+    if (len > 0) {
+        fwrite(buf, 1, (size_t)len < size ? (size_t)len : size - 1, stdout);
+    }
+}
+
+
+/* free a scrape's copy of the results */
+void free_snapshot(struct df_metrics *snapshot, unsigned int count) {
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        free(snapshot[i].labels);
+        free(snapshot[i].histogram);
+        free(snapshot[i].target_labels);
+    }
+    free(snapshot);
+}
+
+
+/* write Prometheus metrics for each filesystem to an HTTP client of -W */
+/* called from the HTTP thread without any lock, the results are copied while holding metrics_lock and formatted after */
+/* if memory runs out the scrape is dropped rather than exiting */
+void serve_metrics(FILE *out, void *arg) {
+    const struct df_round *round = arg;
+    struct df_metrics *snapshot = calloc(round->count, sizeof(struct df_metrics));
+    const struct df_row *row;
+    unsigned int i;
+    size_t len;
+    FILE *labels;
+
+    if (snapshot == NULL) {
+        fprintf(stderr, "Couldn't allocate memory for metrics!\n");
+        return;
+    }
+
+    pthread_mutex_lock(&metrics_lock);
+
+    for (i = 0; i < round->count; i++) {
+        row = &round->rows[i];
+        snapshot[i].row = row;
+        snapshot[i].sent = row->fh->sent;
+        snapshot[i].received = row->fh->received;
+        snapshot[i].valid = row->valid;
+        snapshot[i].last = row->last;
+        snapshot[i].last_usec = row->last_usec;
+        /* the rows for a target are all together */
+        if (i == 0 || row->target != round->rows[i - 1].target) {
+            snapshot[i].histogram = serve_copy(row->target->histogram);
+        }
+    }
+
+    pthread_mutex_unlock(&metrics_lock);
+
+    /* the hosts and paths don't change so they can be read without the lock */
+    for (i = 0; i < round->count; i++) {
+        row = snapshot[i].row;
+        labels = open_memstream(&snapshot[i].labels, &len);
+        if (labels == NULL) {
+            perror("open_memstream");
+            free_snapshot(snapshot, round->count);
+            return;
+        }
+        fputs("host=\"", labels);
+        serve_label(labels, row->target->name);
+        fprintf(labels, "\",ip=\"%s\",path=\"", row->target->ip_address);
+        serve_label(labels, row->fh->path);
+        fputc('"', labels);
+        fclose(labels);
+
+        if (snapshot[i].histogram) {
+            labels = open_memstream(&snapshot[i].target_labels, &len);
+            if (labels == NULL) {
+                perror("open_memstream");
+                free_snapshot(snapshot, round->count);
+                return;
+            }
+            fputs("host=\"", labels);
+            serve_label(labels, row->target->name);
+            fprintf(labels, "\",ip=\"%s\"", row->target->ip_address);
+            fclose(labels);
+        }
+    }
+
+    /* all of the lines for a metric have to be together */
+    fprintf(out, "# HELP nfsdf_requests_total FSSTAT requests sent for the filesystem.\n");
+    fprintf(out, "# TYPE nfsdf_requests_total counter\n");
+    for (i = 0; i < round->count; i++) {
+        fprintf(out, "nfsdf_requests_total{%s} %lu\n", snapshot[i].labels, snapshot[i].sent);
+    }
+
+    fprintf(out, "# HELP nfsdf_responses_total Successful FSSTAT responses for the filesystem.\n");
+    fprintf(out, "# TYPE nfsdf_responses_total counter\n");
+    for (i = 0; i < round->count; i++) {
+        fprintf(out, "nfsdf_responses_total{%s} %lu\n", snapshot[i].labels, snapshot[i].received);
+    }
+
+/* the gauges are from the last successful response, filesystems that haven't answered yet are left out */
+#define DF_GAUGE(metric, help, field) \
+    fprintf(out, "# HELP " metric " " help "\n"); \
+    fprintf(out, "# TYPE " metric " gauge\n"); \
+    for (i = 0; i < round->count; i++) { \
+        if (snapshot[i].valid) { \
+            fprintf(out, metric "{%s} %" PRIu64 "\n", snapshot[i].labels, (uint64_t)snapshot[i].last.field); \
+        } \
+    }
+
+    DF_GAUGE("nfsdf_size_bytes", "Total size of the filesystem.", tbytes)
+    DF_GAUGE("nfsdf_free_bytes", "Free space on the filesystem.", fbytes)
+    DF_GAUGE("nfsdf_avail_bytes", "Free space on the filesystem available to the user.", abytes)
+    DF_GAUGE("nfsdf_files", "Total file slots (inodes) on the filesystem.", tfiles)
+    DF_GAUGE("nfsdf_files_free", "Free file slots on the filesystem.", ffiles)
+    DF_GAUGE("nfsdf_files_avail", "Free file slots on the filesystem available to the user.", afiles)
+#undef DF_GAUGE
+
+    fprintf(out, "# HELP nfsdf_last_response_seconds Response time of the last successful FSSTAT.\n");
+    fprintf(out, "# TYPE nfsdf_last_response_seconds gauge\n");
+    for (i = 0; i < round->count; i++) {
+        if (snapshot[i].valid) {
+            fprintf(out, "nfsdf_last_response_seconds{%s} %.6f\n", snapshot[i].labels, snapshot[i].last_usec / 1000000.0);
+        }
+    }
+
+    /* the histograms are for each target, with NFSv4 every filesystem in a COMPOUND gets the time for the whole call */
+    fprintf(out, "# HELP nfsdf_response_seconds FSSTAT response time for the target.\n");
+    fprintf(out, "# TYPE nfsdf_response_seconds histogram\n");
+    for (i = 0; i < round->count; i++) {
+        if (snapshot[i].histogram) {
+            serve_histogram(out, "nfsdf_response_seconds", snapshot[i].target_labels, snapshot[i].histogram);
+        }
+    }
+
+    fprintf(out, "# HELP nfsdf_response_quantile_seconds FSSTAT response time quantiles for the target since the start.\n");
+    fprintf(out, "# TYPE nfsdf_response_quantile_seconds summary\n");
+    for (i = 0; i < round->count; i++) {
+        if (snapshot[i].histogram) {
+            serve_summary(out, "nfsdf_response_quantile_seconds", snapshot[i].target_labels, snapshot[i].histogram);
+        }
+    }
+
+    free_snapshot(snapshot, round->count);
 }
 
 
 int main(int argc, char **argv) {
     int ch;
     char output_prefix[255] = "nfs";
-    char *input_fh = NULL;
-    size_t n = 0; /* for getline() */
     targets_t dummy = { 0 };
     targets_t *current = &dummy;
     targets_t *targets = current;
@@ -361,7 +986,6 @@ int main(int argc, char **argv) {
     unsigned int maxhost = 0;
     struct winsize winsz;
     unsigned short rows  = 0; /* number of rows in terminal window */
-    unsigned long version = 3;
     struct timespec loop_start, loop_end, loop_elapsed, sleepy;
     /* default to 1Hz */
     struct timespec sleep_time = {
@@ -370,8 +994,23 @@ int main(int argc, char **argv) {
     };
     unsigned long hertz       = NFS_HERTZ;
     struct timeval timeout    = NFS_TIMEOUT;
-    struct timespec call_start, call_end, call_elapsed, wall_clock;
-    unsigned long usec = 0;
+    struct df_round round = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+    };
+    struct df_row *row;
+    pthread_t *threads;
+    unsigned int thread_count;
+    struct serve *metrics_server = NULL;
+    unsigned int printed, ready;
+    unsigned int i;
+    /* for formatting graphite output */
+    char *output = NULL;
+    size_t output_size = 0;
+    /* extra columns in change only mode */
+    char rates[64] = "";
+    /* count of rows printed for repeating the header */
+    unsigned long printed_rows = 0;
     /* count of requests sent */
     unsigned long df_sent = 0;
     /* count of successful requests */
@@ -381,7 +1020,6 @@ int main(int argc, char **argv) {
         /* default to UDP */
         .ai_socktype = SOCK_DGRAM,
     };
-    FSSTAT3res *fsstatres;
     /* source ip address for packets */
     struct sockaddr_in src_ip = {
         .sin_family = AF_INET,
@@ -391,7 +1029,7 @@ int main(int argc, char **argv) {
     /* set the default config "object" */
     cfg = CONFIG_DEFAULT;
 
-    while ((ch = getopt(argc, argv, "Abc:gGhH:iklmMnp:S:tTv")) != -1) {
+    while ((ch = getopt(argc, argv, "Abc:d:F:gGhH:iklmMnp:P:S:tTvV:W:")) != -1) {
         switch(ch) {
             /* display IP addresses */
             case 'A':
@@ -418,6 +1056,11 @@ int main(int argc, char **argv) {
                     cfg.format = ping;
                 }
                 break;
+            /* only print changes */
+            case 'd':
+                cfg.changes = 1;
+                cfg.heartbeat = strtoul(optarg, NULL, 10);
+                break;
             /* display gigabytes */
             case 'g':
                 if (cfg.prefix == NONE) {
@@ -489,6 +1132,13 @@ int main(int argc, char **argv) {
             case 'p':
                 strncpy(output_prefix, optarg, sizeof(output_prefix));
                 break;
+            /* number of requests in parallel */
+            case 'P':
+                cfg.threads = strtoul(optarg, NULL, 10);
+                if (cfg.threads == 0) {
+                    fatal("Zero threads, nothing to do!\n");
+                }
+                break;
             /* specify source address */
             case 'S':
                 if (inet_pton(AF_INET, optarg, &src_ip.sin_addr) != 1) {
@@ -511,6 +1161,21 @@ int main(int argc, char **argv) {
             case 'v':
                 verbose = 1;
                 break;
+            /* filehandle database */
+            case 'F':
+                cfg.database = optarg;
+                break;
+            /* NFS version */
+            case 'V':
+                cfg.version = strtoul(optarg, NULL, 10);
+                if (cfg.version != 3 && cfg.version != 4) {
+                    fatal("Only NFS versions 3 and 4 are supported!\n");
+                }
+                break;
+            /* Prometheus metrics */
+            case 'W':
+                cfg.metrics_listen = optarg;
+                break;
             /* have to keep -h available for human readable output */
             case '?':
             default:
@@ -528,6 +1193,16 @@ int main(int argc, char **argv) {
         cfg.format = ping;
     }
 
+    /* keep running for the scrapes unless there's a count */
+    if (cfg.metrics_listen && cfg.count == 0) {
+        cfg.loop = 1;
+    }
+
+    /* NFSv4 is only over TCP */
+    if (cfg.version == 4) {
+        hints.ai_socktype = SOCK_STREAM;
+    }
+
     /* calculate the sleep_time based on the frequency */
     /* this doesn't support frequencies lower than 1Hz */
     if (hertz > 1) {
@@ -537,36 +1212,82 @@ int main(int argc, char **argv) {
     }
 
     
-    /* first parse all of the input filehandles into a list  from stdin, one per line
+    /* first parse all of the input filehandles into a list, from a database or from stdin one per line
      * this gives us the longest path so we can lay out the output
      * TODO only for human readable output, otherwise do it line by line
      */
-    while (getline(&input_fh, &n, stdin) != -1) {
+    /* don't allocate space for results */
+    fhdb_load_or_read_fhs(cfg.database, targets, cfg.port, timeout, 0);
 
-        /* don't allocate space for results */
-        current = parse_fh(targets, input_fh, cfg.port, timeout, 0);
+    /* set to start of list, skipping first dummy entry */
+    targets = targets->next;
 
+    /* one row for each filesystem in the order they were read, so the output doesn't move around between rounds */
+    round.timeout = timeout;
+    for (current = targets; current; current = current->next) {
         /* save the longest host/paths for display formatting */
-        if (current) {
-            if (strlen(current->filehandles->path) > maxpath) {
-                maxpath = strlen(current->filehandles->path);
+        /* check if we're displaying hostnames or IP addresses */
+        if (cfg.display_ips) {
+            if (strlen(current->ip_address) > maxhost) {
+                maxhost = strlen(current->ip_address);
             }
+        } else {
+            if (strlen(current->name) > maxhost) {
+                maxhost = strlen(current->name);
+            }
+        }
 
-            /* check if we're displaying hostnames or IP addresses */
-            if (cfg.display_ips) {
-                if (strlen(current->ip_address) > maxhost) {
-                    maxhost = strlen(current->ip_address);
-                }
-            } else {
-                if (strlen(current->name) > maxhost) {
-                    maxhost = strlen(current->name);
+        for (filehandle = current->filehandles; filehandle; filehandle = filehandle->next) {
+            if (strlen(filehandle->path) > maxpath) {
+                maxpath = strlen(filehandle->path);
+            }
+
+            round.count++;
+        }
+    }
+
+    if (round.count == 0) {
+        fatalx(3, "No filehandles!\n");
+    }
+
+    round.rows = calloc(round.count, sizeof(struct df_row));
+    if (round.rows == NULL) {
+        fatalx(3, "Couldn't allocate memory for results!\n");
+    }
+    row = round.rows;
+    for (current = targets; current; current = current->next) {
+        /* each thread gets its own connection, so a target can have as many requests outstanding as it has filesystems */
+        current->pool = rpc_pool_new(current->client_sock, &hints, NFS_PROGRAM, cfg.version, timeout, src_ip, cfg.threads, 1);
+
+        for (filehandle = current->filehandles; filehandle; filehandle = filehandle->next) {
+            row->target = current;
+            row->fh = filehandle;
+            if (cfg.format == graphite) {
+                row->metric = metric_base(output_prefix, current->ndqf, filehandle->path);
+                /* up to eight lines, each with the metric name, a suffix, a 64 bit number and a timestamp */
+                if (8 * (strlen(row->metric) + 64) > output_size) {
+                    output_size = 8 * (strlen(row->metric) + 64);
                 }
             }
+            row++;
         }
     }
 
-    /* set to start of list, skipping first dummy entry */
-    targets = targets->next;
+    if (output_size) {
+        output = malloc(output_size);
+        if (output == NULL) {
+            fatalx(3, "Couldn't allocate memory for output!\n");
+        }
+    }
+
+    make_batches(&round);
+    debug("%u filesystems in %u batches\n", round.count, round.batch_count);
+
+    thread_count = round.batch_count < cfg.threads ? round.batch_count : cfg.threads;
+    threads = calloc(thread_count, sizeof(pthread_t));
+    if (threads == NULL) {
+        fatalx(3, "Couldn't allocate memory for threads!\n");
+    }
 
     /* 
      * Print the header before sending any RPCs, this means we have to guess about the size of the results
@@ -579,6 +1300,11 @@ int main(int argc, char **argv) {
     /* always print one header at the start */
     print_header(maxhost, maxpath, cfg.prefix);
 
+    /* the callback takes the lock itself, only for as long as it takes to copy the results */
+    if (cfg.metrics_listen) {
+        metrics_server = serve_http(cfg.metrics_listen, NULL, serve_metrics, &round);
+    }
+
     /* listen for ctrl-c */
     quitting = 0;
     signal(SIGINT, sigint_handler);
@@ -586,11 +1312,8 @@ int main(int argc, char **argv) {
     /* the main loop */
     while(1) {
         /* find the current number of rows in the terminal for printing the header once per screen */
-        ioctl(STDOUT_FILENO, TIOCGWINSZ, &winsz);
-        rows = winsz.ws_row;
-
-        /* reset to start of list */
-        current = targets;
+        /* zero if stdout isn't a terminal */
+        rows = ioctl(STDOUT_FILENO, TIOCGWINSZ, &winsz) == 0 ? winsz.ws_row : 0;
 
 #ifdef CLOCK_MONOTONIC_RAW
         clock_gettime(CLOCK_MONOTONIC_RAW, &loop_start);
@@ -598,88 +1321,100 @@ int main(int argc, char **argv) {
         clock_gettime(CLOCK_MONOTONIC, &loop_start);
 #endif 
 
-        while (current) {
-            /* make a new connection if needed */
-            if (current->client == NULL) {
-                current->client = create_rpc_client(current->client_sock, &hints, NFS_PROGRAM, version, timeout, src_ip);
-                /* don't use default AUTH_NONE */
-                auth_destroy(current->client->cl_auth);
-                /* set up AUTH_SYS instead */
-                current->client->cl_auth = authunix_create_default();
-            }
+        /* send all of the requests for this round at once */
+        round.next = 0;
+        for (i = 0; i < round.count; i++) {
+            round.rows[i].done = 0;
+        }
 
-            /* loop through the filehandles for each target */
+        for (i = 0; i < thread_count; i++) {
+            if (pthread_create(&threads[i], NULL, df_worker, &round) != 0) {
+                fatalx(3, "Couldn't create thread!\n");
+            }
+        }
 
-            filehandle = current->filehandles;
+        /* print the rows in order as soon as each one and all of the rows above it are done */
+        /* so the round takes as long as the slowest reply instead of the sum of all of them */
+        printed = 0;
+        while (printed < round.count) {
+            pthread_mutex_lock(&round.lock);
+            while (round.rows[printed].done == 0) {
+                pthread_cond_wait(&round.done, &round.lock);
+            }
+            for (ready = printed + 1; ready < round.count && round.rows[ready].done; ready++);
+            pthread_mutex_unlock(&round.lock);
 
-            while (filehandle) {
+            /* the workers don't touch rows that are done so they can be printed without the lock */
+            for (; printed < ready; printed++) {
+                row = &round.rows[printed];
+                current = row->target;
+                filehandle = row->fh;
 
-                /* get the current timestamp */
-                clock_gettime(CLOCK_REALTIME, &wall_clock);
+                pthread_mutex_lock(&metrics_lock);
 
-#ifdef CLOCK_MONOTONIC_RAW
-                clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
-#else  
-                clock_gettime(CLOCK_MONOTONIC, &call_start);
-#endif 
-                /* the actual RPC call */
-                fsstatres = get_fsstat(current->client, current->name, filehandle);
-                /* second time marker */
-#ifdef CLOCK_MONOTONIC_RAW
-                clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
-#else  
-                clock_gettime(CLOCK_MONOTONIC, &call_end);
-#endif
                 df_sent++;
                 filehandle->sent++;
 
-                /* calculate elapsed microseconds */
-                timespecsub(&call_end, &call_start, &call_elapsed);
-                usec = ts2us(call_elapsed);
-
-                if (fsstatres && fsstatres->status == NFS3_OK) {
+                if (row->status == RPC_SUCCESS && row->res.status == NFS3_OK) {
                     df_ok++;
                     current->received++;
+                    filehandle->received++;
+
+                    row->valid = 1;
+                    row->last = row->res.FSSTAT3res_u.resok;
+                    row->last_usec = row->usec;
+                    hdr_record_value(current->histogram, row->usec);
+                }
+
+                pthread_mutex_unlock(&metrics_lock);
+
+                /* skip filesystems that haven't changed */
+                if (row->status == RPC_SUCCESS && row->res.status == NFS3_OK && (cfg.changes == 0 || df_changed(row, cfg.heartbeat))) {
+                    if (cfg.changes) {
+                        format_rates(row, cfg.prefix, rates, sizeof(rates));
+                    }
+                    printed_rows++;
 
                     /* print header once per screen like vmstat */
-                    /* TODO maybe a better number than df_ok? What about errors? Or the header line itself? */
-                    if (cfg.one_header == 0 && (df_ok % rows == 0)) {
+                    /* TODO What about errors? Or the header line itself? */
+                    if (cfg.one_header == 0 && rows && (printed_rows % rows == 0)) {
                         print_header(maxhost, maxpath, cfg.prefix);
                     }
 
                     if (cfg.format == ping) {
                         if (cfg.inodes) {
                             if (cfg.display_ips) {
-                                print_inodes(maxpath, current->ip_address, filehandle->path, fsstatres, usec);
+                                print_inodes(maxpath, current->ip_address, filehandle->path, &row->res, row->usec, rates);
                             } else {
-                                print_inodes(maxpath, current->name, filehandle->path, fsstatres, usec);
+                                print_inodes(maxpath, current->name, filehandle->path, &row->res, row->usec, rates);
                             }
                         } else {
                             /* are we printing ip_addresses or hostnames */
                             /* TODO move this logic into print_df? But then have to pass in the filehandle struct */
                             if (cfg.display_ips) {
-                                print_df(maxpath, current->ip_address, filehandle->path, fsstatres, cfg.prefix, usec);
+                                print_df(maxpath, current->ip_address, filehandle->path, &row->res, cfg.prefix, row->usec, rates);
                             } else {
-                                print_df(maxpath, current->name, filehandle->path, fsstatres, cfg.prefix, usec);
+                                print_df(maxpath, current->name, filehandle->path, &row->res, cfg.prefix, row->usec, rates);
                             }
                         }
                     } else {
-                        print_format(cfg.format, output_prefix, current->ndqf, filehandle->path, fsstatres, usec, wall_clock);
+                        print_format(cfg.format, row, output, output_size);
                     }
                 }
 
                 /* free the result */
-                xdr_free((xdrproc_t)xdr_FSSTAT3res, (char *)fsstatres);
-
-                /* TODO pause between requests to same target? */
-
-                filehandle = filehandle->next;
-            } /* while(filehandle) */
+                if (row->status == RPC_SUCCESS) {
+                    xdr_free((xdrproc_t)xdr_FSSTAT3res, (char *)&row->res);
+                }
+            }
 
-            /* don't pause between targets */
+            /* print each batch of rows as it comes in rather than when the buffer fills */
+            fflush(stdout);
+        }
 
-            current = current->next;
-        } /* while(current) */
+        for (i = 0; i < thread_count; i++) {
+            pthread_join(threads[i], NULL);
+        }
 
         /* measure how long the current round took, and subtract that from the sleep time */
         /* this keeps us on the polling frequency */
@@ -713,6 +1448,22 @@ int main(int argc, char **argv) {
         }
     } /* while (1) */
 
+    metrics_server = serve_stop(metrics_server);
+
+    free(threads);
+    free(output);
+    for (i = 0; i < round.count; i++) {
+        free(round.rows[i].metric);
+    }
+    for (i = 0; i < round.batch_count; i++) {
+        free(round.batches[i].ops);
+    }
+    free(round.batches);
+    free(round.rows);
+    for (current = targets; current; current = current->next) {
+        current->pool = rpc_pool_destroy(current->pool);
+    }
+
     /* check if all the results came back ok */
     if (df_sent && df_sent == df_ok) {
         return EXIT_SUCCESS;
@@ -0,0 +1,556 @@
+/*
+ * Add up the space used by directory trees on an NFS server
+ *
+ * Uses the directory walker from nfsls so many directories are read at once. Each directory only counts the entries
+ * directly inside it while the walk is running, then the totals are added up from the bottom of the tree at the end.
+ */
+
+#include "nfsping.h"
+#include "rpc.h"
+#include "util.h"
+#include "human.h" /* prefix_print() */
+#include "walk.h"
+#include "fileid.h"
+
+/* globals */
+extern volatile sig_atomic_t quitting;
+int verbose = 0;
+
+/* a directory and the space used under it */
+struct du_dir {
+    targets_t *target;
+    struct du_dir *parent;
+    /* including a trailing slash, the same as the walker's task path */
+    char *path;
+    unsigned int depth;
+    /* only the entries directly in this directory during the walk, the whole subtree after du_totals() */
+    uint64_t used;
+    uint64_t size;
+    unsigned long files;
+    unsigned long dirs;
+    /* hash chain */
+    struct du_dir *chain;
+    /* list of all directories */
+    struct du_dir *next;
+};
+
+/* all of the directories found so far, looked up by target and path */
+struct du_dirs {
+    pthread_mutex_t lock;
+    struct du_dir **buckets;
+    /* always a power of two */
+    size_t size;
+    size_t count;
+    struct du_dir *all;
+};
+
+/* local prototypes */
+static void usage(void);
+static size_t du_hash(targets_t *, const char *);
+static struct du_dir *du_dir_find(targets_t *, const char *);
+static struct du_dir *du_dir_new(targets_t *, struct du_dir *, const char *, const char *);
+static int du_entry(struct walk *, struct walk_task *, entryplus3 *, void *);
+static int compare_depth(const void *, const void *);
+static int compare_usage(const void *, const void *);
+static struct du_dir **du_totals(void);
+static void print_usage(struct du_dir **);
+
+/* global config "object" */
+static struct config {
+    /* NFS port */
+    uint16_t port;
+    /* NFS version */
+    unsigned long version;
+    struct timeval timeout;
+    /* output size prefix */
+    enum byte_prefix prefix;
+    /* -a */
+    int apparent;
+    /* -A */
+    int display_ips;
+    /* number of directories to print, 0 = all */
+    unsigned long top;
+    /* number of directories to read at once */
+    unsigned int threads;
+} cfg;
+
+/* default config */
+const struct config CONFIG_DEFAULT = {
+    .port        = NFS_PORT,
+    .version     = 3,
+    .timeout     = NFS_TIMEOUT,
+    .prefix      = NONE,
+    .apparent    = 0,
+    .display_ips = 0,
+    .top         = 20,
+    .threads     = 8,
+};
+
+static struct du_dirs dirs = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* files with more than one link that have already been counted */
+static struct fileid_set *links;
+
+
+void usage() {
+    printf("Usage: nfsdu [options]\n\
+Summarise disk usage of NFS directories from stdin\n\n\
+    -a       sort by apparent size (file sizes) not space used\n\
+    -A       show IP addresses (default hostnames)\n\
+    -b       display sizes in bytes\n\
+    -g       display sizes in gigabytes\n\
+    -h       display human readable sizes (default)\n\
+    -k       display sizes in kilobytes\n\
+    -m       display sizes in megabytes\n\
+    -M       use the portmapper (default: %i)\n\
+    -n n     number of directories to print, 0 for all (default %lu)\n\
+    -p n     number of directories to read in parallel (default %u)\n\
+    -S addr  set source address\n\
+    -t       display sizes in terabytes\n\
+    -T       use TCP (default UDP)\n\
+    -v       verbose output\n",
+    NFS_PORT, CONFIG_DEFAULT.top, CONFIG_DEFAULT.threads);
+
+    exit(3);
+}
+
+
+/* FNV-1a of the path mixed with the target */
+size_t du_hash(targets_t *target, const char *path) {
+    size_t hash = 2166136261u ^ (uintptr_t)target;
+
+    while (*path) {
+        hash ^= (unsigned char)*path++;
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+
+/* find a directory that has already been added */
+/* only called once per directory listing, the walker keeps the result in the task */
+struct du_dir *du_dir_find(targets_t *target, const char *path) {
+    struct du_dir *dir;
+
+    pthread_mutex_lock(&dirs.lock);
+
+    dir = dirs.buckets[du_hash(target, path) & (dirs.size - 1)];
+    while (dir && (dir->target != target || strcmp(dir->path, path) != 0)) {
+        dir = dir->chain;
+    }
+
+    pthread_mutex_unlock(&dirs.lock);
+
+    return dir;
+}
+
+
+/* add a directory, the path is the parent's path plus the child's name with a trailing slash like walk_add() */
+struct du_dir *du_dir_new(targets_t *target, struct du_dir *parent, const char *path, const char *child) {
+    struct du_dir *dir = calloc(1, sizeof(struct du_dir));
+    struct du_dir **buckets, *next;
+    size_t path_len = strlen(path);
+    size_t name_len = child ? strlen(child) : 0;
+    size_t i, bucket;
+
+    if (dir == NULL) {
+        fatalx(3, "Couldn't allocate memory for directory!\n");
+    }
+
+    dir->target = target;
+    dir->parent = parent;
+    dir->depth = parent ? parent->depth + 1 : 0;
+
+    /* room for a separator, a trailing slash and the NUL */
+    dir->path = malloc(path_len + name_len + 3);
+    if (dir->path == NULL) {
+        fatalx(3, "Couldn't allocate memory for directory!\n");
+    }
+    memcpy(dir->path, path, path_len);
+    if (path_len == 0 || path[path_len - 1] != '/') {
+        dir->path[path_len++] = '/';
+    }
+    if (name_len) {
+        memcpy(dir->path + path_len, child, name_len);
+        path_len += name_len;
+        dir->path[path_len++] = '/';
+    }
+    dir->path[path_len] = '\0';
+
+    pthread_mutex_lock(&dirs.lock);
+
+    /* grow the table when it's as full as it is big, chains are short enough */
+    if (dirs.count >= dirs.size) {
+        buckets = calloc(dirs.size ? dirs.size * 2 : 1024, sizeof(struct du_dir *));
+        if (buckets == NULL) {
+            fatalx(3, "Couldn't allocate memory for directories!\n");
+        }
+
+        for (i = 0; i < dirs.size; i++) {
+            while (dirs.buckets[i]) {
+                next = dirs.buckets[i]->chain;
+                bucket = du_hash(dirs.buckets[i]->target, dirs.buckets[i]->path) & ((dirs.size ? dirs.size * 2 : 1024) - 1);
+                dirs.buckets[i]->chain = buckets[bucket];
+                buckets[bucket] = dirs.buckets[i];
+                dirs.buckets[i] = next;
+            }
+        }
+
+        free(dirs.buckets);
+        dirs.buckets = buckets;
+        dirs.size = dirs.size ? dirs.size * 2 : 1024;
+    }
+
+    bucket = du_hash(target, dir->path) & (dirs.size - 1);
+    dir->chain = dirs.buckets[bucket];
+    dirs.buckets[bucket] = dir;
+    dir->next = dirs.all;
+    dirs.all = dir;
+    dirs.count++;
+
+    pthread_mutex_unlock(&dirs.lock);
+
+    return dir;
+}
+
+
+/* add each entry to its directory's total */
+/* only one thread lists each directory so the totals don't need locking */
+int du_entry(struct walk *walk, struct walk_task *task, entryplus3 *res_entry, void *arg) {
+    struct du_dir *dir = task->data;
+    struct fattr3 *attributes;
+
+    (void)walk;
+    (void)arg;
+
+    /* first entry from this directory */
+    if (dir == NULL) {
+        dir = du_dir_find(task->target, task->path);
+        if (dir == NULL) {
+            fatalx(3, "%s:%s: directory missing!\n", task->target->name, task->path);
+        }
+        task->data = dir;
+    }
+
+    /* nothing to count */
+    if (res_entry->name_attributes.attributes_follow == 0) {
+        dir->files++;
+        return 0;
+    }
+
+    attributes = &res_entry->name_attributes.post_op_attr_u.attributes;
+
+    if (attributes->type == NF3DIR) {
+        dir->dirs++;
+        /* the directory itself uses some space */
+        dir->used += attributes->used;
+        dir->size += attributes->size;
+
+        /* make sure the subdirectory exists before the walker queues it */
+        du_dir_new(task->target, dir, task->path, res_entry->name);
+
+        return 1;
+    }
+
+    dir->files++;
+
+    /* only count hard links the first time they're seen */
+    if (attributes->nlink > 1 && fileid_set_add(links, task->target->client_sock->sin_addr.s_addr, attributes->fsid, attributes->fileid) == 0) {
+        return 0;
+    }
+
+    dir->used += attributes->used;
+    dir->size += attributes->size;
+
+    return 0;
+}
+
+
+/* deepest first */
+int compare_depth(const void *a, const void *b) {
+    const struct du_dir *dir_a = *(struct du_dir * const *)a;
+    const struct du_dir *dir_b = *(struct du_dir * const *)b;
+
+    return (dir_a->depth < dir_b->depth) - (dir_a->depth > dir_b->depth);
+}
+
+
+/* biggest first */
+int compare_usage(const void *a, const void *b) {
+    const struct du_dir *dir_a = *(struct du_dir * const *)a;
+    const struct du_dir *dir_b = *(struct du_dir * const *)b;
+    uint64_t usage_a = cfg.apparent ? dir_a->size : dir_a->used;
+    uint64_t usage_b = cfg.apparent ? dir_b->size : dir_b->used;
+
+    return (usage_a < usage_b) - (usage_a > usage_b);
+}
+
+
+/* add each directory's totals to its parent, working up from the bottom of the tree */
+/* returns an array of all of the directories sorted by usage */
+struct du_dir **du_totals(void) {
+    struct du_dir **sorted;
+    struct du_dir *dir;
+    size_t i = 0;
+
+    sorted = malloc(dirs.count * sizeof(struct du_dir *));
+    if (sorted == NULL) {
+        fatalx(3, "Couldn't allocate memory for directories!\n");
+    }
+
+    for (dir = dirs.all; dir; dir = dir->next) {
+        sorted[i++] = dir;
+    }
+
+    /* a directory's children are all deeper so they're added to it before it is added to its parent */
+    qsort(sorted, dirs.count, sizeof(struct du_dir *), compare_depth);
+
+    for (i = 0; i < dirs.count; i++) {
+        dir = sorted[i];
+        if (dir->parent) {
+            dir->parent->used  += dir->used;
+            dir->parent->size  += dir->size;
+            dir->parent->files += dir->files;
+            dir->parent->dirs  += dir->dirs;
+        }
+    }
+
+    qsort(sorted, dirs.count, sizeof(struct du_dir *), compare_usage);
+
+    return sorted;
+}
+
+
+/* print the biggest directories */
+/* our format:
+   1.2T  231456 server:/export/home/
+ */
+void print_usage(struct du_dir **sorted) {
+    size_t count = cfg.top && cfg.top < dirs.count ? cfg.top : dirs.count;
+    char usage[max_prefix_width];
+    int files_width = 1;
+    int usage_width = 1;
+    size_t i;
+    struct du_dir *dir;
+
+    /* justify the columns */
+    for (i = 0; i < count; i++) {
+        dir = sorted[i];
+        prefix_print(cfg.apparent ? dir->size : dir->used, usage, cfg.prefix);
+        usage_width = (int)strlen(usage) > usage_width ? (int)strlen(usage) : usage_width;
+        files_width = snprintf(NULL, 0, "%lu", dir->files) > files_width ? snprintf(NULL, 0, "%lu", dir->files) : files_width;
+    }
+
+    for (i = 0; i < count; i++) {
+        dir = sorted[i];
+        prefix_print(cfg.apparent ? dir->size : dir->used, usage, cfg.prefix);
+
+        printf("%*s %*lu %s:%s\n",
+            usage_width, usage,
+            files_width, dir->files,
+            cfg.display_ips ? dir->target->ip_address : dir->target->name,
+            dir->path);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    int ch; /* getopt */
+    targets_t dummy = { 0 };
+    targets_t *targets = &dummy;
+    targets_t *current;
+    nfs_fh_list *filehandle;
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        /* default to UDP */
+        .ai_socktype = SOCK_DGRAM,
+    };
+    /* source ip address for packets */
+    struct sockaddr_in src_ip = {
+        .sin_family = AF_INET,
+        .sin_addr = 0
+    };
+    struct walk *walk;
+    struct du_dir **sorted;
+    struct timespec start, end, elapsed;
+    unsigned long errors;
+    double seconds;
+
+    cfg = CONFIG_DEFAULT;
+
+    while ((ch = getopt(argc, argv, "aAbghkmMn:p:S:tTv")) != -1) {
+        switch(ch) {
+            /* apparent size */
+            case 'a':
+                cfg.apparent = 1;
+                break;
+            /* display IPs instead of hostnames */
+            case 'A':
+                cfg.display_ips = 1;
+                break;
+            /* display bytes */
+            case 'b':
+                if (cfg.prefix == NONE) {
+                    cfg.prefix = BYTE;
+                } else {
+                    fatal("Can't specify multiple units!\n");
+                }
+                break;
+            /* display gigabytes */
+            case 'g':
+                if (cfg.prefix == NONE) {
+                    cfg.prefix = GIGA;
+                } else {
+                    fatal("Can't specify multiple units!\n");
+                }
+                break;
+            /* human sizes */
+            case 'h':
+                if (cfg.prefix == NONE) {
+                    cfg.prefix = HUMAN;
+                } else {
+                    fatal("Can't specify multiple units!\n");
+                }
+                break;
+            /* display kilobytes */
+            case 'k':
+                if (cfg.prefix == NONE) {
+                    cfg.prefix = KILO;
+                } else {
+                    fatal("Can't specify multiple units!\n");
+                }
+                break;
+            /* display megabytes */
+            case 'm':
+                if (cfg.prefix == NONE) {
+                    cfg.prefix = MEGA;
+                } else {
+                    fatal("Can't specify multiple units!\n");
+                }
+                break;
+            /* use the portmapper */
+            case 'M':
+                cfg.port = 0;
+                break;
+            /* number of directories to print */
+            case 'n':
+                cfg.top = strtoul(optarg, NULL, 10);
+                break;
+            /* parallel directories */
+            case 'p':
+                cfg.threads = strtoul(optarg, NULL, 10);
+                if (cfg.threads == 0) {
+                    fatal("Need at least one thread!\n");
+                }
+                break;
+            /* source ip address for packets */
+            case 'S':
+                if (inet_pton(AF_INET, optarg, &src_ip.sin_addr) != 1) {
+                    fatal("Invalid source IP address!\n");
+                }
+                break;
+            /* display terabytes */
+            case 't':
+                if (cfg.prefix == NONE) {
+                    cfg.prefix = TERA;
+                } else {
+                    fatal("Can't specify multiple units!\n");
+                }
+                break;
+            /* use TCP */
+            case 'T':
+                hints.ai_socktype = SOCK_STREAM;
+                break;
+            /* verbose */
+            case 'v':
+                verbose = 1;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    /* default to human output unless specified */
+    if (cfg.prefix == NONE) {
+        cfg.prefix = HUMAN;
+    }
+
+    /* no arguments, use stdin */
+    read_fhs(stdin, targets, cfg.port, cfg.timeout, 0);
+
+    /* skip the dummy entry */
+    targets = targets->next;
+
+    if (targets == NULL) {
+        fatalx(3, "No input!\n");
+    }
+
+    links = fileid_set_new();
+    if (links == NULL) {
+        fatalx(3, "Couldn't allocate memory for hard links!\n");
+    }
+
+    walk = walk_new(cfg.threads, cfg.timeout, du_entry, NULL);
+    if (walk == NULL) {
+        fatalx(3, "Couldn't allocate memory for directory walk!\n");
+    }
+
+    for (current = targets; current; current = current->next) {
+        /* each server gets up to one connection for each thread */
+        current->pool = rpc_pool_new(current->client_sock, &hints, NFS_PROGRAM, cfg.version, cfg.timeout, src_ip, cfg.threads, 1);
+
+        for (filehandle = current->filehandles; filehandle; filehandle = filehandle->next) {
+            du_dir_new(current, NULL, filehandle->path, NULL);
+            walk_add(walk, current, &filehandle->nfs_fh, filehandle->path);
+        }
+    }
+
+    /* listen for ctrl-c */
+    signal(SIGINT, sigint_handler);
+
+    /* don't quit on (TCP) broken pipes */
+    signal(SIGPIPE, SIG_IGN);
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+
+    errors = walk_run(walk);
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &end);
+#endif
+
+    timespecsub(&end, &start, &elapsed);
+    seconds = ts2us(elapsed) / 1000000.0;
+
+    /* print whatever we got even after ctrl-c */
+    sorted = du_totals();
+    print_usage(sorted);
+    fflush(stdout);
+
+    fprintf(stderr, "%lu directories, %lu entries in %.3f s (%.0f entries/s, %lu errors)\n",
+        walk->dirs,
+        walk->entries,
+        seconds,
+        seconds > 0 ? walk->entries / seconds : 0,
+        errors);
+    debug("%lu directories stolen between threads\n", walk->steals);
+
+    for (current = targets; current; current = current->next) {
+        current->pool = rpc_pool_destroy(current->pool);
+    }
+
+    walk_free(walk);
+    links = fileid_set_free(links);
+    free(sorted);
+
+    return errors || quitting ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,388 @@
+/*
+ * Binary filehandle database
+ *
+ * The JSON that nfsmount prints is easy to pipe between tools but every line has to be parsed and the filehandle
+ * decoded from hex. With millions of filehandles that's most of the startup time. nfsmount can instead write the
+ * same fields to a file which the other tools map into memory. The records are sorted by server IP and path so a
+ * single filehandle can be found with a binary search, and loading the whole file is a walk through an array that
+ * copies each record into the target list without any parsing or hex decoding.
+ */
+
+#include "fhdb.h"
+#include "util.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* starting number of entries in a writer */
+#define FHDB_ENTRIES 1024
+
+/* local prototypes */
+static int fhdb_compare(const void *, const void *);
+static int fhdb_record_compare(uint32_t, const char *, const struct fhdb *, const struct fhdb_record *);
+
+
+/* map a database file into memory and check the header */
+/* prints an error and returns NULL if it can't be used */
+struct fhdb *fhdb_open(const char *file) {
+    struct fhdb *db;
+    struct stat st;
+    const struct fhdb_header *header;
+    uint64_t records_end;
+    int fd;
+
+    fd = open(file, O_RDONLY);
+    if (fd == -1) {
+        perror(file);
+        return NULL;
+    }
+
+    if (fstat(fd, &st) == -1) {
+        perror(file);
+        close(fd);
+        return NULL;
+    }
+
+    if ((size_t)st.st_size < sizeof(struct fhdb_header)) {
+        fprintf(stderr, "%s: not a filehandle database!\n", file);
+        close(fd);
+        return NULL;
+    }
+
+    db = calloc(1, sizeof(struct fhdb));
+    if (db == NULL) {
+        fatalx(3, "Couldn't allocate memory for database!\n");
+    }
+    db->size = st.st_size;
+    db->map = mmap(NULL, db->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* the mapping stays valid after the file is closed */
+    close(fd);
+
+    if (db->map == MAP_FAILED) {
+        perror(file);
+        free(db);
+        return NULL;
+    }
+
+    header = db->map;
+
+    if (memcmp(header->magic, FHDB_MAGIC, sizeof(FHDB_MAGIC)) != 0) {
+        fprintf(stderr, "%s: not a filehandle database!\n", file);
+        return fhdb_close(db);
+    }
+
+    if (header->byteorder != FHDB_BYTEORDER) {
+        fprintf(stderr, "%s: database was written on a machine with a different byte order!\n", file);
+        return fhdb_close(db);
+    }
+
+    if (header->version != FHDB_VERSION) {
+        fprintf(stderr, "%s: unsupported database version %u!\n", file, header->version);
+        return fhdb_close(db);
+    }
+
+    /* make sure the records and strings are all inside the file so a truncated file can't crash the reader */
+    records_end = sizeof(struct fhdb_header) + header->count * sizeof(struct fhdb_record);
+    if (header->size != db->size || header->count > db->size / sizeof(struct fhdb_record) ||
+        header->strings < records_end || header->strings > db->size ||
+        /* the last string has to be terminated */
+        (header->strings < db->size && ((const char *)db->map)[db->size - 1] != '\0')) {
+        fprintf(stderr, "%s: database is truncated or corrupt!\n", file);
+        return fhdb_close(db);
+    }
+
+    db->header = header;
+    db->records = (const struct fhdb_record *)(header + 1);
+    db->strings = (const char *)db->map + header->strings;
+
+    /* they're used in order */
+    madvise(db->map, db->size, MADV_SEQUENTIAL);
+
+    return db;
+}
+
+
+/* return a string from the string table, or "" if the offset is out of range */
+const char *fhdb_string(const struct fhdb *db, uint64_t offset) {
+    if (offset >= db->size - db->header->strings) {
+        return "";
+    }
+
+    return &db->strings[offset];
+}
+
+
+/* compare a server and path to a record, in the same order as the records are sorted */
+static int fhdb_record_compare(uint32_t ip, const char *path, const struct fhdb *db, const struct fhdb_record *record) {
+    uint32_t a = ntohl(ip);
+    uint32_t b = ntohl(record->ip);
+
+    if (a != b) {
+        return a < b ? -1 : 1;
+    }
+
+    return strcmp(path, fhdb_string(db, record->path));
+}
+
+
+/* binary search for the filehandle for a path on a server */
+/* returns NULL if it isn't there */
+const struct fhdb_record *fhdb_find(const struct fhdb *db, struct in_addr ip, const char *path) {
+    uint64_t low = 0;
+    uint64_t high = db->header->count;
+    uint64_t middle;
+    int cmp;
+
+    while (low < high) {
+        middle = low + (high - low) / 2;
+        cmp = fhdb_record_compare(ip.s_addr, path, db, &db->records[middle]);
+
+        if (cmp == 0) {
+            return &db->records[middle];
+        } else if (cmp < 0) {
+            high = middle;
+        } else {
+            low = middle + 1;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* add every filehandle in the database to the target list, the same as parse_fh() does for each line of JSON */
+/* returns the last target that was added to */
+targets_t *fhdb_load(const struct fhdb *db, targets_t *head, uint16_t port, struct timeval timeout, unsigned long count) {
+    targets_t *current = NULL;
+    struct nfs_fh_list *fh;
+    const struct fhdb_record *record;
+    struct sockaddr_in sock;
+    uint64_t i;
+
+    for (i = 0; i < db->header->count; i++) {
+        record = &db->records[i];
+
+        if (record->fh_len == 0 || record->fh_len > FHSIZE3) {
+            fprintf(stderr, "Invalid filehandle for %s!\n", fhdb_string(db, record->path));
+            continue;
+        }
+
+        /* the records are sorted by IP so all of a server's filehandles are together */
+        /* only look up the target when the server changes */
+        if (current == NULL || current->client_sock->sin_addr.s_addr != record->ip) {
+            sock.sin_addr.s_addr = record->ip;
+            current = find_or_make_target(head, &sock, port, timeout, count);
+
+            /* don't do any DNS resolution, so the hostname is used for display only */
+            strncpy(current->name, fhdb_string(db, record->host), NI_MAXHOST - 1);
+            current->display_name = current->name;
+            current->ndqf = reverse_fqdn(current->name);
+        }
+
+        fh = nfs_fh_list_new(current, count);
+
+        strncpy(fh->path, fhdb_string(db, record->path), MNTPATHLEN - 1);
+
+        fh->nfs_fh.data.data_len = record->fh_len;
+        fh->nfs_fh.data.data_val = malloc(record->fh_len);
+        if (fh->nfs_fh.data.data_val == NULL) {
+            fatalx(3, "Couldn't allocate memory for filehandles!\n");
+        }
+        memcpy(fh->nfs_fh.data.data_val, record->fh, record->fh_len);
+    }
+
+    return current;
+}
+
+
+/* load the filehandles from a database file if one was given, otherwise read JSON from stdin */
+/* exits if the database can't be opened */
+void fhdb_load_or_read_fhs(const char *file, targets_t *head, uint16_t port, struct timeval timeout, unsigned long count) {
+    struct fhdb *db;
+
+    if (file) {
+        db = fhdb_open(file);
+        if (db == NULL) {
+            exit(3);
+        }
+        fhdb_load(db, head, port, timeout, count);
+        fhdb_close(db);
+    } else {
+        read_fhs(stdin, head, port, timeout, count);
+    }
+}
+
+
+/* unmap a database, returns NULL */
+struct fhdb *fhdb_close(struct fhdb *db) {
+    if (db) {
+        munmap(db->map, db->size);
+        free(db);
+    }
+
+    return NULL;
+}
+
+
+struct fhdb_writer *fhdb_writer_new(void) {
+    struct fhdb_writer *writer = calloc(1, sizeof(struct fhdb_writer));
+
+    if (writer == NULL) {
+        fatalx(3, "Couldn't allocate memory for filehandles!\n");
+    }
+
+    writer->size = FHDB_ENTRIES;
+    writer->entries = calloc(writer->size, sizeof(struct fhdb_entry));
+    if (writer->entries == NULL) {
+        fatalx(3, "Couldn't allocate memory for filehandles!\n");
+    }
+
+    return writer;
+}
+
+
+/* queue a filehandle to be written, the strings are copied */
+void fhdb_add(struct fhdb_writer *writer, struct in_addr ip, const char *host, const char *path, const char *fh, uint32_t fh_len) {
+    struct fhdb_entry *pending;
+
+    if (fh_len > FHSIZE3) {
+        fh_len = FHSIZE3;
+    }
+
+    if (writer->count == writer->size) {
+        writer->size *= 2;
+        writer->entries = realloc(writer->entries, writer->size * sizeof(struct fhdb_entry));
+        if (writer->entries == NULL) {
+            fatalx(3, "Couldn't allocate memory for filehandles!\n");
+        }
+    }
+
+    pending = &writer->entries[writer->count++];
+    pending->ip = ip.s_addr;
+    pending->host = strdup(host);
+    pending->path = strdup(path);
+    if (pending->host == NULL || pending->path == NULL) {
+        fatalx(3, "Couldn't allocate memory for filehandles!\n");
+    }
+    pending->fh_len = fh_len;
+    memcpy(pending->fh, fh, fh_len);
+}
+
+
+/* sort by server IP then path */
+static int fhdb_compare(const void *a, const void *b) {
+    const struct fhdb_entry *x = a;
+    const struct fhdb_entry *y = b;
+    uint32_t ip_x = ntohl(x->ip);
+    uint32_t ip_y = ntohl(y->ip);
+
+    if (ip_x != ip_y) {
+        return ip_x < ip_y ? -1 : 1;
+    }
+
+    return strcmp(x->path, y->path);
+}
+
+
+/* sort the filehandles and write the database */
+/* it's written to a temporary file and renamed over the old one so readers never see a partial file */
+/* returns 0 on success, or prints an error and returns -1 */
+int fhdb_write(struct fhdb_writer *writer, const char *file) {
+    struct fhdb_header header = { .magic = FHDB_MAGIC };
+    struct fhdb_record record;
+    struct fhdb_entry *pending;
+    /* the next free offset in the string table */
+    uint64_t offset = 0;
+    uint64_t host = 0;
+    char *tmpname;
+    FILE *out;
+    uint64_t i;
+    int failed = 0;
+
+    qsort(writer->entries, writer->count, sizeof(struct fhdb_entry), fhdb_compare);
+
+    tmpname = malloc(strlen(file) + sizeof(".tmp"));
+    if (tmpname == NULL) {
+        fatalx(3, "Couldn't allocate memory for filename!\n");
+    }
+    sprintf(tmpname, "%s.tmp", file);
+
+    out = fopen(tmpname, "w");
+    if (out == NULL) {
+        perror(tmpname);
+        free(tmpname);
+        return -1;
+    }
+
+    header.version = FHDB_VERSION;
+    header.byteorder = FHDB_BYTEORDER;
+    header.count = writer->count;
+    header.strings = sizeof(struct fhdb_header) + writer->count * sizeof(struct fhdb_record);
+
+    /* the size isn't known until the strings are written, so write the header again at the end */
+    failed |= fwrite(&header, sizeof(header), 1, out) != 1;
+
+    for (i = 0; i < writer->count; i++) {
+        pending = &writer->entries[i];
+
+        memset(&record, 0, sizeof(record));
+        record.ip = pending->ip;
+        record.fh_len = pending->fh_len;
+        memcpy(record.fh, pending->fh, pending->fh_len);
+
+        /* a server's records are all together so only store its hostname once */
+        if (i == 0 || pending->ip != pending[-1].ip || strcmp(pending->host, pending[-1].host)) {
+            host = offset;
+            offset += strlen(pending->host) + 1;
+        }
+        record.host = host;
+
+        record.path = offset;
+        offset += strlen(pending->path) + 1;
+
+        failed |= fwrite(&record, sizeof(record), 1, out) != 1;
+    }
+
+    /* the strings in the same order as the offsets were handed out */
+    for (i = 0; i < writer->count; i++) {
+        pending = &writer->entries[i];
+
+        if (i == 0 || pending->ip != pending[-1].ip || strcmp(pending->host, pending[-1].host)) {
+            failed |= fwrite(pending->host, strlen(pending->host) + 1, 1, out) != 1;
+        }
+        failed |= fwrite(pending->path, strlen(pending->path) + 1, 1, out) != 1;
+    }
+
+    header.size = header.strings + offset;
+    failed |= fseek(out, 0, SEEK_SET) != 0;
+    failed |= fwrite(&header, sizeof(header), 1, out) != 1;
+    failed |= fclose(out) != 0;
+
+    if (failed || rename(tmpname, file) == -1) {
+        perror(file);
+        unlink(tmpname);
+        free(tmpname);
+        return -1;
+    }
+
+    free(tmpname);
+
+    return 0;
+}
+
+
+/* free a writer and all of its entries, returns NULL */
+struct fhdb_writer *fhdb_writer_free(struct fhdb_writer *writer) {
+    uint64_t i;
+
+    if (writer) {
+        for (i = 0; i < writer->count; i++) {
+            free(writer->entries[i].host);
+            free(writer->entries[i].path);
+        }
+        free(writer->entries);
+        free(writer);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,72 @@
+#ifndef FHDB_H
+#define FHDB_H
+
+#include "nfsping.h"
+
+#define FHDB_MAGIC "NFSFHDB"
+#define FHDB_VERSION 1
+/* written in the host's byte order so a file from a machine with the other endianness can be spotted */
+#define FHDB_BYTEORDER 0x01020304
+
+/*
+ * The file is a header, then an array of fixed size records sorted by server IP and path, then a table of
+ * NUL terminated strings. It's read with mmap() so the records don't need any parsing, just copying.
+ */
+struct fhdb_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteorder;
+    uint64_t count;
+    /* offset of the string table from the start of the file */
+    uint64_t strings;
+    /* total size of the file */
+    uint64_t size;
+};
+
+struct fhdb_record {
+    /* network byte order */
+    uint32_t ip;
+    uint32_t fh_len;
+    /* offsets into the string table */
+    uint64_t host;
+    uint64_t path;
+    unsigned char fh[FHSIZE3];
+};
+
+/* an open database */
+struct fhdb {
+    void *map;
+    size_t size;
+    const struct fhdb_header *header;
+    const struct fhdb_record *records;
+    const char *strings;
+};
+
+/* a filehandle waiting to be written */
+struct fhdb_entry {
+    uint32_t ip;
+    char *host;
+    char *path;
+    uint32_t fh_len;
+    unsigned char fh[FHSIZE3];
+};
+
+/* collects filehandles in memory, they're sorted and written out all at once */
+struct fhdb_writer {
+    struct fhdb_entry *entries;
+    uint64_t count;
+    uint64_t size;
+};
+
+struct fhdb *fhdb_open(const char *);
+const struct fhdb_record *fhdb_find(const struct fhdb *, struct in_addr, const char *);
+const char *fhdb_string(const struct fhdb *, uint64_t);
+targets_t *fhdb_load(const struct fhdb *, targets_t *, uint16_t, struct timeval, unsigned long);
+void fhdb_load_or_read_fhs(const char *, targets_t *, uint16_t, struct timeval, unsigned long);
+struct fhdb *fhdb_close(struct fhdb *);
+struct fhdb_writer *fhdb_writer_new(void);
+void fhdb_add(struct fhdb_writer *, struct in_addr, const char *, const char *, const char *, uint32_t);
+int fhdb_write(struct fhdb_writer *, const char *);
+struct fhdb_writer *fhdb_writer_free(struct fhdb_writer *);
+
+#endif /* FHDB_H */
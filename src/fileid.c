@@ -0,0 +1,216 @@
+/*
+ * Set of (server, fsid, fileid) triples
+ *
+ * A file with more than one hard link shows up in more than one directory with the same fileid, and a buggy server
+ * can return a directory inside itself. Recursive tools add each file they find to the set and only count it (or
+ * descend into it) the first time.
+ *
+ * This needs to hold hundreds of millions of fileids so each one only takes an 8 byte slot. The tables are kept at
+ * most 3/4 full, which is between 10.7 and 21.3 bytes per fileid depending on when they last doubled.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "fileid.h"
+
+/* starting size of each shard's table */
+#define FILEID_SIZE 64
+
+/* local prototypes */
+static uint64_t fileid_hash(uint64_t);
+static uint64_t *fileid_find(uint64_t *, uint64_t, uint64_t, uint64_t);
+static struct fileid_fs *fileid_fs_get(struct fileid_set *, uint32_t, uint64_t);
+static int fileid_shard_add(struct fileid_shard *, uint64_t, uint64_t);
+
+
+/* finaliser from MurmurHash3, fileids are often sequential */
+static uint64_t fileid_hash(uint64_t fileid) {
+    uint64_t hash = fileid;
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+
+/* return the slot holding a fileid, or the empty slot where it belongs */
+static uint64_t *fileid_find(uint64_t *table, uint64_t size, uint64_t hash, uint64_t fileid) {
+    /* the low bits of the hash pick the shard so use the high bits here */
+    uint64_t i = (hash >> 32) & (size - 1);
+
+    while (table[i] && table[i] != fileid) {
+        i = (i + 1) & (size - 1);
+    }
+
+    return &table[i];
+}
+
+
+/* find the shards for a filesystem, adding it if it's new */
+static struct fileid_fs *fileid_fs_get(struct fileid_set *set, uint32_t server, uint64_t fsid) {
+    struct fileid_fs *fs;
+    unsigned int i;
+
+    /* usually there's only one filesystem */
+    for (fs = __sync_fetch_and_add(&set->filesystems, 0); fs; fs = fs->next) {
+        if (fs->fsid == fsid && fs->server == server) {
+            return fs;
+        }
+    }
+
+    pthread_mutex_lock(&set->lock);
+
+    /* check again in case another thread just added it */
+    for (fs = set->filesystems; fs; fs = fs->next) {
+        if (fs->fsid == fsid && fs->server == server) {
+            break;
+        }
+    }
+
+    if (fs == NULL) {
+        fs = calloc(1, sizeof(struct fileid_fs));
+        if (fs == NULL) {
+            fprintf(stderr, "Couldn't allocate memory for fileid set!\n");
+            exit(3);
+        }
+
+        fs->server = server;
+        fs->fsid = fsid;
+        for (i = 0; i < FILEID_SHARDS; i++) {
+            pthread_mutex_init(&fs->shards[i].lock, NULL);
+        }
+
+        fs->next = set->filesystems;
+        /* full barrier so readers never see the new filesystem before it's initialised */
+        __sync_synchronize();
+        set->filesystems = fs;
+    }
+
+    pthread_mutex_unlock(&set->lock);
+
+    return fs;
+}
+
+
+/* returns 1 if the fileid was added, 0 if it was already there */
+static int fileid_shard_add(struct fileid_shard *shard, uint64_t hash, uint64_t fileid) {
+    uint64_t *slot, *table;
+    uint64_t i;
+    int added = 0;
+
+    pthread_mutex_lock(&shard->lock);
+
+    if (shard->table == NULL) {
+        shard->size = FILEID_SIZE;
+        shard->table = calloc(shard->size, sizeof(uint64_t));
+        if (shard->table == NULL) {
+            fprintf(stderr, "Couldn't allocate memory for fileid set!\n");
+            exit(3);
+        }
+    }
+
+    slot = fileid_find(shard->table, shard->size, hash, fileid);
+
+    if (*slot == 0) {
+        *slot = fileid;
+        shard->count++;
+        added = 1;
+
+        /* linear probing is still quick at 3/4 full with a good hash */
+        if (shard->count * 4 > shard->size * 3) {
+            table = calloc(shard->size * 2, sizeof(uint64_t));
+            if (table == NULL) {
+                fprintf(stderr, "Couldn't allocate memory for fileid set!\n");
+                exit(3);
+            }
+
+            for (i = 0; i < shard->size; i++) {
+                if (shard->table[i]) {
+                    *fileid_find(table, shard->size * 2, fileid_hash(shard->table[i]), shard->table[i]) = shard->table[i];
+                }
+            }
+
+            free(shard->table);
+            shard->table = table;
+            shard->size *= 2;
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return added;
+}
+
+
+/* returns NULL if out of memory */
+struct fileid_set *fileid_set_new(void) {
+    struct fileid_set *set = calloc(1, sizeof(struct fileid_set));
+
+    if (set) {
+        pthread_mutex_init(&set->lock, NULL);
+    }
+
+    return set;
+}
+
+
+/* add a file on a server (IP address in network byte order) to the set */
+/* returns 1 if it wasn't already there, 0 if it was */
+int fileid_set_add(struct fileid_set *set, uint32_t server, uint64_t fsid, uint64_t fileid) {
+    struct fileid_fs *fs = fileid_fs_get(set, server, fsid);
+    uint64_t hash;
+
+    if (fileid == 0) {
+        return __sync_lock_test_and_set(&fs->zero, 1) == 0;
+    }
+
+    hash = fileid_hash(fileid);
+
+    return fileid_shard_add(&fs->shards[hash & (FILEID_SHARDS - 1)], hash, fileid);
+}
+
+
+/* the number of files in the set */
+/* only exact when nothing is being added */
+uint64_t fileid_set_count(struct fileid_set *set) {
+    struct fileid_fs *fs;
+    uint64_t count = 0;
+    unsigned int i;
+
+    for (fs = __sync_fetch_and_add(&set->filesystems, 0); fs; fs = fs->next) {
+        count += fs->zero;
+        for (i = 0; i < FILEID_SHARDS; i++) {
+            count += fs->shards[i].count;
+        }
+    }
+
+    return count;
+}
+
+
+struct fileid_set *fileid_set_free(struct fileid_set *set) {
+    struct fileid_fs *fs;
+    unsigned int i;
+
+    if (set) {
+        while (set->filesystems) {
+            fs = set->filesystems;
+            set->filesystems = fs->next;
+
+            for (i = 0; i < FILEID_SHARDS; i++) {
+                pthread_mutex_destroy(&fs->shards[i].lock);
+                free(fs->shards[i].table);
+            }
+            free(fs);
+        }
+
+        pthread_mutex_destroy(&set->lock);
+        free(set);
+    }
+
+    return NULL;
+}
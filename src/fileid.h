@@ -0,0 +1,46 @@
+#ifndef FILEID_H
+#define FILEID_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* the hash picks a shard, each shard has its own lock and table so threads rarely wait for each other */
+/* it also means only one small table is copied at a time when they grow */
+#define FILEID_SHARDS 256
+
+/* open addressing table of fileids, 0 marks an empty slot */
+struct fileid_shard {
+    pthread_mutex_t lock;
+    uint64_t *table;
+    /* always a power of two */
+    uint64_t size;
+    uint64_t count;
+};
+
+/* fileids are only unique within a filesystem, so each server's fsid gets its own set of shards */
+/* that way each slot only needs the 64 bit fileid */
+struct fileid_fs {
+    /* IP address in network byte order, different servers can report the same fsid */
+    uint32_t server;
+    uint64_t fsid;
+    /* fileid 0 can't go in the tables */
+    int zero;
+    struct fileid_shard shards[FILEID_SHARDS];
+    struct fileid_fs *next;
+};
+
+/* set of files that have already been seen, for counting hard links once and spotting directory loops */
+/* safe for concurrent inserts */
+struct fileid_set {
+    /* list of filesystems, only ever added to at the head so it can be read without locking */
+    struct fileid_fs *filesystems;
+    /* only for adding filesystems */
+    pthread_mutex_t lock;
+};
+
+struct fileid_set *fileid_set_new(void);
+int fileid_set_add(struct fileid_set *, uint32_t, uint64_t, uint64_t);
+uint64_t fileid_set_count(struct fileid_set *);
+struct fileid_set *fileid_set_free(struct fileid_set *);
+
+#endif /* FILEID_H */
@@ -0,0 +1,516 @@
+/*
+ * Search directory trees on an NFS server
+ *
+ * Uses the directory walker from nfsls. Every test is done on the attributes that come back in the READDIRPLUS
+ * replies, so apart from reading the directories themselves no other requests are needed. Directories that are
+ * excluded are never read at all.
+ */
+
+#include "nfsping.h"
+#include "rpc.h"
+#include "util.h"
+#include "walk.h"
+#include <fnmatch.h>
+#include <regex.h>
+
+/* globals */
+extern volatile sig_atomic_t quitting;
+int verbose = 0;
+
+/* a number to compare against, like find's +n/-n/n arguments */
+struct find_range {
+    /* 1 = greater than, -1 = less than, 0 = equal */
+    int compare;
+    uint64_t value;
+    /* multiplier from the suffix */
+    uint64_t unit;
+};
+
+/* local prototypes */
+static void usage(void);
+static void parse_range(struct find_range *, const char *, const char *, const uint64_t *, uint64_t);
+static int match_range(struct find_range *, uint64_t);
+static int find_excluded(const char *, const char *);
+static int find_matches(entryplus3 *);
+static void print_match(struct walk_task *, entryplus3 *);
+static int find_entry(struct walk *, struct walk_task *, entryplus3 *, void *);
+
+/* global config "object" */
+static struct config {
+    /* NFS port */
+    uint16_t port;
+    /* NFS version */
+    unsigned long version;
+    struct timeval timeout;
+    /* number of directories to read at once */
+    unsigned int threads;
+    /* -d */
+    unsigned int max_depth;
+    /* -n */
+    const char *name;
+    /* -r */
+    int regex;
+    regex_t name_regex;
+    /* -t, a bit for each ftype3 */
+    unsigned int types;
+    /* -s */
+    int size;
+    struct find_range size_range;
+    /* -m */
+    int mtime;
+    struct find_range mtime_range;
+    /* -a */
+    int atime;
+    struct find_range atime_range;
+    /* -u */
+    int uid;
+    uint32_t uid_value;
+    /* -x patterns, in argv */
+    char **excludes;
+    unsigned int exclude_count;
+} cfg;
+
+/* default config */
+const struct config CONFIG_DEFAULT = {
+    .port      = NFS_PORT,
+    .version   = 3,
+    .timeout   = NFS_TIMEOUT,
+    .threads   = 8,
+    .max_depth = 0,
+    .name      = NULL,
+    .regex     = 0,
+    .types     = 0,
+    .size      = 0,
+    .mtime     = 0,
+    .atime     = 0,
+    .uid       = 0,
+    .excludes  = NULL,
+    .exclude_count = 0,
+};
+
+/* size suffixes */
+static const char *size_suffixes = "ckMGT";
+static const uint64_t size_units[] = { 1, 1024, 1048576, 1073741824, 1099511627776ull };
+/* age suffixes, the default is days */
+static const char *age_suffixes = "smhdw";
+static const uint64_t age_units[] = { 1, 60, 3600, 86400, 604800 };
+
+/* file types in ftype3 order, starting at NF3REG = 1 */
+static const char *type_letters = "fdbclsp";
+
+/* the time the search started, for ages */
+static time_t now;
+
+/* counts */
+static unsigned long matches = 0;
+
+
+void usage() {
+    printf("Usage: nfsfind [options]\n\
+Find files in NFS directories from stdin\n\n\
+    -a [+-]n    accessed n days ago (+ more than, - less than, suffix s/m/h/d/w)\n\
+    -d n        descend at most n directories (default unlimited)\n\
+    -m [+-]n    modified n days ago (+ more than, - less than, suffix s/m/h/d/w)\n\
+    -M          use the portmapper (default: %i)\n\
+    -n glob     name matches shell pattern\n\
+    -p n        number of directories to read in parallel (default %u)\n\
+    -r regex    name matches extended regular expression\n\
+    -s [+-]n    size is n bytes (+ more than, - less than, suffix k/M/G/T)\n\
+    -S addr     set source address\n\
+    -t types    file type is one of f (file) d (directory) l (symlink) b c s p\n\
+    -T          use TCP (default UDP)\n\
+    -u uid      owned by numeric uid\n\
+    -v          verbose output\n\
+    -x glob     don't read directories whose path matches shell pattern\n",
+    NFS_PORT, CONFIG_DEFAULT.threads);
+
+    exit(3);
+}
+
+
+/* parse a number with an optional +/- in front and a unit suffix */
+void parse_range(struct find_range *range, const char *arg, const char *suffixes, const uint64_t *units, uint64_t default_unit) {
+    char *end;
+    const char *suffix;
+
+    range->compare = 0;
+    if (*arg == '+') {
+        range->compare = 1;
+        arg++;
+    } else if (*arg == '-') {
+        range->compare = -1;
+        arg++;
+    }
+
+    if (!isdigit((unsigned char)*arg)) {
+        fatal("Invalid number: %s\n", arg);
+    }
+
+    range->value = strtoull(arg, &end, 10);
+    range->unit = default_unit;
+
+    if (*end) {
+        suffix = strchr(suffixes, *end);
+        if (suffix == NULL || end[1]) {
+            fatal("Invalid suffix: %s\n", end);
+        }
+        range->unit = units[suffix - suffixes];
+    }
+}
+
+
+/* compare a value against a range in the range's units */
+/* values are rounded up to whole units like find does for sizes, ages are rounded down by the caller */
+int match_range(struct find_range *range, uint64_t value) {
+    value = (value + range->unit - 1) / range->unit;
+
+    if (range->compare > 0) {
+        return value > range->value;
+    } else if (range->compare < 0) {
+        return value < range->value;
+    }
+
+    return value == range->value;
+}
+
+
+/* returns 1 if a directory path matches any of the -x patterns */
+int find_excluded(const char *path, const char *child) {
+    char full[MNTPATHLEN];
+    unsigned int i;
+
+    if (cfg.exclude_count == 0) {
+        return 0;
+    }
+
+    /* the same as the walker's task path */
+    snprintf(full, sizeof(full), "%s%s/", path, child);
+
+    for (i = 0; i < cfg.exclude_count; i++) {
+        /* also try without the trailing slash so patterns don't have to end in one */
+        if (fnmatch(cfg.excludes[i], full, 0) == 0) {
+            return 1;
+        }
+        full[strlen(full) - 1] = '\0';
+        if (fnmatch(cfg.excludes[i], full, 0) == 0) {
+            return 1;
+        }
+        strcat(full, "/");
+    }
+
+    return 0;
+}
+
+
+/* check all of the tests, they all have to match */
+int find_matches(entryplus3 *res_entry) {
+    struct fattr3 *attributes = &res_entry->name_attributes.post_op_attr_u.attributes;
+    uint64_t age;
+
+    if (cfg.name && fnmatch(cfg.name, res_entry->name, 0) != 0) {
+        return 0;
+    }
+
+    if (cfg.regex && regexec(&cfg.name_regex, res_entry->name, 0, NULL, 0) != 0) {
+        return 0;
+    }
+
+    /* everything else needs attributes */
+    if (cfg.types == 0 && cfg.size == 0 && cfg.mtime == 0 && cfg.atime == 0 && cfg.uid == 0) {
+        return 1;
+    }
+
+    if (res_entry->name_attributes.attributes_follow == 0) {
+        return 0;
+    }
+
+    if (cfg.types && (attributes->type > NF3FIFO || (cfg.types & (1 << attributes->type)) == 0)) {
+        return 0;
+    }
+
+    if (cfg.size && match_range(&cfg.size_range, attributes->size) == 0) {
+        return 0;
+    }
+
+    /* ages are in whole units, rounded down, so -m 1 is anything between 24 and 48 hours old */
+    if (cfg.mtime) {
+        age = now > (time_t)attributes->mtime.seconds ? now - attributes->mtime.seconds : 0;
+        if (match_range(&cfg.mtime_range, age / cfg.mtime_range.unit * cfg.mtime_range.unit) == 0) {
+            return 0;
+        }
+    }
+
+    if (cfg.atime) {
+        age = now > (time_t)attributes->atime.seconds ? now - attributes->atime.seconds : 0;
+        if (match_range(&cfg.atime_range, age / cfg.atime_range.unit * cfg.atime_range.unit) == 0) {
+            return 0;
+        }
+    }
+
+    if (cfg.uid && attributes->uid != cfg.uid_value) {
+        return 0;
+    }
+
+    return 1;
+}
+
+
+/* print a match as a JSON filehandle that the other tools can use */
+/* directories get a trailing slash so they can be listed by nfsls */
+/* called from the walker threads, each match is printed with a single printf() so lines don't get mixed up */
+void print_match(struct walk_task *task, entryplus3 *res_entry) {
+    struct fattr3 *attributes = &res_entry->name_attributes.post_op_attr_u.attributes;
+    JSON_Value  *json_root = json_value_init_object();
+    JSON_Object *json_obj  = json_value_get_object(json_root);
+    char path[MNTPATHLEN];
+    char *fh;
+    char *my_json_string;
+
+    json_object_set_string(json_obj, "host", task->target->name);
+    json_object_set_string(json_obj, "ip", task->target->ip_address);
+
+    snprintf(path, sizeof(path), "%s%s%s", task->path, res_entry->name,
+        res_entry->name_attributes.attributes_follow && attributes->type == NF3DIR ? "/" : "");
+    json_object_set_string(json_obj, "path", path);
+
+    fh = nfs_fh3_to_string(res_entry->name_handle.post_op_fh3_u.handle);
+    json_object_set_string(json_obj, "filehandle", fh);
+    free(fh);
+
+    if (res_entry->name_attributes.attributes_follow) {
+        json_object_set_number(json_obj, "size", (double) attributes->size);
+        json_object_set_number(json_obj, "used", (double) attributes->used);
+        json_object_set_number(json_obj, "fileid", (double) attributes->fileid);
+        json_object_set_number(json_obj, "uid", (double) attributes->uid);
+        json_object_set_number(json_obj, "gid", (double) attributes->gid);
+        json_object_set_number(json_obj, "mtime", (double) attributes->mtime.seconds);
+        json_object_set_number(json_obj, "atime", (double) attributes->atime.seconds);
+    }
+
+    my_json_string = json_serialize_to_string(json_root);
+    printf("%s\n", my_json_string);
+    json_free_serialized_string(my_json_string);
+    json_value_free(json_root);
+}
+
+
+/* test each entry and decide whether to descend into directories */
+int find_entry(struct walk *walk, struct walk_task *task, entryplus3 *res_entry, void *arg) {
+    int directory = res_entry->name_attributes.attributes_follow &&
+        res_entry->name_attributes.post_op_attr_u.attributes.type == NF3DIR;
+
+    (void)walk;
+    (void)arg;
+
+    /* prune excluded directories before they are read */
+    if (directory && find_excluded(task->path, res_entry->name)) {
+        debug("Skipping %s:%s%s/\n", task->target->name, task->path, res_entry->name);
+        return 0;
+    }
+
+    /* nothing can be done with an entry that doesn't have a filehandle */
+    if (res_entry->name_handle.handle_follows && res_entry->name_handle.post_op_fh3_u.handle.data.data_len && find_matches(res_entry)) {
+        __sync_fetch_and_add(&matches, 1);
+        print_match(task, res_entry);
+    }
+
+    return 1;
+}
+
+
+int main(int argc, char **argv) {
+    int ch; /* getopt */
+    targets_t dummy = { 0 };
+    targets_t *targets = &dummy;
+    targets_t *current;
+    nfs_fh_list *filehandle;
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        /* default to UDP */
+        .ai_socktype = SOCK_DGRAM,
+    };
+    /* source ip address for packets */
+    struct sockaddr_in src_ip = {
+        .sin_family = AF_INET,
+        .sin_addr = 0
+    };
+    struct walk *walk;
+    struct timespec start, end, elapsed;
+    unsigned long errors;
+    double seconds;
+    const char *type;
+    int error;
+    char error_string[256];
+
+    cfg = CONFIG_DEFAULT;
+
+    while ((ch = getopt(argc, argv, "a:d:m:Mn:p:r:s:S:t:Tu:vx:")) != -1) {
+        switch(ch) {
+            /* access time */
+            case 'a':
+                cfg.atime = 1;
+                parse_range(&cfg.atime_range, optarg, age_suffixes, age_units, 86400);
+                break;
+            /* maximum depth */
+            case 'd':
+                cfg.max_depth = strtoul(optarg, NULL, 10);
+                if (cfg.max_depth == 0) {
+                    fatal("Depth has to be at least 1!\n");
+                }
+                break;
+            /* modification time */
+            case 'm':
+                cfg.mtime = 1;
+                parse_range(&cfg.mtime_range, optarg, age_suffixes, age_units, 86400);
+                break;
+            /* use the portmapper */
+            case 'M':
+                cfg.port = 0;
+                break;
+            /* name glob */
+            case 'n':
+                cfg.name = optarg;
+                break;
+            /* parallel directories */
+            case 'p':
+                cfg.threads = strtoul(optarg, NULL, 10);
+                if (cfg.threads == 0) {
+                    fatal("Need at least one thread!\n");
+                }
+                break;
+            /* name regex */
+            case 'r':
+                if (cfg.regex) {
+                    fatal("Can't specify multiple regular expressions!\n");
+                }
+                error = regcomp(&cfg.name_regex, optarg, REG_EXTENDED | REG_NOSUB);
+                if (error) {
+                    regerror(error, &cfg.name_regex, error_string, sizeof(error_string));
+                    fatal("Invalid regular expression: %s\n", error_string);
+                }
+                cfg.regex = 1;
+                break;
+            /* size */
+            case 's':
+                cfg.size = 1;
+                parse_range(&cfg.size_range, optarg, size_suffixes, size_units, 1);
+                break;
+            /* source ip address for packets */
+            case 'S':
+                if (inet_pton(AF_INET, optarg, &src_ip.sin_addr) != 1) {
+                    fatal("Invalid source IP address!\n");
+                }
+                break;
+            /* file types */
+            case 't':
+                for (type = optarg; *type; type++) {
+                    if (*type == ',') {
+                        continue;
+                    }
+                    if (strchr(type_letters, *type) == NULL) {
+                        fatal("Invalid file type: %c\n", *type);
+                    }
+                    /* ftype3 starts at 1 */
+                    cfg.types |= 1 << (strchr(type_letters, *type) - type_letters + 1);
+                }
+                break;
+            /* use TCP */
+            case 'T':
+                hints.ai_socktype = SOCK_STREAM;
+                break;
+            /* owner */
+            case 'u':
+                cfg.uid = 1;
+                cfg.uid_value = strtoul(optarg, NULL, 10);
+                break;
+            /* verbose */
+            case 'v':
+                verbose = 1;
+                break;
+            /* exclude directories */
+            case 'x':
+                cfg.excludes = realloc(cfg.excludes, (cfg.exclude_count + 1) * sizeof(char *));
+                if (cfg.excludes == NULL) {
+                    fatalx(3, "Couldn't allocate memory for exclude patterns!\n");
+                }
+                cfg.excludes[cfg.exclude_count++] = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    /* no arguments, use stdin */
+    read_fhs(stdin, targets, cfg.port, cfg.timeout, 0);
+
+    /* skip the dummy entry */
+    targets = targets->next;
+
+    if (targets == NULL) {
+        fatalx(3, "No input!\n");
+    }
+
+    walk = walk_new(cfg.threads, cfg.timeout, find_entry, NULL);
+    if (walk == NULL) {
+        fatalx(3, "Couldn't allocate memory for directory walk!\n");
+    }
+    walk->max_depth = cfg.max_depth;
+
+    for (current = targets; current; current = current->next) {
+        /* each server gets up to one connection for each thread */
+        current->pool = rpc_pool_new(current->client_sock, &hints, NFS_PROGRAM, cfg.version, cfg.timeout, src_ip, cfg.threads, 1);
+
+        for (filehandle = current->filehandles; filehandle; filehandle = filehandle->next) {
+            walk_add(walk, current, &filehandle->nfs_fh, filehandle->path);
+        }
+    }
+
+    /* listen for ctrl-c */
+    signal(SIGINT, sigint_handler);
+
+    /* don't quit on (TCP) broken pipes */
+    signal(SIGPIPE, SIG_IGN);
+
+    now = time(NULL);
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+
+    errors = walk_run(walk);
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &end);
+#endif
+
+    fflush(stdout);
+
+    timespecsub(&end, &start, &elapsed);
+    seconds = ts2us(elapsed) / 1000000.0;
+
+    fprintf(stderr, "%lu directories, %lu entries, %lu matches in %.3f s (%.0f entries/s, %lu errors)\n",
+        walk->dirs,
+        walk->entries,
+        matches,
+        seconds,
+        seconds > 0 ? walk->entries / seconds : 0,
+        errors);
+    debug("%lu directories stolen between threads\n", walk->steals);
+
+    for (current = targets; current; current = current->next) {
+        current->pool = rpc_pool_destroy(current->pool);
+    }
+
+    walk_free(walk);
+
+    if (cfg.regex) {
+        regfree(&cfg.name_regex);
+    }
+    free(cfg.excludes);
+
+    return errors || quitting ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,178 @@
+/*
+ * uid/gid to name cache
+ *
+ * Long listings need the owner and group names of every entry. With LDAP or SSSD behind NSS each getpwuid() or
+ * getgrgid() can be a network round trip, but a listing usually only has a handful of different owners. Each id is
+ * looked up once and the name (or the number if the id doesn't exist) is kept for the life of the process.
+ */
+
+#define _GNU_SOURCE /* for getpwent(), getgrent() and strdup() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pwd.h>
+#include <grp.h>
+#include "idcache.h"
+
+/* starting table size */
+#define IDCACHE_SIZE 256
+
+/* local prototypes */
+static struct idcache_entry *idcache_find(struct idcache *, uint32_t);
+static void idcache_insert(struct idcache *, uint32_t, const char *);
+static const char *idcache_get(struct idcache *, uint32_t, int);
+
+/* shared by all threads */
+static struct idcache users = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+static struct idcache groups = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+
+/* return the slot for an id, either the one holding it or the empty slot where it belongs */
+/* the table must already have been allocated */
+static struct idcache_entry *idcache_find(struct idcache *cache, uint32_t id) {
+    /* Fibonacci hashing, ids are usually small and sequential */
+    size_t i = (id * 2654435761u) & (cache->size - 1);
+
+    while (cache->table[i].name && cache->table[i].id != id) {
+        i = (i + 1) & (cache->size - 1);
+    }
+
+    return &cache->table[i];
+}
+
+
+/* add a name to the cache if the id isn't already there, call with the lock held */
+static void idcache_insert(struct idcache *cache, uint32_t id, const char *name) {
+    struct idcache_entry *old_table = cache->table;
+    struct idcache_entry *slot;
+    size_t old_size = cache->size;
+    size_t i;
+
+    /* keep the table at most half full so probes stay short */
+    if ((cache->count + 1) * 2 > cache->size) {
+        cache->size = cache->size ? cache->size * 2 : IDCACHE_SIZE;
+        cache->table = calloc(cache->size, sizeof(struct idcache_entry));
+        if (cache->table == NULL) {
+            fprintf(stderr, "Couldn't allocate memory for id cache!\n");
+            exit(3);
+        }
+
+        /* only the pointers move, the names stay where they are for the life of the process */
+        for (i = 0; i < old_size; i++) {
+            if (old_table[i].name) {
+                *idcache_find(cache, old_table[i].id) = old_table[i];
+            }
+        }
+
+        free(old_table);
+    }
+
+    slot = idcache_find(cache, id);
+    /* the first name for an id wins, the same as getpwuid() */
+    if (slot->name == NULL) {
+        slot->id = id;
+        slot->name = strdup(name);
+        if (slot->name == NULL) {
+            fprintf(stderr, "Couldn't allocate memory for id cache!\n");
+            exit(3);
+        }
+        cache->count++;
+    }
+}
+
+
+/* look up an id in the cache, asking NSS on a miss */
+/* the returned string is never freed */
+static const char *idcache_get(struct idcache *cache, uint32_t id, int group) {
+    struct idcache_entry *slot = NULL;
+    struct passwd *passwd;
+    struct group *gr;
+    const char *name = NULL;
+    const char *cached;
+    /* a 32 bit number plus NULL */
+    char number[11];
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (cache->table) {
+        slot = idcache_find(cache, id);
+    }
+
+    if (slot == NULL || slot->name == NULL) {
+        cache->lookups++;
+
+        if (group) {
+            gr = getgrgid(id);
+            if (gr) {
+                name = gr->gr_name;
+            }
+        } else {
+            passwd = getpwuid(id);
+            if (passwd) {
+                name = passwd->pw_name;
+            }
+        }
+
+        /* negative cache, use the number as the name like ls does */
+        if (name == NULL) {
+            snprintf(number, sizeof(number), "%u", id);
+            name = number;
+        }
+
+        idcache_insert(cache, id, name);
+        slot = idcache_find(cache, id);
+    }
+
+    /* another thread's insert can move the slot once the lock is released, but not the name */
+    cached = slot->name;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return cached;
+}
+
+
+/* load the whole passwd and group databases in one pass each */
+/* this only returns the local files with most LDAP/SSSD setups (enumeration is usually off), anything else is looked up as it's needed */
+void idcache_prewarm(void) {
+    struct passwd *passwd;
+    struct group *gr;
+
+    pthread_mutex_lock(&users.lock);
+    setpwent();
+    while ((passwd = getpwent())) {
+        idcache_insert(&users, passwd->pw_uid, passwd->pw_name);
+    }
+    endpwent();
+    pthread_mutex_unlock(&users.lock);
+
+    pthread_mutex_lock(&groups.lock);
+    setgrent();
+    while ((gr = getgrent())) {
+        idcache_insert(&groups, gr->gr_gid, gr->gr_name);
+    }
+    endgrent();
+    pthread_mutex_unlock(&groups.lock);
+}
+
+
+/* the username for a uid, or the uid as a string if it doesn't exist */
+const char *idcache_user(uint32_t uid) {
+    return idcache_get(&users, uid, 0);
+}
+
+
+/* the group name for a gid, or the gid as a string if it doesn't exist */
+const char *idcache_group(uint32_t gid) {
+    return idcache_get(&groups, gid, 1);
+}
+
+
+/* the number of individual NSS lookups made */
+unsigned long idcache_lookups(void) {
+    return users.lookups + groups.lookups;
+}
@@ -0,0 +1,31 @@
+#ifndef IDCACHE_H
+#define IDCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* a uid or gid and its name, name is NULL for an empty slot */
+struct idcache_entry {
+    uint32_t id;
+    char *name;
+};
+
+/* open addressing hash table of ids to names */
+/* ids that don't exist are cached as their number so they are only looked up once */
+struct idcache {
+    pthread_mutex_t lock;
+    struct idcache_entry *table;
+    /* always a power of two */
+    size_t size;
+    size_t count;
+    /* calls to getpwuid()/getgrgid(), for debugging */
+    unsigned long lookups;
+};
+
+void idcache_prewarm(void);
+const char *idcache_user(uint32_t);
+const char *idcache_group(uint32_t);
+unsigned long idcache_lookups(void);
+
+#endif /* IDCACHE_H */
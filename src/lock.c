@@ -1,6 +1,7 @@
 #include "nfsping.h"
 #include "rpc.h"
 #include "util.h"
+#include "fhdb.h"
 
 /* local prototypes */
 static void usage(void);
@@ -13,6 +14,7 @@ int verbose = 0;
 void usage() {
     printf("Usage: nfslock [options]\n\
     -c n     count of lock requests to send to target\n\
+    -F file  read filehandles from a database written by nfsmount -w instead of stdin\n\
     -h       display this help and exit\n\
     -H n     frequency in Hertz (requests per second, default %i)\n\
     -l       loop forever\n\
@@ -114,12 +116,12 @@ int do_nlm_test(CLIENT *client, char *nodename, pid_t mypid, const char *host, n
 
 int main(int argc, char **argv) {
     int ch;
-    char *input_fh;
-    size_t n = 0; /* for getline() */
     targets_t dummy = { 0 };
     targets_t *targets = &dummy;
     targets_t *current = targets;
     nfs_fh_list *filehandle;
+    /* read filehandles from a database instead of stdin */
+    char *database = NULL;
     struct addrinfo hints = {
         .ai_family = AF_INET,
         /* default to UDP */
@@ -144,7 +146,7 @@ int main(int argc, char **argv) {
     int getaddr;
     char nodename[NI_MAXHOST];
 
-    while ((ch = getopt(argc, argv, "c:hH:lTv")) != -1) {
+    while ((ch = getopt(argc, argv, "c:F:hH:lTv")) != -1) {
         switch(ch) {
             /* number of locks per target */
             case 'c':
@@ -156,6 +158,10 @@ int main(int argc, char **argv) {
                     fatal("Zero count, nothing to do!\n");
                 }
                 break;
+            /* filehandle database */
+            case 'F':
+                database = optarg;
+                break;
             /* polling frequency */
             case 'H':
                 /* TODO check for reasonable values */
@@ -194,11 +200,9 @@ int main(int argc, char **argv) {
         sleep_time.tv_nsec = 1000000000 / hertz;
     }
 
-    /* no arguments, use stdin */
-    while (getline(&input_fh, &n, stdin) != -1) {
-        /* don't allocate space for results */
-        current = parse_fh(targets, input_fh, 0, timeout, 0);
-    }
+    /* no database, use stdin */
+    /* don't allocate space for results */
+    fhdb_load_or_read_fhs(database, targets, 0, timeout, 0);
 
     targets = targets->next;
 
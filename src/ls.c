@@ -1,12 +1,13 @@
 #include "nfsping.h"
 #include "rpc.h"
 #include "util.h"
-#include "xdr_copy.h"
+#include "arena.h"
+#include "idcache.h"
 #include "human.h" /* prefix_print() */
+#include "walk.h"
+#include "sort.h"
+#include "fhdb.h"
 #include <sys/stat.h> /* for file mode bits */
-#include <pwd.h> /* getpwuid() */
-#include <grp.h> /* getgrgid() */
-#include <math.h> /* for log10() */
 #include <libgen.h> /* basename() */
 
 /* globals */
@@ -22,17 +23,73 @@ enum ls_formats {
     ls_json,
 };
 
+/* symlinks from a READDIRPLUS reply waiting for READLINKs */
+struct readlink_batch {
+    targets_t *target;
+    /* the directory being listed, its arena holds the results */
+    nfs_fh_list *fh;
+    entrypluslink3 **links;
+    unsigned int count;
+    unsigned int size;
+    /* index of the next symlink to look up */
+    unsigned int next;
+};
+
+/* threads for looking up symlinks, started the first time a batch needs them and kept for the whole listing */
+struct readlink_pool {
+    /* protects the rest of the pool and the arena of the batch's directory, which isn't thread safe */
+    pthread_mutex_t lock;
+    /* signalled when there's a new batch or the threads should exit */
+    pthread_cond_t work;
+    /* signalled when the last symlink in the batch has been looked up */
+    pthread_cond_t done;
+    /* the batch being looked up, or NULL */
+    struct readlink_batch *batch;
+    /* symlinks in the batch that haven't finished */
+    unsigned int pending;
+    int stopping;
+    pthread_t *threads;
+    unsigned int count;
+};
+
+/* shared by every directory listed */
+static struct readlink_pool readlinks = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+/* column widths for long listings */
+struct ls_widths {
+    int inode;
+    int links;
+    int size;
+    int user;
+    int group;
+    int host;
+};
+
 /* local prototypes */
 static void usage(void);
-static char *do_readlink(CLIENT *, char *, char *, nfs_fh3);
-static entrypluslink3 *do_getattr(CLIENT *, char *, nfs_fh_list *);
-static entrypluslink3 *do_readdirplus(CLIENT *, char *, nfs_fh_list *);
+static enum clnt_stat do_readlink(CLIENT *, char *, char *, nfs_fh3, READLINK3res *);
+static void *readlink_worker(void *);
+static void resolve_symlinks(CLIENT *, struct readlink_batch *);
+static void readlink_pool_stop(void);
+static entrypluslink3 *do_getattr(CLIENT *, targets_t *, nfs_fh_list *);
+static entrypluslink3 *do_readdirplus(CLIENT *, targets_t *, nfs_fh_list *);
+static int dir_unchanged(CLIENT *, nfs_fh_list *);
 static char *lsperms(char *, ftype3, mode3);
+static int digits(uint64_t);
+static void long_widths(struct ls_widths *, char *, entrypluslink3 *);
+static int print_long_entries(struct ls_widths *, char *, entrypluslink3 *);
 static int print_long_listing(targets_t *);
 static void print_entrypluslink3(entrypluslink3 *, char *, char *, char *, const unsigned long usec);
 static int print_filehandles(targets_t *, nfs_fh_list *, const unsigned long);
+static void print_stream(targets_t *, nfs_fh_list *, entrypluslink3 *, const unsigned long);
 static int print_ping(targets_t *, struct nfs_fh_list *, const unsigned long);
 static void print_summary(targets_t *, enum ls_formats);
+static int walk_entry(struct walk *, struct walk_task *, entryplus3 *, void *);
+static int walk_targets(targets_t *, struct addrinfo *, struct sockaddr_in);
 
 /* global config "object" */
 static struct config {
@@ -56,6 +113,20 @@ static struct config {
     unsigned long version;
     struct timeval timeout;
     int quiet;
+    /* ls -R */
+    int recursive;
+    /* number of directories to list at once with -R */
+    unsigned int threads;
+    /* -s */
+    int stream;
+    /* -i */
+    int incremental;
+    /* -o */
+    enum sort_keys sort;
+    /* -r */
+    int reverse;
+    /* -F */
+    char *database;
 } cfg;
 
 /* default config */
@@ -71,6 +142,13 @@ const struct config CONFIG_DEFAULT = {
     .version      = 3,
     .timeout      = NFS_TIMEOUT,
     .quiet        = 0,
+    .recursive    = 0,
+    .threads      = 8,
+    .stream       = 0,
+    .incremental  = 0,
+    .sort         = sort_none,
+    .reverse      = 0,
+    .database     = NULL,
 };
 
 
@@ -86,71 +164,208 @@ List NFS files and directories from stdin\n\n\
     -c n     count of requests to send for each filehandle\n\
     -C n     same as -c, output parseable format\n\
     -d       list actual directory not contents\n\
+    -F file  read filehandles from a database written by nfsmount -w instead of stdin\n\
     -g       display sizes in gigabytes\n\
     -h       display human readable sizes (default)\n\
     -H       frequency in Hertz (requests per second, default %i)\n\
+    -i       only list directories again if they have changed (with -c or -L)\n\
     -k       display sizes in kilobytes\n\
     -l       print long listing\n\
     -L       loop forever\n\
     -m       display sizes in megabytes\n\
     -M       use the portmapper (default: %i)\n\
+    -o key   sort by name, size, mtime or inode (default server order)\n\
+    -p n     number of requests to send in parallel (directories with -R, or READLINKs, default %u)\n\
     -q       quiet, only print summary\n\
+    -r       reverse the sort order\n\
+    -R       list subdirectories recursively\n\
+    -s       print entries as they arrive instead of after the whole listing\n\
     -S addr  set source address\n\
     -t       display sizes in terabytes\n\
     -T       use TCP (default UDP)\n\
     -v       verbose output\n",
-    NFS_HERTZ, NFS_PORT); 
+    NFS_HERTZ, NFS_PORT, CONFIG_DEFAULT.threads);
 
     exit(3);
 }
 
 
 /* do a readlink to look up symlinks */
-/* return a char * to the string with the symlink name */
+/* the generated nfsproc3_readlink_3() returns a static result which isn't thread safe, so call clnt_call() directly */
+/* returns the RPC status, if it's RPC_SUCCESS the caller has to xdr_free() the result */
 /* the other calls should already have the attributes */
-char *do_readlink(CLIENT *client, char *host, char *path, nfs_fh3 fh) {
-    READLINK3res *res;
+enum clnt_stat do_readlink(CLIENT *client, char *host, char *path, nfs_fh3 fh, READLINK3res *res) {
     READLINK3args args = {
         .symlink = fh
     };
     const char *proc = "nfsproc3_readlink_3";
-    /* the result */
-    char *symlink = NULL; /* return a NULL pointer to signal failure */
-    struct rpc_err clnt_err;
+    enum clnt_stat status;
+
+    memset(res, 0, sizeof(READLINK3res));
 
     debug("nfsproc3_readlink_3(%s)\n", nfs_fh3_to_string(args.symlink));
-    res = nfsproc3_readlink_3(&args, client);
+    status = clnt_call(client, NFSPROC3_READLINK,
+        (xdrproc_t) xdr_READLINK3args, (caddr_t) &args,
+        (xdrproc_t) xdr_READLINK3res, (caddr_t) res,
+        cfg.timeout);
 
-    if (res) {
-        if (res->status == NFS3_OK) {
-            /* make a copy of the symlink to return */
-            symlink = strdup(res->READLINK3res_u.resok.data);
-        } else {
+    if (status == RPC_SUCCESS) {
+        if (res->status != NFS3_OK) {
             fprintf(stderr, "%s:%s: ", host, path);
-            clnt_geterr(client, &clnt_err);
-            clnt_err.re_status ? clnt_perror(client, proc) : nfs_perror(res->status, proc);
+            nfs_perror(res->status, proc);
         }
-   
-        /* free the result */
-        xdr_free((xdrproc_t)xdr_READLINK3res, (char *)res);
     } else {
+        fprintf(stderr, "%s:%s: ", host, path);
         clnt_perror(client, proc);
     }
 
-    return symlink;
+    return status;
+}
+
+
+/* thread for looking up symlinks in parallel */
+/* each thread takes the next symlink from the current batch until they're all done, then waits for the next batch */
+void *readlink_worker(void *arg) {
+    struct readlink_pool *pool = arg;
+    struct readlink_batch *batch;
+    targets_t *target;
+    entrypluslink3 *link;
+    READLINK3res res;
+    enum clnt_stat status;
+    CLIENT *client;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (1) {
+        while (pool->stopping == 0 && (pool->batch == NULL || pool->batch->next >= pool->batch->count)) {
+            pthread_cond_wait(&pool->work, &pool->lock);
+        }
+
+        if (pool->stopping) {
+            break;
+        }
+
+        batch = pool->batch;
+        target = batch->target;
+        link = batch->links[batch->next++];
+
+        pthread_mutex_unlock(&pool->lock);
+
+        status = RPC_CANTSEND;
+        client = rpc_pool_get(target->pool);
+        if (client) {
+            status = do_readlink(client, target->name, batch->fh->path, link->name_handle.post_op_fh3_u.handle, &res);
+            /* reconnect next time in case it was a broken TCP connection */
+            rpc_pool_put(target->pool, client, status != RPC_SUCCESS);
+        }
+
+        pthread_mutex_lock(&pool->lock);
+
+        if (status == RPC_SUCCESS) {
+            if (res.status == NFS3_OK) {
+                link->symlink = arena_strdup(batch->fh->arena, res.READLINK3res_u.resok.data);
+            }
+            xdr_free((xdrproc_t)xdr_READLINK3res, (char *)&res);
+        }
+
+        if (--pool->pending == 0) {
+            pool->batch = NULL;
+            pthread_cond_signal(&pool->done);
+        }
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+
+/* look up all of the symlinks in a batch with up to cfg.threads READLINKs outstanding at once */
+/* a single symlink is looked up with the main connection to avoid waking the threads */
+void resolve_symlinks(CLIENT *client, struct readlink_batch *batch) {
+    READLINK3res res;
+    unsigned int i;
+
+    if (batch->count == 0) {
+        return;
+    }
+
+    if (batch->count == 1 || batch->target->pool == NULL) {
+        for (i = 0; i < batch->count; i++) {
+            if (do_readlink(client, batch->target->name, batch->fh->path, batch->links[i]->name_handle.post_op_fh3_u.handle, &res) == RPC_SUCCESS) {
+                if (res.status == NFS3_OK) {
+                    batch->links[i]->symlink = arena_strdup(batch->fh->arena, res.READLINK3res_u.resok.data);
+                }
+                xdr_free((xdrproc_t)xdr_READLINK3res, (char *)&res);
+            }
+        }
+    } else {
+        /* start the threads the first time */
+        if (readlinks.threads == NULL) {
+            readlinks.count = cfg.threads;
+            readlinks.threads = calloc(readlinks.count, sizeof(pthread_t));
+            if (readlinks.threads == NULL) {
+                fatalx(3, "Couldn't allocate memory for threads!\n");
+            }
+            for (i = 0; i < readlinks.count; i++) {
+                if (pthread_create(&readlinks.threads[i], NULL, readlink_worker, &readlinks) != 0) {
+                    fatalx(3, "Couldn't create thread!\n");
+                }
+            }
+        }
+
+        pthread_mutex_lock(&readlinks.lock);
+
+        batch->next = 0;
+        readlinks.pending = batch->count;
+        readlinks.batch = batch;
+        pthread_cond_broadcast(&readlinks.work);
+
+        while (readlinks.pending) {
+            pthread_cond_wait(&readlinks.done, &readlinks.lock);
+        }
+
+        pthread_mutex_unlock(&readlinks.lock);
+    }
+
+    batch->count = 0;
+}
+
+
+/* stop the symlink threads if they were started */
+void readlink_pool_stop(void) {
+    unsigned int i;
+
+    if (readlinks.threads) {
+        pthread_mutex_lock(&readlinks.lock);
+        readlinks.stopping = 1;
+        pthread_cond_broadcast(&readlinks.work);
+        pthread_mutex_unlock(&readlinks.lock);
+
+        for (i = 0; i < readlinks.count; i++) {
+            pthread_join(readlinks.threads[i], NULL);
+        }
+
+        free(readlinks.threads);
+        readlinks.threads = NULL;
+    }
 }
 
 
 /* do a getattr to get attributes for a single file */
 /* return a single directory entry so we can share code with do_readdirplus() */
-entrypluslink3 *do_getattr(CLIENT *client, char *host, nfs_fh_list *fh) {
+entrypluslink3 *do_getattr(CLIENT *client, targets_t *target, nfs_fh_list *fh) {
+    char *host = target->name;
     GETATTR3res *res;
+    READLINK3res readlink_res;
     /* shortcut */
     struct fattr3 attributes;
     GETATTR3args args = {
         .object = fh->nfs_fh
     };
     const char *proc = "nfsproc3_getattr_3";
+    /* time the call for -s */
+    struct timespec call_start, call_end, call_elapsed;
     /* the result */
     entrypluslink3 *res_entry = NULL;
     struct rpc_err clnt_err;
@@ -161,7 +376,18 @@ entrypluslink3 *do_getattr(CLIENT *client, char *host, nfs_fh_list *fh) {
 
     /* the RPC call */
     debug("nfsproc3_getattr_3(%s)\n", nfs_fh3_to_string(args.object));
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &call_start);
+#endif
     res = nfsproc3_getattr_3(&args, client);
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &call_end);
+#endif
+    timespecsub(&call_end, &call_start, &call_elapsed);
 
     if (res) {
         if (res->status == NFS3_OK) {
@@ -173,33 +399,41 @@ entrypluslink3 *do_getattr(CLIENT *client, char *host, nfs_fh_list *fh) {
              */
             if (attributes.type == NF3DIR && cfg.listdir == 0) {
                 /* do a readdirplus */
-                res_entry = do_readdirplus(client, host, fh);
+                res_entry = do_readdirplus(client, target, fh);
 
             /* not a directory, or we're listing the directory itself */
             } else {
                 /* make an empty directory entry for the result */
-                res_entry = calloc(1, sizeof(entrypluslink3));
+                res_entry = arena_calloc(fh->arena, sizeof(entrypluslink3));
+                if (res_entry == NULL) {
+                    fatalx(3, "Couldn't allocate memory for directory entry!\n");
+                }
 
                 /* the path we were given is a filename, so chop it up */
                 /* first make a copy of the path in case basename() modifies it */
-                base = strndup(fh->path, MNTPATHLEN);
+                base = arena_strndup(fh->arena, fh->path, MNTPATHLEN);
                 /* get the base filename */
                 base = basename(base);
 
                 /* if it's a directory print a trailing slash (like ls -F) */
                 if (attributes.type == NF3DIR) {
                     /* make space for the filename plus / plus NULL */
-                    res_entry->name = calloc(strlen(base) + 2, sizeof(char));
-                    strncpy(res_entry->name, base, strlen(base));
+                    res_entry->name = arena_alloc(fh->arena, strlen(base) + 2);
+                    strcpy(res_entry->name, base);
                     /* add a trailing slash */
-                    res_entry->name[strlen(res_entry->name)] = '/';
+                    strcat(res_entry->name, "/");
                 } else {
                     /* just use the received filename */
-                    res_entry->name = strdup(base);
+                    res_entry->name = arena_strdup(fh->arena, base);
 
                     /* if it's a symlink, do another RPC to look up the target */
                     if (attributes.type == NF3LNK) {
-                        res_entry->symlink = do_readlink(client, host, fh->path, fh->nfs_fh);
+                        if (do_readlink(client, host, fh->path, fh->nfs_fh, &readlink_res) == RPC_SUCCESS) {
+                            if (readlink_res.status == NFS3_OK) {
+                                res_entry->symlink = arena_strdup(fh->arena, readlink_res.READLINK3res_u.resok.data);
+                            }
+                            xdr_free((xdrproc_t)xdr_READLINK3res, (char *)&readlink_res);
+                        }
                     }
                 }
 
@@ -217,6 +451,10 @@ entrypluslink3 *do_getattr(CLIENT *client, char *host, nfs_fh_list *fh) {
                 /* copy the filehandle */
                 memcpy(&res_entry->name_handle.post_op_fh3_u.handle, &fh->nfs_fh, sizeof(nfs_fh3));
                 res_entry->name_handle.handle_follows = 1;
+
+                if (cfg.stream) {
+                    print_stream(target, fh, res_entry, ts2us(call_elapsed));
+                }
             }
         } else {
             fprintf(stderr, "%s:%s: ", host, path);
@@ -239,8 +477,14 @@ entrypluslink3 *do_getattr(CLIENT *client, char *host, nfs_fh_list *fh) {
 
 /* do readdirplus calls to get a full list of directory entries */
 /* returns NULL if no entries found */
-entrypluslink3 *do_readdirplus(CLIENT *client, char *host, nfs_fh_list *fh) {
+entrypluslink3 *do_readdirplus(CLIENT *client, targets_t *target, nfs_fh_list *fh) {
+    char *host = target->name;
     READDIRPLUS3res *res;
+    /* symlinks in each reply are looked up in parallel once the whole reply has been copied */
+    struct readlink_batch symlinks = {
+        .target = target,
+        .fh = fh,
+    };
     /* results from server */
     entryplus3 *res_entry;
     /* our list of entries */
@@ -260,15 +504,34 @@ entrypluslink3 *do_readdirplus(CLIENT *client, char *host, nfs_fh_list *fh) {
     const char emptyverf[NFS3_COOKIEVERFSIZE] = { 0 };
     const char *proc = "nfsproc3_readdirplus_3";
     struct rpc_err clnt_err;
+    /* the directory's attributes from the first reply */
+    int dir_attributes = 0;
+    /* time each reply for -s */
+    struct timespec call_start, call_end, call_elapsed;
+
 
+    /* forget the old listing's times until the new one is complete */
+    fh->cached = 0;
 
     /* the RPC call */
     debug("nfsproc3_readdirplus_3(%s, %llu)\n", nfs_fh3_to_string(args.dir), (long long unsigned)args.cookie);
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &call_start);
+#endif
     res = nfsproc3_readdirplus_3(&args, client);
 
     if (res) {
         /* loop through results, might take multiple calls for the whole directory */
         while (res) {
+#ifdef CLOCK_MONOTONIC_RAW
+            clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
+#else
+            clock_gettime(CLOCK_MONOTONIC, &call_end);
+#endif
+            timespecsub(&call_end, &call_start, &call_elapsed);
+
             if (res->status == NFS3_OK) {
                 /* check to see if the cookieverf has changed
                  * this could mean the directory has been modified underneath us
@@ -292,8 +555,24 @@ entrypluslink3 *do_readdirplus(CLIENT *client, char *host, nfs_fh_list *fh) {
                     }
                 }
 
+                /* store the times from the start of the listing, if the directory changes while it's being read */
+                /* the next GETATTR won't match and it will be listed again */
+                if (dir_attributes == 0 && res->READDIRPLUS3res_u.resok.dir_attributes.attributes_follow) {
+                    fh->mtime = res->READDIRPLUS3res_u.resok.dir_attributes.post_op_attr_u.attributes.mtime;
+                    fh->ctime = res->READDIRPLUS3res_u.resok.dir_attributes.post_op_attr_u.attributes.ctime;
+                    dir_attributes = 1;
+                }
+
                 res_entry = res->READDIRPLUS3res_u.resok.reply.entries;
 
+                /* when streaming only keep one reply's worth of entries in memory */
+                /* the last nonempty reply is returned so the caller can still tell that the listing worked */
+                if (cfg.stream && res_entry) {
+                    arena_reset(fh->arena);
+                    dummy.next = NULL;
+                    current = &dummy;
+                }
+
                 /* loop through the directory entries in the RPC result */
                 while (res_entry) {
                     /* first check for hidden files */
@@ -303,30 +582,51 @@ entrypluslink3 *do_readdirplus(CLIENT *client, char *host, nfs_fh_list *fh) {
                         continue;
                     }
 
-                    /* allocate a new entrypluslink and copy the data from the entryplus result */
-                    current->next = calloc(1, sizeof(entrypluslink3));
+                    /* allocate a new entrypluslink from the listing's arena */
+                    current->next = arena_alloc(fh->arena, sizeof(entrypluslink3));
+                    if (current->next == NULL) {
+                        fatalx(3, "Couldn't allocate memory for directory entry!\n");
+                    }
                     current = current->next;
                     current->next = NULL;
+                    current->symlink = NULL;
 
-                    /* copy the entry into the output list */
-                    XDR_COPY(entryplus3, current, res_entry);
+                    /* copy the entry from the result, the attributes are all fixed size */
+                    /* only the name and filehandle point into the result so they need their own copies */
+                    current->entryplus = *res_entry;
+
+                    if (current->name_handle.handle_follows) {
+                        current->name_handle.post_op_fh3_u.handle.data.data_val = arena_memdup(fh->arena,
+                            res_entry->name_handle.post_op_fh3_u.handle.data.data_val,
+                            res_entry->name_handle.post_op_fh3_u.handle.data.data_len);
+                    }
 
                     /* if it's a directory print a trailing slash (like ls -F) */
                     /* TODO this seems to be 0 sometimes */
                     if (current->name_attributes.post_op_attr_u.attributes.type == NF3DIR) {
                         /* make space for the filename plus / plus NULL */
-                        current->name = calloc(strlen(res_entry->name) + 2, sizeof(char));
-                        strncpy(current->name, res_entry->name, strlen(res_entry->name));
+                        current->name = arena_alloc(fh->arena, strlen(res_entry->name) + 2);
+                        strcpy(current->name, res_entry->name);
                         /* add a trailing slash */
-                        current->name[strlen(res_entry->name)] = '/';
+                        strcat(current->name, "/");
                     /* check for symlinks and do a READLINK */
                     } else if (current->name_attributes.post_op_attr_u.attributes.type == NF3LNK) {
-                        /* use the filehandle from the current result entry for the readlink */
-                        current->symlink = do_readlink(client, host, fh->path, current->name_handle.post_op_fh3_u.handle);
-                        current->name = strdup(res_entry->name);
+                        current->name = arena_strdup(fh->arena, res_entry->name);
+
+                        /* add it to the batch of symlinks to look up at the end of this reply */
+                        if (current->name_handle.handle_follows) {
+                            if (symlinks.count == symlinks.size) {
+                                symlinks.size = symlinks.size ? symlinks.size * 2 : 64;
+                                symlinks.links = realloc(symlinks.links, symlinks.size * sizeof(entrypluslink3 *));
+                                if (symlinks.links == NULL) {
+                                    fatalx(3, "Couldn't allocate memory for symlinks!\n");
+                                }
+                            }
+                            symlinks.links[symlinks.count++] = current;
+                        }
                     /* not a directory or link, just use the received filename */
                     } else {
-                        current->name = strdup(res_entry->name);
+                        current->name = arena_strdup(fh->arena, res_entry->name);
                     }
 
                     /* update the directory cookie in case we have to make another call for more entries */
@@ -351,6 +651,13 @@ entrypluslink3 *do_readdirplus(CLIENT *client, char *host, nfs_fh_list *fh) {
                     res_entry = res_entry->nextentry;
                 }
 
+                /* READLINK all of the symlinks from this reply at once */
+                resolve_symlinks(client, &symlinks);
+
+                if (cfg.stream && res->READDIRPLUS3res_u.resok.reply.entries) {
+                    print_stream(target, fh, dummy.next, ts2us(call_elapsed));
+                }
+
                 /* check for the end of directory */
                 if (res->READDIRPLUS3res_u.resok.reply.eof == 0) {
                     /* do another RPC call for more entries */
@@ -360,6 +667,11 @@ entrypluslink3 *do_readdirplus(CLIENT *client, char *host, nfs_fh_list *fh) {
                     xdr_free((xdrproc_t)xdr_READDIRPLUS3res, (char *)res);
                     /* new RPC call */
                     debug("nfsproc3_readdirplus_3(%s, %llu)\n", nfs_fh3_to_string(args.dir), (long long unsigned)args.cookie);
+#ifdef CLOCK_MONOTONIC_RAW
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+#else
+                    clock_gettime(CLOCK_MONOTONIC, &call_start);
+#endif
                     res = nfsproc3_readdirplus_3(&args, client);
 
                     if (res == NULL) {
@@ -368,13 +680,16 @@ entrypluslink3 *do_readdirplus(CLIENT *client, char *host, nfs_fh_list *fh) {
 
                     continue;
                 }
+
+                /* the whole directory has been read, keep the entries for next time */
+                fh->cached = dir_attributes && cfg.incremental;
             /* !NFS3_OK */
             } else {
                 /* TODO check for NFS3ERR_BAD_COOKIE which means the directory changed underneath us */
                 /* it's a file, do a getattr instead */
                 if (res->status == NFS3ERR_NOTDIR) {
                     /* do_getattr() can call do_readdirplus() but only if it finds a directory, so this shouldn't loop */
-                    current->next = do_getattr(client, host, fh);
+                    current->next = do_getattr(client, target, fh);
                 } else {
                     fprintf(stderr, "%s:%s: ", host, fh->path);
                     clnt_geterr(client, &clnt_err);
@@ -391,10 +706,43 @@ entrypluslink3 *do_readdirplus(CLIENT *client, char *host, nfs_fh_list *fh) {
         clnt_perror(client, proc);
     }  
 
+    free(symlinks.links);
+
     return dummy.next;
 }
 
 
+/* send a single GETATTR to see if a directory has changed since it was listed */
+/* returns 1 if the mtime and ctime are the same, 0 if it has changed or the GETATTR failed (the READDIRPLUS will report any errors) */
+int dir_unchanged(CLIENT *client, nfs_fh_list *fh) {
+    GETATTR3res *res;
+    GETATTR3args args = {
+        .object = fh->nfs_fh
+    };
+    struct fattr3 *attributes;
+    int unchanged = 0;
+
+    debug("nfsproc3_getattr_3(%s)\n", nfs_fh3_to_string(args.object));
+    res = nfsproc3_getattr_3(&args, client);
+
+    if (res) {
+        if (res->status == NFS3_OK) {
+            attributes = &res->GETATTR3res_u.resok.obj_attributes;
+
+            unchanged = attributes->type == NF3DIR &&
+                attributes->mtime.seconds  == fh->mtime.seconds &&
+                attributes->mtime.nseconds == fh->mtime.nseconds &&
+                attributes->ctime.seconds  == fh->ctime.seconds &&
+                attributes->ctime.nseconds == fh->ctime.nseconds;
+        }
+
+        xdr_free((xdrproc_t)xdr_GETATTR3res, (char *)res);
+    }
+
+    return unchanged;
+}
+
+
 /* generate a string of the file type and permissions bits of a file like ls -l */
 /* based on http://stackoverflow.com/questions/10323060/printing-file-permissions-like-ls-l-using-stat2-in-c */
 char *lsperms(char *bits, ftype3 type, mode3 mode) {
@@ -427,6 +775,52 @@ char *lsperms(char *bits, ftype3 type, mode3 mode) {
 };
 
 
+/* number of decimal digits in a number, for justifying columns */
+int digits(uint64_t n) {
+    int count = 1;
+
+    while (n >= 10) {
+        n /= 10;
+        count++;
+    }
+
+    return count;
+}
+
+
+/* find the widest value in each column of a long listing for a list of directory entries */
+/* the widths only ever grow, so this can be called again as more entries arrive */
+void long_widths(struct ls_widths *widths, char *host, entrypluslink3 *current) {
+    /* shortcut */
+    struct fattr3 attributes;
+    const char *user, *group;
+
+    /* find the longest hostname */
+    if ((int)strlen(host) > widths->host) {
+        widths->host = strlen(host);
+    }
+
+    while (current) {
+        if (current->name_attributes.attributes_follow) {
+            /* shortcut */
+            attributes = current->name_attributes.post_op_attr_u.attributes;
+
+            widths->inode = digits(attributes.fileid) > widths->inode ? digits(attributes.fileid) : widths->inode;
+            widths->links = digits(attributes.nlink) > widths->links ? digits(attributes.nlink) : widths->links;
+            widths->size  = digits(attributes.size) > widths->size ? digits(attributes.size) : widths->size;
+
+            user = idcache_user(attributes.uid);
+            widths->user = (int)strlen(user) > widths->user ? (int)strlen(user) : widths->user;
+
+            group = idcache_group(attributes.gid);
+            widths->group = (int)strlen(group) > widths->group ? (int)strlen(group) : widths->group;
+        }
+
+        current = current->next;
+    }
+}
+
+
 /* ls -l */
 /* loop through a list of directory entries printing a long listing for each */
 /* our format:
@@ -434,13 +828,9 @@ char *lsperms(char *bits, ftype3 type, mode3 mode) {
  */
 /* TODO print milliseconds response time - how to format for directories with a single readdirplus? multiple readdirplus? ..? */
 /* TODO -F to print trailing slash for directories */
-/* TODO cache/memoise uid/gid lookups */
-/* BSD has functions user_from_uid() and group_from_gid() */
-/* gnulib has getuser() and getgroup() */
-int print_long_listing(targets_t *targets) {
-    targets_t *target = targets;
-    struct nfs_fh_list *fh;
-    entrypluslink3 *current;
+/* uid/gid lookups are cached in idcache.c */
+/* returns the number of entries printed */
+int print_long_entries(struct ls_widths *widths, char *host, entrypluslink3 *current) {
     /* shortcut */
     struct fattr3 attributes;
     struct fattr3 empty_attributes = { 0 };
@@ -451,152 +841,110 @@ int print_long_listing(targets_t *targets) {
     char bits[11];
     /* string for storing the formatted file size */
     char filesize[max_prefix_width];
-    struct passwd *passwd;
-    struct group  *group;
+    const char *user, *group;
     struct tm     *mtime;
     /* timestamp in ISO 8601 format */
     /* 2000-12-25 22:23:34 + terminating NULL */
     char buf[20];
-    /* pointer to which hostname string to use */
-    char *host_p;
     /* pointer to which filename string to use */
     char *name_p;
     char *symlink = NULL;
-    /* sizes for justifying columns */
-    /* set these to 1 so log10() doesn't have 0 as an input and returns -HUGE_VAL */
-    /* we're always going to need one space to output "0" */
-    uint64        maxinode = 1;
-    unsigned long maxlinks = 1;
-    size3         maxsize  = 1;
-    size_t        maxuser  = 0;
-    size_t        maxgroup = 0;
-    size_t        maxhost  = 0;
 
+    while (current) {
+        count++;
 
-    /* first loop through all targets and entries to find longest strings for justifying columns */
-    while (target) {
-        /* which name to use, IP address or hostname */
-        host_p = cfg.display_ips ? target->ip_address : target->name;
-
-        /* find the longest hostname */
-        maxhost = strlen(host_p) > maxhost ? strlen(host_p) : maxhost;
-
-        fh = target->filehandles;
-
-        while (fh) {
-            current = fh->entries;
-
-            while (current) {
-                count++;
-
-                if (current->name_attributes.attributes_follow) {
-                    /* shortcut */
-                    attributes = current->name_attributes.post_op_attr_u.attributes;
-
-                    maxinode = attributes.fileid > maxinode ? attributes.fileid : maxinode;
-                    maxlinks = attributes.nlink > maxlinks ? attributes.nlink : maxlinks;
-                    maxsize = attributes.size > maxsize ? attributes.size : maxsize;
+        if (current->name_attributes.attributes_follow) {
+            attributes = current->name_attributes.post_op_attr_u.attributes;
+        } else {
+            attributes = empty_attributes;
+        }
 
-                    /* TODO cache this ! */
-                    passwd = getpwuid(attributes.uid);
-                    maxuser = strlen(passwd->pw_name) > maxuser ? strlen(passwd->pw_name) : maxuser;
+        /* look up username and group locally */
+        /* TODO -n option to keep uid/gid */
+        /* ids that don't exist locally are printed as numbers */
+        user  = idcache_user(attributes.uid);
+        group = idcache_group(attributes.gid);
+
+        /* format to ISO 8601 timestamp */
+        /* this converts an unsigned 32 bit seconds to a signed 32 bit time_t which doesn't always do what is expected! */
+        /* TODO detect values greater than 32 bit signed max and treat them as signed? */
+        /* Solaris has a setting nfs_allow_preepoch_time for this, make it into an option? */
+        /* TODO print a message in gcc output acknowledging this warning */
+        mtime = localtime(&attributes.mtime.seconds);
+        /* TODO check return value, should always be 19 */
+        strftime(buf, 20, "%Y-%m-%d %H:%M:%S", mtime);
+
+        if (attributes.type == NF3LNK) {
+            /* TODO just allocate to name_p? */
+            asprintf(&symlink, "%s -> %s", current->name, current->symlink);
+            name_p = symlink;
+        } else {
+            name_p = current->name;
+        }
 
-                    /* TODO cache this ! */
-                    group = getgrgid(attributes.gid);
-                    maxgroup = strlen(group->gr_name) > maxgroup ? strlen(group->gr_name) : maxgroup;
-                }
+        prefix_print(attributes.size, filesize, cfg.prefix);
+
+        /* printf only accepts ints for field widths with * */
+        printf("%*llu %s %*lu %-*s %-*s %-*s %s %-*s %s\n",
+            /* inode */
+            widths->inode, (unsigned long long)attributes.fileid,
+            /* permissions bits */
+            lsperms(bits, attributes.type, attributes.mode),
+            /* number of links */
+            widths->links, attributes.nlink,
+            /* username */
+            widths->user, user,
+            /* group */
+            widths->group, group,
+            /* file size */
+            widths->size, filesize,
+            /* date + time */
+            buf,
+            /* hostname */
+            widths->host, host,
+            /* filename */
+            name_p);
+
+        if (symlink) {
+            free(symlink);
+            symlink = NULL;
+        }
 
-                current = current->next;
-            } /* while (current) */
+        current = current->next;
+    }
 
-            fh = fh->next;
-        } /* while (fh) */
+    return count;
+}
 
-        target = target->next;
-    } /* while (target) */
 
-    /* calculate the maximum string widths */
-    maxinode = floor(log10(abs(maxinode))) + 1;
-    maxlinks = floor(log10(abs(maxlinks))) + 1;
-    maxsize  = floor(log10(abs(maxsize))) + 1;
+/* print a long listing of all targets and filehandles */
+/* do this once so output can be justified to longest user/group name */
+/* returns the number of entries printed */
+int print_long_listing(targets_t *targets) {
+    targets_t *target;
+    struct nfs_fh_list *fh;
+    /* sizes for justifying columns */
+    /* we're always going to need one space to output "0" */
+    struct ls_widths widths = {
+        .inode = 1,
+        .links = 1,
+        .size  = 1,
+    };
+    int count = 0;
 
-    /* reset to start of target list */
-    target = targets;
+    /* first loop through all targets and entries to find longest strings for justifying columns */
+    for (target = targets; target; target = target->next) {
+        for (fh = target->filehandles; fh; fh = fh->next) {
+            /* which name to use, IP address or hostname */
+            long_widths(&widths, cfg.display_ips ? target->ip_address : target->name, fh->entries);
+        }
+    }
 
     /* now loop through and print each entry */
-    while(target) {
-        fh = target->filehandles;
-
-        /* which name to use, IP address or hostname */
-        host_p = cfg.display_ips ? target->ip_address : target->name;
-
-        while (fh) {
-            current = fh->entries;
-
-            while (current) {
-                if (current->name_attributes.attributes_follow) {
-                    attributes = current->name_attributes.post_op_attr_u.attributes;
-                } else {
-                    attributes = empty_attributes;
-                }
-
-                    /* look up username and group locally */
-                    /* TODO -n option to keep uid/gid */
-                    /* TODO check for NULL return value */
-                    passwd = getpwuid(attributes.uid);
-                    group  = getgrgid(attributes.gid);
-
-                    /* format to ISO 8601 timestamp */
-                    /* this converts an unsigned 32 bit seconds to a signed 32 bit time_t which doesn't always do what is expected! */
-                    /* TODO detect values greater than 32 bit signed max and treat them as signed? */
-                    /* Solaris has a setting nfs_allow_preepoch_time for this, make it into an option? */
-                    /* TODO print a message in gcc output acknowledging this warning */
-                    mtime = localtime(&attributes.mtime.seconds);
-                    /* TODO check return value, should always be 19 */
-                    strftime(buf, 20, "%Y-%m-%d %H:%M:%S", mtime);
-
-                    if (attributes.type == NF3LNK) {
-                        /* TODO just allocate to name_p? */
-                        asprintf(&symlink, "%s -> %s", current->name, current->symlink);
-                        name_p = symlink;
-                    } else {
-                        name_p = current->name;
-                    }
-
-                    prefix_print(attributes.size, filesize, cfg.prefix);
-
-                /* have to cast size_t to int for compiler warning (-Wformat) */
-                /* printf only accepts ints for field widths with * */
-                printf("%*llu %s %*lu %-*s %-*s %-*s %s %-*s %s\n",
-                    /* inode */
-                    (int)maxinode, (unsigned long long)attributes.fileid,
-                    /* permissions bits */
-                    lsperms(bits, attributes.type, attributes.mode),
-                    /* number of links */
-                    (int)maxlinks, attributes.nlink,
-                    /* username */
-                    (int)maxuser, passwd->pw_name,
-                    /* group */
-                    (int)maxgroup, group->gr_name,
-                    /* file size */
-                    (int)maxsize, filesize,
-                    /* date + time */
-                    buf,
-                    /* hostname */
-                    (int)maxhost, host_p,
-                    /* filename */
-                    name_p);
-
-                /* TODO */
-                //free(symlink);
-
-                current = current->next;
-            }
-
-            fh = fh->next;
+    for (target = targets; target; target = target->next) {
+        for (fh = target->filehandles; fh; fh = fh->next) {
+            count += print_long_entries(&widths, cfg.display_ips ? target->ip_address : target->name, fh->entries);
         }
-
-        target = target->next;
     }
 
     return count;
@@ -688,6 +1036,34 @@ int print_filehandles(targets_t *target, struct nfs_fh_list *fh, const unsigned
 }
 
 
+/* print the entries from a single READDIRPLUS reply (or GETATTR) as soon as it arrives with -s */
+/* long listing columns are justified to the widest value seen so far so they only ever grow */
+void print_stream(targets_t *target, struct nfs_fh_list *fh, entrypluslink3 *current, const unsigned long usec) {
+    static struct ls_widths widths = {
+        .inode = 1,
+        .links = 1,
+        .size  = 1,
+    };
+    char *host = cfg.display_ips ? target->ip_address : target->name;
+
+    if (cfg.format == ls_longform) {
+        long_widths(&widths, host, current);
+        print_long_entries(&widths, host, current);
+    } else {
+        while (current) {
+            /* if there is no filehandle (/dev, /proc, etc) don't print */
+            if (current->name_handle.post_op_fh3_u.handle.data.data_len) {
+                print_entrypluslink3(current, target->name, target->ip_address, fh->path, usec);
+            }
+
+            current = current->next;
+        }
+    }
+
+    fflush(stdout);
+}
+
+
 /* print fping style output */
 int print_ping(targets_t *target, struct nfs_fh_list *fh, const unsigned long usec) {
     entrypluslink3 *current = fh->entries;
@@ -802,10 +1178,99 @@ void print_summary(targets_t *targets, enum ls_formats format) {
 }
 
 
+/* print each entry found during a recursive listing */
+/* called from the walker threads, each entry is printed with a single printf() so lines don't get mixed up */
+int walk_entry(struct walk *walk, struct walk_task *dir, entryplus3 *res_entry, void *arg) {
+    entrypluslink3 link = { 0 };
+    char slashed[MNTPATHLEN];
+
+    (void)walk;
+    (void)arg;
+
+    /* skip hidden files, and don't descend into hidden directories */
+    if (cfg.listdot == 0 && res_entry->name[0] == '.') {
+        return 0;
+    }
+
+    if (cfg.quiet == 0 && res_entry->name_handle.post_op_fh3_u.handle.data.data_len) {
+        link.entryplus = *res_entry;
+
+        /* if it's a directory print a trailing slash (like ls -F) so it can be piped back into nfsls */
+        if (res_entry->name_attributes.post_op_attr_u.attributes.type == NF3DIR) {
+            snprintf(slashed, sizeof(slashed), "%s/", res_entry->name);
+            link.name = slashed;
+        }
+
+        print_entrypluslink3(&link, dir->target->name, dir->target->ip_address, dir->path, dir->usec);
+    }
+
+    return 1;
+}
+
+
+/* recursively list all of the directories from stdin using a pool of threads */
+/* returns the number of errors */
+int walk_targets(targets_t *targets, struct addrinfo *hints, struct sockaddr_in src_ip) {
+    struct walk *walk;
+    targets_t *current;
+    nfs_fh_list *filehandle;
+    struct timespec start, end, elapsed;
+    unsigned long errors;
+    double seconds;
+
+    walk = walk_new(cfg.threads, cfg.timeout, walk_entry, NULL);
+    if (walk == NULL) {
+        fatalx(3, "Couldn't allocate memory for directory walk!\n");
+    }
+
+    for (current = targets; current; current = current->next) {
+        /* each server gets up to one connection for each thread */
+        current->pool = rpc_pool_new(current->client_sock, hints, NFS_PROGRAM, cfg.version, cfg.timeout, src_ip, cfg.threads, 1);
+
+        for (filehandle = current->filehandles; filehandle; filehandle = filehandle->next) {
+            walk_add(walk, current, &filehandle->nfs_fh, filehandle->path);
+        }
+    }
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+
+    errors = walk_run(walk);
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &end);
+#endif
+
+    fflush(stdout);
+
+    timespecsub(&end, &start, &elapsed);
+    seconds = ts2us(elapsed) / 1000000.0;
+
+    fprintf(stderr, "%lu directories, %lu entries in %.3f s (%.0f entries/s, %lu errors)\n",
+        walk->dirs,
+        walk->entries,
+        seconds,
+        seconds > 0 ? walk->entries / seconds : 0,
+        errors);
+    debug("%lu directories stolen between threads\n", walk->steals);
+
+    for (current = targets; current; current = current->next) {
+        current->pool = rpc_pool_destroy(current->pool);
+    }
+
+    walk_free(walk);
+
+    return errors;
+}
+
+
 int main(int argc, char **argv) {
     int ch; /* getopt */
-    char   *input_fh  = NULL;
-    size_t  input_len = 0;
     targets_t dummy = { 0 };
     targets_t *targets = &dummy;
     targets_t *current;
@@ -832,10 +1297,14 @@ int main(int argc, char **argv) {
     unsigned long ls_sent = 0;
     /* count of successful requests */
     unsigned long ls_ok   = 0;
+    /* -i directory cache */
+    int unchanged;
+    unsigned long cache_checks = 0;
+    unsigned long cache_hits   = 0;
 
     cfg = CONFIG_DEFAULT;
 
-    while ((ch = getopt(argc, argv, "aAbc:C:dghH:klLmMqS:tTv")) != -1) {
+    while ((ch = getopt(argc, argv, "aAbc:C:dF:ghH:iklLmMo:p:qrRsS:tTv")) != -1) {
         switch(ch) {
             /* list hidden files */
             case 'a':
@@ -887,6 +1356,10 @@ int main(int argc, char **argv) {
             case 'd':
                 cfg.listdir = 1;
                 break;
+            /* filehandle database */
+            case 'F':
+                cfg.database = optarg;
+                break;
             /* display gigabytes */
             case 'g':
                 if (cfg.prefix == NONE) {
@@ -908,6 +1381,10 @@ int main(int argc, char **argv) {
                 /* TODO check for reasonable values */
                 hertz = strtoul(optarg, NULL, 10);
                 break;
+            /* skip unchanged directories */
+            case 'i':
+                cfg.incremental = 1;
+                break;
             /* display kilobytes */
             case 'k':
                 if (cfg.prefix == NONE) {
@@ -948,11 +1425,37 @@ int main(int argc, char **argv) {
             case 'M':
                 cfg.port = 0;
                 break;
+            /* sort order */
+            case 'o':
+                cfg.sort = sort_key(optarg);
+                if (cfg.sort == sort_none) {
+                    fatal("Unknown sort key: %s\n", optarg);
+                }
+                break;
+            /* parallel directories */
+            case 'p':
+                cfg.threads = strtoul(optarg, NULL, 10);
+                if (cfg.threads == 0) {
+                    fatal("Need at least one thread!\n");
+                }
+                break;
             /* quiet */
             case 'q':
                 /* TODO check for conflicts with -l etc */
                 cfg.quiet = 1;
                 break;
+            /* reverse sort */
+            case 'r':
+                cfg.reverse = 1;
+                break;
+            /* recursive */
+            case 'R':
+                cfg.recursive = 1;
+                break;
+            /* print entries as they arrive */
+            case 's':
+                cfg.stream = 1;
+                break;
             /* source ip address for packets */
             case 'S':
                 if (inet_pton(AF_INET, optarg, &src_ip.sin_addr) != 1) {
@@ -999,23 +1502,54 @@ int main(int argc, char **argv) {
         sleep_time.tv_nsec = 1000000000 / hertz;
     }
 
-    /* no arguments, use stdin */
-    while (getline(&input_fh, &input_len, stdin) != -1) {
-        if (cfg.format == ls_fping || cfg.format == ls_longform) {
-            current = parse_fh(targets, input_fh, cfg.port, cfg.timeout, cfg.count);
-        } else {
-            /* don't allocate space for results */
-            current = parse_fh(targets, input_fh, cfg.port, cfg.timeout, 0);
-        }
+    /* no database, use stdin */
+    if (cfg.format == ls_fping || cfg.format == ls_longform) {
+        fhdb_load_or_read_fhs(cfg.database, targets, cfg.port, cfg.timeout, cfg.count);
+    } else {
+        /* don't allocate space for results */
+        fhdb_load_or_read_fhs(cfg.database, targets, cfg.port, cfg.timeout, 0);
     }
 
     /* skip the dummy entry */
     targets = targets->next;
 
+    if (cfg.stream && cfg.format != ls_json && cfg.format != ls_longform) {
+        fatal("Streaming only supports JSON or long listing output!\n");
+    }
+
+    /* the whole listing is needed to sort it */
+    if (cfg.sort != sort_none && (cfg.stream || cfg.recursive)) {
+        fatal("Can't sort streamed or recursive listings!\n");
+    }
+
+    /* streaming doesn't keep the entries around to reuse */
+    if (cfg.stream && cfg.incremental) {
+        fatal("Can't combine -i and -s!\n");
+    }
+
+    if (cfg.recursive) {
+        if (cfg.format != ls_json) {
+            fatal("Recursive listings only support JSON output!\n");
+        }
+
+        /* listen for ctrl-c */
+        signal(SIGINT, sigint_handler);
+
+        /* don't quit on (TCP) broken pipes */
+        signal(SIGPIPE, SIG_IGN);
+
+        return walk_targets(targets, &hints, src_ip) ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     /* set timezone for date output */
     /* TODO only with long_listing set? */
     tzset();
 
+    /* load the local users and groups in one go rather than one lookup per file */
+    if (cfg.format == ls_longform) {
+        idcache_prewarm();
+    }
+
     /* listen for ctrl-c */
     signal(SIGINT, sigint_handler);
 
@@ -1034,8 +1568,13 @@ int main(int argc, char **argv) {
             if (current->client == NULL) {
                 /* connect to server */
                 current->client = create_rpc_client(current->client_sock, &hints, NFS_PROGRAM, cfg.version, cfg.timeout, src_ip);
-                auth_destroy(current->client->cl_auth);
-                current->client->cl_auth = authunix_create_default();
+                if (current->client) {
+                    auth_destroy(current->client->cl_auth);
+                    current->client->cl_auth = authunix_create_default();
+
+                    /* extra connections for looking up symlinks in parallel */
+                    current->pool = rpc_pool_new(current->client_sock, &hints, NFS_PROGRAM, cfg.version, cfg.timeout, src_ip, cfg.threads, 1);
+                }
             }
 
             if (current->client) {
@@ -1049,13 +1588,40 @@ int main(int argc, char **argv) {
                     clock_gettime(CLOCK_MONOTONIC, &call_start);
 #endif
 
-                    /* if we're listing directories, do a getattr no matter what */
-                    /* check for a trailing slash to see if we need to do readdirplus or getattr */
-                    if (cfg.listdir || filehandle->path[strlen(filehandle->path) - 1] != '/') {
-                        filehandle->entries = do_getattr(current->client, current->name, filehandle);
+                    /* with -i check if the directory has changed since the last round before reading it all again */
+                    unchanged = 0;
+                    if (filehandle->cached) {
+                        cache_checks++;
+                        unchanged = dir_unchanged(current->client, filehandle);
+                    }
+
+                    if (unchanged) {
+                        /* keep the entries from the last round */
+                        cache_hits++;
                     } else {
-                        /* store the directory entries in the filehandle list */
-                        filehandle->entries = do_readdirplus(current->client, current->name, filehandle);
+                        /* throw away the entries from the last round */
+                        if (filehandle->arena) {
+                            arena_reset(filehandle->arena);
+                        } else {
+                            filehandle->arena = arena_new(0);
+                            if (filehandle->arena == NULL) {
+                                fatalx(3, "Couldn't allocate memory for directory entries!\n");
+                            }
+                        }
+
+                        /* if we're listing directories, do a getattr no matter what */
+                        /* check for a trailing slash to see if we need to do readdirplus or getattr */
+                        if (cfg.listdir || filehandle->path[strlen(filehandle->path) - 1] != '/') {
+                            filehandle->entries = do_getattr(current->client, current, filehandle);
+                        } else {
+                            /* store the directory entries in the filehandle list */
+                            filehandle->entries = do_readdirplus(current->client, current, filehandle);
+                        }
+
+                        /* reused entries are already sorted */
+                        if (cfg.sort != sort_none) {
+                            filehandle->entries = sort_entries(filehandle->entries, cfg.sort, cfg.reverse, cfg.threads, filehandle->arena);
+                        }
                     }
 
 #ifdef CLOCK_MONOTONIC_RAW
@@ -1091,7 +1657,8 @@ int main(int argc, char **argv) {
                     some option to print raw request results in JSON including cookie (-d?)
                     */
 
-                    if (cfg.format == ls_json) {
+                    /* streamed entries have already been printed */
+                    if (cfg.format == ls_json && cfg.stream == 0) {
                         print_filehandles(current, filehandle, usec);
                     } else if (!cfg.quiet && (cfg.format == ls_ping || cfg.format == ls_fping)) {
                         print_ping(current, filehandle, usec);
@@ -1118,7 +1685,7 @@ int main(int argc, char **argv) {
 
         /* pass the whole list for printing long listing */
         /* do this once so output can be justified to longest user/group name */
-        if (cfg.format == ls_longform) {
+        if (cfg.format == ls_longform && cfg.stream == 0) {
             print_long_listing(targets);
         }
 
@@ -1148,9 +1715,23 @@ int main(int argc, char **argv) {
         }
     } /* while (1) */
 
+    /* the threads have all returned their connections */
+    readlink_pool_stop();
+
+    for (current = targets; current; current = current->next) {
+        current->pool = rpc_pool_destroy(current->pool);
+    }
+
     /* if looping or counting, print a summary */
     if (cfg.loop || cfg.count) {
         print_summary(targets, cfg.format);
+
+        if (cfg.incremental) {
+            fprintf(stderr, "directory cache: %lu/%lu unchanged (%.0f%% hit rate)\n",
+                cache_hits,
+                cache_checks,
+                cache_checks ? cache_hits * 100.0 / cache_checks : 0);
+        }
     }
 
     /* return success if all requests came back ok */
@@ -6,11 +6,46 @@
 #include "nfsping.h"
 #include "rpc.h"
 #include "util.h"
+#include "fhdb.h"
+
+/* xdr_void() is declared without arguments, casting through a plain function pointer keeps -Wcast-function-type quiet */
+#define xdr_void_proc ((xdrproc_t)(void (*)(void)) xdr_void)
+
+/* a server's queue of exports when mounting in parallel */
+struct mount_server {
+    targets_t *target;
+    /* the result of the EXPORT call if no path was given, freed with xdr_free() */
+    exports ex;
+    /* the next export to mount this round */
+    struct mount_exports *next;
+    /* number of MNTs outstanding, limited by the size of the target's connection pool */
+    unsigned int active;
+};
+
+/* shared state for all of the threads mounting in parallel */
+struct mount_job {
+    pthread_mutex_t lock;
+    /* signalled when a mount finishes and a server might have a free slot */
+    pthread_cond_t done;
+    struct mount_server *servers;
+    unsigned int server_count;
+    /* the next server to send an EXPORT to */
+    unsigned int next_export;
+    /* the next server to send the deferred UMNTs to with -k */
+    unsigned int next_unmount;
+    /* servers are picked round robin so one server's exports don't starve the others */
+    unsigned int next_server;
+    /* for aligning the output */
+    int width;
+    /* counters for results */
+    unsigned long sent;
+    unsigned long ok;
+};
 
 /* local prototypes */
 static void usage(void);
 static void mount_perror(mountstat3);
-static exports get_exports(struct targets *);
+static exports get_exports(CLIENT *, struct targets *);
 static mountres3 *fhstatus_to_mountres3(fhstatus *);
 static mountres3 *copy_mountres3(mountres3 *);
 static void free_mountres3(mountres3 *);
@@ -18,7 +53,13 @@ static mountres3 *mountproc_mnt_x(char *, CLIENT *);
 static fhandle3 *get_root_filehandle(CLIENT *, char *, char *, fhandle3 *, unsigned long *);
 static void unmount_client(CLIENT *, char *);
 static int print_exports(char *, struct exportnode *);
-static struct mount_exports *make_exports(targets_t *);
+static struct mount_exports *make_exports(targets_t *, exports);
+static void *export_worker(void *);
+static void mount_export(struct mount_job *, targets_t *, struct mount_exports *);
+static void *mount_worker(void *);
+static void *unmount_worker(void *);
+static void run_workers(void *(*)(void *), struct mount_job *, unsigned int);
+static void make_pools(struct mount_job *, struct addrinfo *, struct sockaddr_in);
 static int print_fhandle3(JSON_Value *, const fhandle3, const unsigned long, const struct timespec);
 void print_output(enum outputs, const char *, const int, const char *, const char *, struct mount_exports *, const fhandle3, const struct timespec, unsigned long);
 void print_summary(targets_t *, enum outputs, const int, const int);
@@ -41,8 +82,17 @@ static struct config {
     int quiet;
     int reconnect;
     int unmount;
+    /* keep exports mounted and connections open until exit */
+    int keep;
     struct timeval timeout;
     unsigned long hertz;
+    /* number of threads */
+    unsigned int parallel;
+    /* maximum number of requests outstanding to each server */
+    unsigned int limit;
+    /* -w filehandle database */
+    char *database;
+    struct fhdb_writer *writer;
 } cfg;
 
 /* default config */
@@ -64,14 +114,17 @@ const struct config CONFIG_DEFAULT = {
     .quiet     = 0,
     .reconnect = 1,
     .unmount   = 1,
+    .keep      = 0,
+    .parallel  = 32,
+    .limit     = 4,
+    .database  = NULL,
+    .writer    = NULL,
 };
 
 
 /* MOUNT protocol function pointers */
 /* EXPORT procedure */
 typedef exports *(*proc_export_t)(void *, CLIENT *);
-/* UMNT procedure */
-typedef void *(*proc_umnt_t)(dirpath *, CLIENT *);
 
 struct export_procs {
     /* function pointer */
@@ -84,17 +137,6 @@ struct export_procs {
     u_long version;
 };
 
-struct umnt_procs {
-    /* function pointer */
-    proc_umnt_t proc;
-    /* store the name as a string for error messages */
-    char *name;
-    /* protocol name for output functions */
-    char *protocol;
-    /* version is the filehandle version, ie NFSv2 or v3 */
-    u_long version;
-};
-
 /* array to store pointers to export procedures for different mount protocol versions */
 static const struct export_procs export_dispatch[4] = {
     [1] = { .proc = mountproc_export_1, .name = "mountproc_export_1", .protocol = "mountv1", .version = 2 },
@@ -102,13 +144,6 @@ static const struct export_procs export_dispatch[4] = {
     [3] = { .proc = mountproc_export_3, .name = "mountproc_export_3", .protocol = "mountv3", .version = 3 },
 };
 
-/* umnt procedures */
-static const struct umnt_procs umnt_dispatch[4] = {
-    [1] = { .proc =  mountproc_umnt_1, .name = "mountproc_umnt_1", .protocol = "mountv1", .version = 2 },
-    [2] = { .proc =  mountproc_umnt_2, .name = "mountproc_umnt_2", .protocol = "mountv2", .version = 2 },
-    [3] = { .proc =  mountproc_umnt_3, .name = "mountproc_umnt_3", .protocol = "mountv3", .version = 3 },
-};
-
 
 void usage() {
     /* TODO:
@@ -125,16 +160,20 @@ void usage() {
     -h       display this help and exit\n\
     -H n     frequency in Hertz (requests per second, default 1)\n\
     -J       force JSON output\n\
+    -k       keep mounted, only unmount and disconnect at exit (implies -R)\n\
     -l       loop forever\n\
+    -L n     maximum number of requests to send to each server at once (default %u)\n\
     -m       use multiple target IP addresses if found (implies -A)\n\
+    -P n     number of requests to send in parallel across all servers (default %u)\n\
     -q       quiet, only print summary\n\
     -R       don't reconnect to server after each round\n\
     -S addr  set source address\n\
     -T       use TCP (default UDP)\n\
     -u       don't unmount after mount\n\
     -v       verbose output\n\
-    -V n     MOUNT protocol version (1/2/3, default 3)\n"
-    );
+    -V n     MOUNT protocol version (1/2/3, default 3)\n\
+    -w file  also write filehandles to a database file for other commands\n",
+    CONFIG_DEFAULT.limit, CONFIG_DEFAULT.parallel);
 
     exit(3);
 }
@@ -160,48 +199,48 @@ void mount_perror(mountstat3 fhs_status) {
 
 
 /* get the list of exports from a server */
-exports get_exports(struct targets *target) {
-    struct rpc_err clnt_err;
+/* the generated EXPORT functions return a static result which isn't thread safe, so call clnt_call() directly */
+/* the caller has to free the list with xdr_free() */
+exports get_exports(CLIENT *client, struct targets *target) {
     exports ex = NULL;
+    enum clnt_stat status;
     unsigned long usec;
     struct timespec call_start, call_end, call_elapsed;
 
-    if (target->client) {
-        /* first time marker */
+    /* first time marker */
 #ifdef CLOCK_MONOTONIC_RAW
-        clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
 #else
-        clock_gettime(CLOCK_MONOTONIC, &call_start);
+    clock_gettime(CLOCK_MONOTONIC, &call_start);
 #endif
 
-        /* the actual RPC call */
-        ex = *export_dispatch[cfg.version].proc(NULL, target->client);
+    /* the actual RPC call, it's the same procedure number in all versions */
+    status = clnt_call(client, MOUNTPROC_EXPORT,
+        xdr_void_proc, NULL,
+        (xdrproc_t) xdr_exports, (caddr_t) &ex,
+        cfg.timeout);
 
-        /* second time marker */
+    /* second time marker */
 #ifdef CLOCK_MONOTONIC_RAW
-        clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
+    clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
 #else
-        clock_gettime(CLOCK_MONOTONIC, &call_end);
+    clock_gettime(CLOCK_MONOTONIC, &call_end);
 #endif
 
-        /* calculate elapsed microseconds */
-        timespecsub(&call_end, &call_start, &call_elapsed);
-        usec = ts2us(call_elapsed);
+    /* calculate elapsed microseconds */
+    timespecsub(&call_end, &call_start, &call_elapsed);
+    usec = ts2us(call_elapsed);
 
-        /* only print timing to stderr if verbose is enabled */
-        /* TODO unless we're doing graphite output */
-        debug("%s (%s): %s=%03.2f ms\n", target->name, target->ip_address, export_dispatch[cfg.version].name, usec / 1000.0);
-    }
+    /* only print timing to stderr if verbose is enabled */
+    /* TODO unless we're doing graphite output */
+    debug("%s (%s): %s=%03.2f ms\n", target->name, target->ip_address, export_dispatch[cfg.version].name, usec / 1000.0);
 
     /* export call doesn't return errors */
     /* it also doesn't usually require a privileged port */
-    if (ex == NULL) {
-        /* RPC error */
-        clnt_geterr(target->client, &clnt_err);
-        if  (clnt_err.re_status) {
-            fprintf(stderr, "%s: ", target->name);
-            clnt_perror(target->client, "mountproc_export_3");
-        }
+    if (status != RPC_SUCCESS) {
+        fprintf(stderr, "%s: ", target->name);
+        clnt_perror(client, export_dispatch[cfg.version].name);
+        ex = NULL;
     }
 
     return ex;
@@ -266,45 +305,40 @@ void free_mountres3(mountres3 *mountres) {
 
 
 /* wrapper for mountproc_mnt that handles different protocol versions and always returns a v3 result */
-/* this frees the RPC result in the client and returns a newly allocated mountres which must be freed using free_mountres3() */
+/* the generated functions return a static result which isn't thread safe, so call clnt_call() directly */
+/* returns a newly allocated mountres which must be freed using free_mountres3(), or NULL on an RPC error */
 mountres3 *mountproc_mnt_x(char *path, CLIENT *client) {
     /* for versions 1 and 2 */
-    fhstatus *status = NULL;
+    fhstatus status;
     /* for version 3 */
+    mountres3 result;
     mountres3 *mountres = NULL;
-    /* temp result */
-    mountres3 *result;
 
-    /* the actual RPC call */
+    /* the actual RPC call, it's the same procedure number in all versions */
     switch (cfg.version) {
         case 1:
-            status = mountproc_mnt_1(&path, client);
-            /* convert to v3 */
-            /* TODO if (status == MNT3_OK) */
-            mountres = fhstatus_to_mountres3(status);
-            /* free fhstatus */
-            if (clnt_freeres(client, (xdrproc_t) xdr_fhstatus, (caddr_t) status) == 0) {
-                fatalx(3, "Couldn't free fhstatus!\n");
-            }
-            break;
         case 2:
-            status = mountproc_mnt_2(&path, client);
-            /* convert to v3 */
-            /* TODO if (status == MNT3_OK) */
-            mountres = fhstatus_to_mountres3(status);
-            /* free fhstatus */
-            if (clnt_freeres(client, (xdrproc_t) xdr_fhstatus, (caddr_t) status) == 0) {
-                fatalx(3, "Couldn't free fhstatus!\n");
+            memset(&status, 0, sizeof(status));
+            if (clnt_call(client, MOUNTPROC_MNT,
+                (xdrproc_t) xdr_dirpath, (caddr_t) &path,
+                (xdrproc_t) xdr_fhstatus, (caddr_t) &status,
+                cfg.timeout) == RPC_SUCCESS) {
+                /* convert to v3 */
+                /* TODO if (status == MNT3_OK) */
+                mountres = fhstatus_to_mountres3(&status);
+                xdr_free((xdrproc_t) xdr_fhstatus, (char *) &status);
             }
             break;
         case 3:
-            result = mountproc_mnt_3(&path, client);
-            /* make a copy so it's out of the RPC client */
-            /* TODO if (result.fhs_status == MNT3_OK) */
-            mountres = copy_mountres3(result);
-            /* now free the result in the client */
-            if (clnt_freeres(client, (xdrproc_t) xdr_mountres3, (caddr_t) result) == 0) {
-                fatalx(3, "Couldn't free mountres3!\n");
+            memset(&result, 0, sizeof(result));
+            if (clnt_call(client, MOUNTPROC_MNT,
+                (xdrproc_t) xdr_dirpath, (caddr_t) &path,
+                (xdrproc_t) xdr_mountres3, (caddr_t) &result,
+                cfg.timeout) == RPC_SUCCESS) {
+                /* make a copy so the result can be freed */
+                /* TODO if (result.fhs_status == MNT3_OK) */
+                mountres = copy_mountres3(&result);
+                xdr_free((xdrproc_t) xdr_mountres3, (char *) &result);
             }
             break;
         default:
@@ -382,9 +416,13 @@ fhandle3 *get_root_filehandle(CLIENT *client, char *hostname, char *path, fhandl
 
 
 /* "unmount" a client from a server */
+/* the same procedure number in all versions */
 void unmount_client(CLIENT *client, char *path) {
     /* no errors returned from server */
-    umnt_dispatch[cfg.version].proc(&path, client);
+    clnt_call(client, MOUNTPROC_UMNT,
+        (xdrproc_t) xdr_dirpath, (caddr_t) &path,
+        xdr_void_proc, NULL,
+        cfg.timeout);
 }
 
 
@@ -429,24 +467,18 @@ int print_exports(char *host, struct exportnode *ex) {
 }
 
 
-/* make an export list by querying the server for a list of exports */
-struct mount_exports *make_exports(targets_t *target) {
-    exports ex;
+/* make an export list from the server's list of exports */
+struct mount_exports *make_exports(targets_t *target, exports ex) {
     struct mount_exports dummy;
     struct mount_exports *current = &dummy;
 
     dummy.next = NULL;
 
-    if (target->client) {
-        /* get the list of exports from the server */
-        ex = get_exports(target);
-
-        while (ex) {
-            current->next = init_export(target, ex->ex_dir, cfg.count);
-            current = current->next;
+    while (ex) {
+        current->next = init_export(target, ex->ex_dir, cfg.count);
+        current = current->next;
 
-            ex = ex->ex_next;
-        }
+        ex = ex->ex_next;
     }
 
     /* skip the dummy entry */
@@ -454,6 +486,246 @@ struct mount_exports *make_exports(targets_t *target) {
 }
 
 
+/* thread that sends EXPORT calls to servers that don't have an export list yet until there are none left */
+void *export_worker(void *arg) {
+    struct mount_job *job = arg;
+    struct mount_server *server;
+    CLIENT *client;
+    unsigned int i;
+
+    while ((i = __sync_fetch_and_add(&job->next_export, 1)) < job->server_count) {
+        server = &job->servers[i];
+
+        /* a path was given on the command line */
+        if (server->target->exports) {
+            continue;
+        }
+
+        client = rpc_pool_get(server->target->pool);
+        if (client) {
+            server->ex = get_exports(client, server->target);
+            rpc_pool_put(server->target->pool, client, server->ex == NULL);
+        }
+    }
+
+    return NULL;
+}
+
+
+/* mount a single export and print the result */
+void mount_export(struct mount_job *job, targets_t *target, struct mount_exports *export) {
+    /* allocate space for root filehandle */
+    char fhandle3_val[FHSIZE3];
+    fhandle3 root = {
+        .fhandle3_len = 0,
+        .fhandle3_val = fhandle3_val
+    };
+    struct timespec wall_clock;
+    /* response time in microseconds */
+    unsigned long usec = 0;
+    struct rpc_err clnt_err = { 0 };
+    CLIENT *client;
+    char *display_name; /* for print_output() */
+
+    client = rpc_pool_get(target->pool);
+
+    /* get the current timestamp */
+    clock_gettime(CLOCK_REALTIME, &wall_clock);
+
+    if (client) {
+        /* the mount RPC call */
+        get_root_filehandle(client, target->name, export->path, &root, &usec);
+
+        /* cleanup the mounted client list on the server */
+        /* this doesn't count towards the call timing */
+        /* with -k this waits until exit so each round is only a single MNT */
+        if (root.fhandle3_len && cfg.unmount && cfg.keep == 0) {
+            unmount_client(client, export->path);
+        }
+
+        /* reconnect next time in case it was a broken TCP connection */
+        clnt_geterr(client, &clnt_err);
+        rpc_pool_put(target->pool, client, clnt_err.re_status != RPC_SUCCESS);
+    }
+
+    /* the stats are per export so they're only updated by one thread at a time, but lines have to be printed one at a time */
+    pthread_mutex_lock(&job->lock);
+
+    job->sent++;
+    export->sent++;
+
+    if (root.fhandle3_len) {
+        export->received++;
+        job->ok++;
+
+        /* only save each filehandle once when looping */
+        if (cfg.writer && export->received == 1) {
+            fhdb_add(cfg.writer, target->client_sock->sin_addr, target->name, export->path, root.fhandle3_val, root.fhandle3_len);
+        }
+
+        /* only calculate these if we're looping */
+        if (cfg.count || cfg.loop) {
+            if (usec < export->min) export->min = usec;
+            if (usec > export->max) export->max = usec;
+            /* calculate the average time */
+            export->avg = (export->avg * (export->received - 1) + usec) / export->received;
+            hdr_record_value(export->histogram, usec);
+
+            if (cfg.format == fping) {
+                export->results[export->sent - 1] = usec;
+            }
+        }
+
+        if (cfg.quiet == 0) {
+            /* whether to display IP address or hostname */
+            if (cfg.ip) {
+                display_name = target->ip_address;
+            } else {
+                display_name = target->name;
+            }
+
+            print_output(cfg.format, cfg.prefix, job->width, display_name, target->ndqf, export, root, wall_clock, usec);
+            /* print each filehandle as soon as it comes in rather than when the buffer fills up */
+            fflush(stdout);
+        }
+    }
+
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+/* thread that keeps mounting exports until there are none left */
+/* picks the next server that has exports waiting and isn't already at its limit */
+void *mount_worker(void *arg) {
+    struct mount_job *job = arg;
+    struct mount_server *server;
+    struct mount_exports *export;
+    unsigned int i;
+    int waiting;
+
+    pthread_mutex_lock(&job->lock);
+
+    while (quitting == 0) {
+        server = NULL;
+        waiting = 0;
+
+        for (i = 0; i < job->server_count; i++) {
+            struct mount_server *candidate = &job->servers[(job->next_server + i) % job->server_count];
+
+            if (candidate->next) {
+                waiting = 1;
+
+                if (candidate->active < cfg.limit) {
+                    server = candidate;
+                    job->next_server = (job->next_server + i + 1) % job->server_count;
+                    break;
+                }
+            }
+        }
+
+        if (server == NULL) {
+            /* nothing left to do */
+            if (waiting == 0) {
+                break;
+            }
+
+            /* every server with exports left is busy, wait for one to finish */
+            pthread_cond_wait(&job->done, &job->lock);
+            continue;
+        }
+
+        export = server->next;
+        server->next = export->next;
+        server->active++;
+
+        pthread_mutex_unlock(&job->lock);
+
+        mount_export(job, server->target, export);
+
+        pthread_mutex_lock(&job->lock);
+
+        server->active--;
+        pthread_cond_broadcast(&job->done);
+    }
+
+    pthread_mutex_unlock(&job->lock);
+
+    return NULL;
+}
+
+
+/* thread that sends the UMNTs deferred by -k to each server over its existing connections */
+/* only exports that were mounted successfully at least once are unmounted */
+void *unmount_worker(void *arg) {
+    struct mount_job *job = arg;
+    struct mount_exports *export;
+    targets_t *target;
+    CLIENT *client;
+    unsigned int i;
+
+    while ((i = __sync_fetch_and_add(&job->next_unmount, 1)) < job->server_count) {
+        target = job->servers[i].target;
+
+        client = rpc_pool_get(target->pool);
+        if (client == NULL) {
+            continue;
+        }
+
+        for (export = target->exports; export; export = export->next) {
+            if (export->received) {
+                unmount_client(client, export->path);
+            }
+        }
+
+        rpc_pool_put(target->pool, client, 0);
+    }
+
+    return NULL;
+}
+
+
+/* start some threads and wait for them to finish */
+void run_workers(void *(*worker)(void *), struct mount_job *job, unsigned int count) {
+    pthread_t *threads;
+    unsigned int i;
+
+    /* no servers or exports */
+    if (count == 0) {
+        return;
+    }
+
+    threads = calloc(count, sizeof(pthread_t));
+    if (threads == NULL) {
+        fatalx(3, "Couldn't allocate memory for threads!\n");
+    }
+
+    for (i = 0; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, worker, job) != 0) {
+            fatalx(3, "Couldn't create thread!\n");
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+}
+
+
+/* give each server a pool of connections, up to the per server limit */
+/* mounts don't need authentication because they return a list of authentication flavours supported so leave it as default (AUTH_NONE) */
+void make_pools(struct mount_job *job, struct addrinfo *hints, struct sockaddr_in src_ip) {
+    unsigned int i;
+    targets_t *target;
+
+    for (i = 0; i < job->server_count; i++) {
+        target = job->servers[i].target;
+        target->pool = rpc_pool_new(target->client_sock, hints, MOUNTPROG, cfg.version, cfg.timeout, src_ip, cfg.limit, 0);
+    }
+}
+
+
 /* print a MOUNT filehandle to stdout as a series of hex bytes wrapped in a JSON object */
 /* returns the length of the filehandle in bytes */
 /*
@@ -596,7 +868,12 @@ void print_summary(targets_t *targets, enum outputs format, const int width, con
                             /* only print times if we got any responses */
                             if (export->received) {
                                 fprintf(stderr, ", min/avg/max = %.2f/%.2f/%.2f",
-                                    export->min / 1000.0, export->avg / 1000.0, export->max / 1000.0);
+                                    hdr_min(export->histogram) / 1000.0, export->avg / 1000.0, export->max / 1000.0);
+                                /* median not mean! */
+                                fprintf(stderr, ", 50/90/99%% = %.2f/%.2f/%.2f",
+                                    hdr_value_at_percentile(export->histogram, 50.0) / 1000.0,
+                                    hdr_value_at_percentile(export->histogram, 90.0) / 1000.0,
+                                    hdr_value_at_percentile(export->histogram, 99.0) / 1000.0);
                             }
                             break;
                         case fping:
@@ -633,12 +910,6 @@ void print_summary(targets_t *targets, enum outputs format, const int width, con
 
 
 int main(int argc, char **argv) {
-    /* allocate space for root filehandle */
-    char fhandle3_val[FHSIZE3];
-    fhandle3 root = {
-        .fhandle3_len = 0,
-        .fhandle3_val = fhandle3_val
-    };
     struct addrinfo hints = {
         .ai_family = AF_INET,
         /* default to UDP */
@@ -646,9 +917,6 @@ int main(int argc, char **argv) {
     };
     char *host;
     char *path;
-    char *display_name; /* for print_output() */
-    /* RPC call results */
-    exports ex;
     /* target lists */
     targets_t target_dummy = {0};
     /* pointer to head of list */
@@ -663,10 +931,15 @@ int main(int argc, char **argv) {
     /* getopt */
     int ch;
     struct timespec sleep_time;
-    struct timespec wall_clock;
     struct timespec loop_start, loop_end, loop_elapsed, sleepy;
-    /* response time in microseconds */
-    unsigned long usec = 0;
+    struct mount_job job = {
+        .lock = PTHREAD_MUTEX_INITIALIZER,
+        .done = PTHREAD_COND_INITIALIZER,
+    };
+    struct mount_server *server;
+    unsigned int i;
+    /* total number of exports on all servers */
+    unsigned int total = 0;
     /* source ip address for packets */
     struct sockaddr_in src_ip = {
         .sin_family = AF_INET,
@@ -683,7 +956,7 @@ int main(int argc, char **argv) {
     if (argc == 1)
         usage();
 
-    while ((ch = getopt(argc, argv, "Ac:C:dDeEGhH:JlmqRS:TuvV:")) != -1) {
+    while ((ch = getopt(argc, argv, "Ac:C:dDeEGhH:JklL:mP:qRS:TuvV:w:")) != -1) {
         switch(ch) {
             /* show IP addresses instead of hostnames */
             case 'A':
@@ -916,6 +1189,12 @@ int main(int argc, char **argv) {
                         break;
                 }
                 break;
+            /* keep exports mounted between rounds */
+            case 'k':
+                cfg.keep = 1;
+                /* the point is to reuse the same connections */
+                cfg.reconnect = 0;
+                break;
             case 'l':
                 /* Can't count and loop */
                 if (cfg.count) {
@@ -930,6 +1209,13 @@ int main(int argc, char **argv) {
 
                 cfg.loop = 1;
                 break;
+            /* maximum requests to each server */
+            case 'L':
+                cfg.limit = strtoul(optarg, NULL, 10);
+                if (cfg.limit == 0) {
+                    fatal("Zero limit, nothing to do!\n");
+                }
+                break;
             /* use multiple IP addresses if found */
             /* in this case we also want to default to showing IP addresses instead of names */
             case 'm':
@@ -940,6 +1226,13 @@ int main(int argc, char **argv) {
                     cfg.ip = 1;
                 }
                 break;
+            /* number of threads */
+            case 'P':
+                cfg.parallel = strtoul(optarg, NULL, 10);
+                if (cfg.parallel == 0) {
+                    fatal("Zero threads, nothing to do!\n");
+                }
+                break;
             case 'q':
                 cfg.quiet = 1;
                 break;
@@ -972,6 +1265,10 @@ int main(int argc, char **argv) {
                     fatal("Illegal version %lu!\n", cfg.version);
                 }
                 break;
+            /* filehandle database */
+            case 'w':
+                cfg.database = optarg;
+                break;
             case 'h':
             case '?':
             default:
@@ -984,6 +1281,13 @@ int main(int argc, char **argv) {
         cfg.format = json;
     }
 
+    if (cfg.database) {
+        if (cfg.format == showmount) {
+            fatal("Can't specify both -e and -w!\n");
+        }
+        cfg.writer = fhdb_writer_new();
+    }
+
     /* calculate the sleep_time based on the frequency */
     /* check for a frequency of 1, that's a simple case */
     /* this doesn't support frequencies lower than 1Hz */
@@ -1024,30 +1328,45 @@ int main(int argc, char **argv) {
 
     /* skip the first dummy entry */
     targets = targets->next;
-    /* reset to start of list */
-    current = targets;
 
-    /* go through the new targets and make a list of exports */
-    while (current) {
-        /* no path given, look up exports on server */
-        if (current->exports == NULL) {
-            /* first create an rpc connection so we can query the server for an exports list */
-            current->client = create_rpc_client(current->client_sock, &hints, MOUNTPROG, cfg.version, cfg.timeout, src_ip);
+    for (current = targets; current; current = current->next) {
+        job.server_count++;
+    }
+
+    job.servers = calloc(job.server_count, sizeof(struct mount_server));
+    if (job.server_count && job.servers == NULL) {
+        fatalx(3, "Couldn't allocate memory for servers!\n");
+    }
+
+    for (current = targets, i = 0; current; current = current->next, i++) {
+        job.servers[i].target = current;
+    }
+
+    make_pools(&job, &hints, src_ip);
 
+    /* query all of the servers without a path for their list of exports at the same time */
+    run_workers(export_worker, &job, job.server_count < cfg.parallel ? job.server_count : cfg.parallel);
+
+    /* go through the servers in order and make a list of exports */
+    for (i = 0; i < job.server_count; i++) {
+        server = &job.servers[i];
+        current = server->target;
+
+        /* no path given, use the exports from the server */
+        if (current->exports == NULL) {
             if (cfg.format == showmount) {
-                ex = get_exports(current);
                 if (cfg.ip) {
-                    exports_sent = print_exports(current->ip_address, ex);
+                    exports_sent = print_exports(current->ip_address, server->ex);
                 } else {
-                    exports_sent = print_exports(current->name, ex);
+                    exports_sent = print_exports(current->name, server->ex);
                 }
             } else {
-                /* look up the export list on the server and create a list of exports */
-                current->exports = make_exports(current);
+                /* create a list of exports */
+                current->exports = make_exports(current, server->ex);
             }
-        }
 
-        current = current->next;
+            xdr_free((xdrproc_t) xdr_exports, (char *) &server->ex);
+        }
     }
 
     /* listen for ctrl-c */
@@ -1075,6 +1394,13 @@ int main(int argc, char **argv) {
                     width = tmpwidth;
                 }
 
+                total++;
+
+                /* histogram of response times for the summary */
+                if (cfg.count || cfg.loop) {
+                    hdr_init(1, tv2us(cfg.timeout), 3, &export->histogram);
+                }
+
                 export = export->next;
             }
 
@@ -1082,12 +1408,10 @@ int main(int argc, char **argv) {
         }
     }
 
+    job.width = width;
 
     /* now we have a target list, loop through and query the server(s) */
-    while(1) {
-        /* reset to head of list */
-        current = targets;
-
+    while(targets) {
         /* grab the starting time of each loop */
 #ifdef CLOCK_MONOTONIC_RAW
         clock_gettime(CLOCK_MONOTONIC_RAW, &loop_start);
@@ -1095,76 +1419,25 @@ int main(int argc, char **argv) {
         clock_gettime(CLOCK_MONOTONIC, &loop_start);
 #endif
 
-        /* go through the list of targets */
-        while(current) {
-
-            if (current->client == NULL) {
-                /* create an rpc connection */
-                current->client = create_rpc_client(current->client_sock, &hints, MOUNTPROG, cfg.version, cfg.timeout, src_ip);
-                /* mounts don't need authentication because they return a list of authentication flavours supported so leave it as default (AUTH_NONE) */
-            }
-
-            if (current->client) {
-                export = current->exports;
-
-                /* for each target, go through the list of filesystem exports */
-                while (export) {
-                    /* get the current timestamp */
-                    clock_gettime(CLOCK_REALTIME, &wall_clock);
-
-                    /* the mount RPC call */
-                    get_root_filehandle(current->client, current->name, export->path, &root, &usec);
-
-                    exports_sent++;
-                    export->sent++;
-
-                    if (root.fhandle3_len) {
-                        export->received++;
-                        exports_ok++;
-
-                        /* cleanup the mounted client list on the server */
-                        /* this doesn't count towards the call timing */
-                        /* TODO only do this once after sending all requests? */
-                        if (cfg.unmount) {
-                            unmount_client(current->client, export->path);
-                        }
-
-                        /* only calculate these if we're looping */
-                        if (cfg.count || cfg.loop) {
-                            if (usec < export->min) export->min = usec;
-                            if (usec > export->max) export->max = usec;
-                            /* calculate the average time */
-                            export->avg = (export->avg * (export->received - 1) + usec) / export->received;
-
-                            if (cfg.format == fping) {
-                                export->results[export->sent - 1] = usec;
-                            }
-                        }
-
-                        if (cfg.quiet == 0) {
-                            /* whether to display IP address or hostname */
-                            if (cfg.ip) {
-                                display_name = current->ip_address;
-                            } else {
-                                display_name = current->name;
-                            }
+        /* queue up all of the exports on each server */
+        for (i = 0; i < job.server_count; i++) {
+            job.servers[i].next = job.servers[i].target->exports;
+        }
 
-                            print_output(cfg.format, cfg.prefix, width, display_name, current->ndqf, export, root, wall_clock, usec);
-                        }
-                    }
+        /* mount everything in parallel, up to the limit for each server */
+        /* the results are printed as they come in so they aren't in any particular order */
+        run_workers(mount_worker, &job, total < cfg.parallel ? total : cfg.parallel);
 
-                    export = export->next;
-                }
-            } /* TODO else if no connection */
+        exports_sent = job.sent;
+        exports_ok = job.ok;
 
-            /* disconnect from server */
-            if (cfg.reconnect) {
-                current->client = destroy_rpc_client(current->client);
+        /* disconnect from the servers */
+        if (cfg.reconnect) {
+            for (current = targets; current; current = current->next) {
+                current->pool = rpc_pool_destroy(current->pool);
             }
-
-            current = current->next;
-
-        } /* while(current) */
+            make_pools(&job, &hints, src_ip);
+        }
 
         /* measure how long the current round took, and subtract that from the sleep time */
         /* this keeps us on the polling frequency */
@@ -1184,7 +1457,7 @@ int main(int argc, char **argv) {
         /* at the end of the targets list, see if we need to loop */
         /* check the first export of the first target */
         /* TODO do we even need to store the sent number for each target or just once globally? */
-        if (cfg.loop || (cfg.count && targets->exports->sent < cfg.count)) {
+        if (cfg.loop || (cfg.count && targets->exports && targets->exports->sent < cfg.count)) {
             /* don't sleep if we went over the sleep_time */
             if (timespeccmp(&loop_elapsed, &sleep_time, >)) {
                 debug("Slow poll, not sleeping\n");
@@ -1200,11 +1473,23 @@ int main(int argc, char **argv) {
 
     } /* while(1) */
 
+    /* send the UMNTs that were skipped while looping */
+    if (cfg.keep && cfg.unmount) {
+        run_workers(unmount_worker, &job, job.server_count < cfg.parallel ? job.server_count : cfg.parallel);
+    }
+
     /* only print summary if looping */
     if (cfg.count || cfg.loop) {
         print_summary(targets, cfg.format, width, cfg.ip);
     }
 
+    if (cfg.writer) {
+        if (fhdb_write(cfg.writer, cfg.database) != 0) {
+            return EXIT_FAILURE;
+        }
+        cfg.writer = fhdb_writer_free(cfg.writer);
+    }
+
     /* check if all of the requests came back ok */
     if (exports_sent && exports_sent == exports_ok) {
         return EXIT_SUCCESS;
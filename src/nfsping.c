@@ -1,11 +1,35 @@
 #include "nfsping.h"
 #include "util.h"
 #include "rpc.h"
+#include "serve.h"
+#include "stats.h"
 #include <sys/ioctl.h> /* for checking terminal size */
 
 /* Globals! */
 extern volatile sig_atomic_t quitting;
 int verbose = 0;
+/* set by SIGHUP to read the targets file (-f) again */
+static volatile sig_atomic_t reloading = 0;
+/* the -U socket thread reads the target list and results while the main loop updates them */
+static pthread_mutex_t results_lock = PTHREAD_MUTEX_INITIALIZER;
+/* -z shared memory statistics, the records follow the target list around */
+static struct stats *live_stats = NULL;
+
+/* what the -W metrics callback needs, the list head changes when the targets are reloaded */
+struct metrics {
+    targets_t **targets;
+    const char *protocol;
+};
+
+/* a copy of a target's results taken for a scrape, so the main loop only waits while it's copied */
+struct metrics_target {
+    char name[NI_MAXHOST];
+    char ip_address[INET_ADDRSTRLEN];
+    unsigned long sent;
+    struct hdr_histogram *histogram;
+    /* formatted label pairs for every line */
+    char *labels;
+};
 
 enum ping_outputs {
     ping_unset,     /* use as a default for getopt checks */
@@ -19,10 +43,18 @@ enum ping_outputs {
 /* local prototypes */
 static void usage(void);
 static void print_interval(enum ping_outputs, char *, targets_t *, unsigned long, u_long, const struct timespec);
-static void print_summary(enum ping_outputs, unsigned long, targets_t *);
+static void print_summary(enum ping_outputs, FILE *, unsigned long, targets_t *);
 static void print_result(enum ping_outputs, unsigned int, char *, targets_t *, unsigned long, u_long, const struct timespec, unsigned long);
 static void print_lost(enum ping_outputs, char *, targets_t *, unsigned long, u_long, const struct timespec);
 static void print_header(enum ping_outputs, unsigned int, unsigned long, u_long);
+static void sighup_handler(int);
+static int read_targets(FILE *, const char *, targets_t *, const struct addrinfo *, uint16_t, int, struct timeval, unsigned long, int, int);
+static void replace_targets(targets_t **, targets_t *);
+static void reload_targets(targets_t **, const struct addrinfo *, uint16_t, int, struct timeval, unsigned long);
+static int read_batch(targets_t **, const struct addrinfo *, uint16_t, int, struct timeval, unsigned long);
+static void serve_results(FILE *, void *);
+static void free_snapshot(struct metrics_target *, size_t);
+static void serve_metrics(FILE *, void *);
 
 /* global config "object" */
 static struct config {
@@ -32,6 +64,16 @@ static struct config {
     int display_ips;
     /* -Q quiet summary interval (seconds) */
     unsigned int summary_interval;
+    /* -f file of targets, read again on SIGHUP */
+    char *targets_file;
+    /* -U Unix socket for serving results */
+    char *socket_path;
+    /* -B read batches of targets from stdin */
+    int batch;
+    /* -z name of the shared memory segment */
+    char *stats_name;
+    /* -W address and port for serving metrics over HTTP */
+    char *metrics_listen;
 } cfg;
 
 /* default config */
@@ -39,6 +81,11 @@ const struct config CONFIG_DEFAULT = {
     .reverse_dns      = 0,
     .display_ips      = 0,
     .summary_interval = 0,
+    .targets_file     = NULL,
+    .socket_path      = NULL,
+    .batch            = 0,
+    .stats_name       = NULL,
+    .metrics_listen   = NULL,
 };
 
 /* dispatch table for null function calls, this saves us from a bunch of if statements */
@@ -88,11 +135,13 @@ void usage() {
     printf("Usage: nfsping [options] [targets...]\n\
     -a         check the NFS ACL protocol (default NFS)\n\
     -A         show IP addresses (default hostnames)\n\
+    -B         read batches of targets from stdin, use with -C\n\
     -c n       count of pings to send to target\n\
     -C n       same as -c, output parseable format\n\
     -d         reverse DNS lookups for targets\n\
     -D         print timestamp (unix time) before each line\n\
     -E         StatsD format output (default human readable)\n\
+    -f file    read targets from a file, read it again on SIGHUP\n\
     -g string  prefix for Graphite/StatsD metric names (default \"nfsping\")\n\
     -G         Graphite format output (default human readable)\n\
     -h         display this help and exit\n\
@@ -114,8 +163,11 @@ void usage() {
     -t n       timeout (in ms, default %lu)\n\
     -T         use TCP (default UDP)\n\
     -u         check the rquota protocol (default NFS)\n\
+    -U path    serve results on a Unix socket (implies -l and -R)\n\
     -v         verbose output\n\
-    -V n       specify NFS version (2/3/4, default 3)\n",
+    -V n       specify NFS version (2/3/4, default 3)\n\
+    -W addr    serve Prometheus metrics over HTTP on [address:]port (implies -l and -R)\n\
+    -z name    publish live statistics in shared memory (/dev/shm/name)\n",
     NFS_HERTZ, ts2ms(wait_time), NFS_PORT, PMAPPORT, tv2ms(timeout));
 
     exit(3);
@@ -251,23 +303,24 @@ void print_interval(enum ping_outputs format, char *prefix, targets_t *target, u
 
 
 /* print a final summary before exiting */
-/* fping format prints to stderr for compatibility */
-void print_summary(enum ping_outputs format, unsigned long total_sent, targets_t *targets) {
+/* fping format prints to out, which is stderr for compatibility except in batch mode (-B) */
+/* rounds is the number of pings sent to each target */
+void print_summary(enum ping_outputs format, FILE *out, unsigned long rounds, targets_t *targets) {
     targets_t *current = targets;
     unsigned long i;
 
     while (current) {
         /* print a parseable summary string in fping-compatible format */
         if (format == ping_fping) {
-            fprintf(stderr, "%s :", current->display_name);
-            for (i = 0; i < total_sent; i++) {
+            fprintf(out, "%s :", current->display_name);
+            for (i = 0; i < rounds; i++) {
                 if (current->results[i]) {
-                    fprintf(stderr, " %.2f", current->results[i] / 1000.0);
+                    fprintf(out, " %.2f", current->results[i] / 1000.0);
                 } else {
-                    fprintf(stderr, " -");
+                    fprintf(out, " -");
                 }
             }
-            fprintf(stderr, "\n");
+            fprintf(out, "\n");
         } else if (format == ping_ping) {
             /* blank line to separate from results */
             /* TODO only if !quiet */
@@ -381,6 +434,329 @@ void print_header(enum ping_outputs format, unsigned int maxhost, unsigned long
 }
 
 
+/* ask the main loop to read the targets file again */
+void sighup_handler(int sig) {
+    if (sig == SIGHUP) {
+        reloading = 1;
+    }
+}
+
+
+/* make targets from names read one per line */
+/* blank lines and lines starting with # are skipped, except in batch mode where a blank line ends the batch */
+/* when reloading or in batch mode, names that don't resolve are skipped instead of exiting */
+/* source is the name of the input for error messages */
+/* returns the number of targets made */
+int read_targets(FILE *in, const char *source, targets_t *head, const struct addrinfo *hints, uint16_t port, int multiple, struct timeval timeout, unsigned long count, int reload, int batch) {
+    char *line = NULL;
+    size_t len = 0;
+    char *start, *end;
+    /* make_target() can write a reverse DNS name over its argument */
+    char host[NI_MAXHOST];
+    struct addrinfo *addr;
+    struct in_addr ip;
+    int created = 0;
+
+    while (getline(&line, &len, in) != -1) {
+        start = line;
+        while (isspace(*start)) {
+            start++;
+        }
+
+        if (*start == '\0') {
+            if (batch) {
+                break;
+            }
+            continue;
+        }
+
+        if (*start == '#') {
+            continue;
+        }
+
+        /* only the first word on the line */
+        end = start;
+        while (*end && !isspace(*end)) {
+            end++;
+        }
+        *end = '\0';
+
+        if (strlen(start) >= sizeof(host)) {
+            fprintf(stderr, "%s: name too long: %s\n", source, start);
+            continue;
+        }
+        strcpy(host, start);
+
+        if ((reload || batch) && inet_pton(AF_INET, host, &ip) != 1) {
+            if (getaddrinfo(host, "nfs", hints, &addr) != 0) {
+                fprintf(stderr, "%s: can't resolve %s, skipping\n", source, host);
+                continue;
+            }
+            freeaddrinfo(addr);
+        }
+
+        created += make_target(head, host, hints, port, cfg.reverse_dns, cfg.display_ips, multiple, timeout, NULL, count);
+    }
+
+    free(line);
+
+    return created;
+}
+
+
+/* swap in a new list of targets */
+/* targets that are in both lists keep their RPC client and results, the others are freed */
+/* the head is replaced while holding the lock so the socket threads never see the old one after it's freed */
+void replace_targets(targets_t **head, targets_t *fresh) {
+    targets_t dummy = { 0 };
+    targets_t *previous = &dummy;
+    targets_t *targets;
+    targets_t *current, *old;
+    targets_t **link;
+
+    dummy.next = fresh;
+
+    pthread_mutex_lock(&results_lock);
+
+    targets = *head;
+
+    current = dummy.next;
+    while (current) {
+        /* look for the same address in the old list */
+        for (link = &targets; *link; link = &(*link)->next) {
+            if ((*link)->client_sock->sin_addr.s_addr == current->client_sock->sin_addr.s_addr) {
+                break;
+            }
+        }
+
+        if (*link) {
+            /* take it out of the old list and put it in place of the new target */
+            old = *link;
+            *link = old->next;
+            old->next = current->next;
+            previous->next = old;
+
+            /* the name may have changed */
+            if (old->ndqf != old->name && old->ndqf != old->ip_address) {
+                free(old->ndqf);
+            }
+            strncpy(old->name, current->name, NI_MAXHOST);
+            if (current->ndqf == current->name) {
+                old->ndqf = old->name;
+            } else if (current->ndqf == current->ip_address) {
+                old->ndqf = old->ip_address;
+            } else {
+                old->ndqf = current->ndqf;
+                current->ndqf = NULL;
+            }
+            old->display_name = current->display_name == current->ip_address ? old->ip_address : old->name;
+
+            free_target(current);
+            current = old;
+        }
+
+        previous = current;
+        current = current->next;
+    }
+
+    /* anything left isn't in the new list */
+    while (targets) {
+        debug("Removing %s\n", targets->display_name);
+        targets = free_target(targets);
+    }
+
+    *head = dummy.next;
+
+    if (live_stats) {
+        stats_targets(live_stats, *head);
+    }
+
+    pthread_mutex_unlock(&results_lock);
+}
+
+
+/* read the targets file (-f) again and swap in the new list */
+/* the list is left alone if the file couldn't be used */
+void reload_targets(targets_t **targets, const struct addrinfo *hints, uint16_t port, int multiple, struct timeval timeout, unsigned long count) {
+    targets_t dummy = { 0 };
+    FILE *in;
+    int created;
+
+    /* do the DNS lookups before taking the lock */
+    in = fopen(cfg.targets_file, "r");
+    if (in == NULL) {
+        fprintf(stderr, "%s: %s, keeping the current list\n", cfg.targets_file, strerror(errno));
+        return;
+    }
+
+    created = read_targets(in, cfg.targets_file, &dummy, hints, port, multiple, timeout, count, 1, 0);
+    fclose(in);
+
+    if (created == 0) {
+        fprintf(stderr, "%s: no targets, keeping the current list\n", cfg.targets_file);
+        return;
+    }
+
+    replace_targets(targets, dummy.next);
+}
+
+
+/* read the next batch of targets (-B) from stdin, ending with a blank line */
+/* targets that were in the last batch keep their RPC client, but all of the results are cleared */
+/* returns 0 at the end of the input, otherwise 1 even if the batch was empty so it still gets an answer */
+int read_batch(targets_t **targets, const struct addrinfo *hints, uint16_t port, int multiple, struct timeval timeout, unsigned long count) {
+    targets_t dummy = { 0 };
+    targets_t *target;
+
+    read_targets(stdin, "stdin", &dummy, hints, port, multiple, timeout, count, 0, 1);
+
+    /* nothing left to read */
+    if (dummy.next == NULL && feof(stdin)) {
+        return 0;
+    }
+
+    replace_targets(targets, dummy.next);
+
+    pthread_mutex_lock(&results_lock);
+    for (target = *targets; target; target = target->next) {
+        target->sent = 0;
+        target->received = 0;
+        target->min = ULONG_MAX;
+        target->max = 0;
+        target->avg = 0;
+        memset(target->results, 0, count * sizeof(unsigned long));
+    }
+    pthread_mutex_unlock(&results_lock);
+
+    return 1;
+}
+
+
+/* write the results for each target as a line of JSON to a client of the -U socket */
+/* called from the socket thread with results_lock held */
+void serve_results(FILE *out, void *arg) {
+    targets_t *target = *(targets_t **)arg;
+    JSON_Value *json_root;
+    JSON_Object *json_obj;
+    char *my_json_string;
+
+    while (target) {
+        json_root = json_value_init_object();
+        json_obj = json_value_get_object(json_root);
+
+        json_object_set_string(json_obj, "host", target->name);
+        json_object_set_string(json_obj, "ip", target->ip_address);
+        json_object_set_number(json_obj, "sent", target->sent);
+        json_object_set_number(json_obj, "received", target->received);
+
+        /* the histogram is empty until there's a response */
+        if (target->received) {
+            json_object_set_number(json_obj, "min", hdr_min(target->histogram));
+            json_object_set_number(json_obj, "p50", hdr_value_at_percentile(target->histogram, 50.0));
+            json_object_set_number(json_obj, "p90", hdr_value_at_percentile(target->histogram, 90.0));
+            json_object_set_number(json_obj, "p99", hdr_value_at_percentile(target->histogram, 99.0));
+            json_object_set_number(json_obj, "max", hdr_max(target->histogram));
+        }
+
+        my_json_string = json_serialize_to_string(json_root);
+        fprintf(out, "%s\n", my_json_string);
+        json_free_serialized_string(my_json_string);
+        json_value_free(json_root);
+
+        target = target->next;
+    }
+}
+
+
+/* free a scrape's copy of the results */
+void free_snapshot(struct metrics_target *snapshot, size_t count) {
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        free(snapshot[i].histogram);
+        free(snapshot[i].labels);
+    }
+    free(snapshot);
+}
+
+
+/* write Prometheus metrics for each target to an HTTP client of -W */
+/* called from the HTTP thread without any lock, the results are copied while holding results_lock and formatted after */
+/* if memory runs out the scrape is dropped rather than exiting */
+void serve_metrics(FILE *out, void *arg) {
+    struct metrics *metrics = arg;
+    struct metrics_target *snapshot;
+    targets_t *target;
+    size_t count = 0;
+    size_t i;
+    size_t len;
+    FILE *labels;
+
+    pthread_mutex_lock(&results_lock);
+
+    for (target = *metrics->targets; target; target = target->next) {
+        count++;
+    }
+
+    snapshot = calloc(count ? count : 1, sizeof(struct metrics_target));
+    if (snapshot == NULL) {
+        pthread_mutex_unlock(&results_lock);
+        fprintf(stderr, "Couldn't allocate memory for metrics!\n");
+        return;
+    }
+
+    for (target = *metrics->targets, i = 0; target; target = target->next, i++) {
+        strcpy(snapshot[i].name, target->name);
+        strcpy(snapshot[i].ip_address, target->ip_address);
+        snapshot[i].sent = target->total_sent;
+        snapshot[i].histogram = serve_copy(target->histogram);
+    }
+
+    pthread_mutex_unlock(&results_lock);
+
+    for (i = 0; i < count; i++) {
+        labels = open_memstream(&snapshot[i].labels, &len);
+        if (labels == NULL) {
+            perror("open_memstream");
+            free_snapshot(snapshot, count);
+            return;
+        }
+        fputs("target=\"", labels);
+        serve_label(labels, snapshot[i].name);
+        fprintf(labels, "\",ip=\"%s\",protocol=\"%s\"", snapshot[i].ip_address, metrics->protocol);
+        fclose(labels);
+    }
+
+    /* all of the lines for a metric have to be together */
+    fprintf(out, "# HELP nfsping_sent_total Requests sent to the target.\n");
+    fprintf(out, "# TYPE nfsping_sent_total counter\n");
+    for (i = 0; i < count; i++) {
+        fprintf(out, "nfsping_sent_total{%s} %lu\n", snapshot[i].labels, snapshot[i].sent);
+    }
+
+    /* every response is in the histogram, and it isn't reset by -Q */
+    fprintf(out, "# HELP nfsping_received_total Responses received from the target.\n");
+    fprintf(out, "# TYPE nfsping_received_total counter\n");
+    for (i = 0; i < count; i++) {
+        fprintf(out, "nfsping_received_total{%s} %" PRId64 "\n", snapshot[i].labels, snapshot[i].histogram->total_count);
+    }
+
+    fprintf(out, "# HELP nfsping_response_seconds Response time.\n");
+    fprintf(out, "# TYPE nfsping_response_seconds histogram\n");
+    for (i = 0; i < count; i++) {
+        serve_histogram(out, "nfsping_response_seconds", snapshot[i].labels, snapshot[i].histogram);
+    }
+
+    fprintf(out, "# HELP nfsping_response_quantile_seconds Response time quantiles since the start.\n");
+    fprintf(out, "# TYPE nfsping_response_quantile_seconds summary\n");
+    for (i = 0; i < count; i++) {
+        serve_summary(out, "nfsping_response_quantile_seconds", snapshot[i].labels, snapshot[i].histogram);
+    }
+
+    free_snapshot(snapshot, count);
+}
+
+
 int main(int argc, char **argv) {
     void *status;
     struct timeval timeout = NFS_TIMEOUT;
@@ -398,7 +774,9 @@ int main(int argc, char **argv) {
         .ai_socktype = SOCK_DGRAM,
     };
     struct rpc_err clnt_err;
-    unsigned long us;
+    unsigned long us = 0;
+    /* for counting timeouts separately from other errors */
+    int timedout;
     /* default to unset so we can check in getopt */
     enum ping_outputs format = ping_unset;
     char prefix[255] = "nfsping";
@@ -426,6 +804,11 @@ int main(int argc, char **argv) {
     struct winsize winsz;
     unsigned short rows = 0; /* number of rows in terminal window */
     unsigned int maxhost = 0; /* has to be int not size_t for printf width */
+    struct serve *server = NULL;
+    struct serve *metrics_server = NULL;
+    struct metrics metrics;
+    /* -f targets file */
+    FILE *input;
 
     cfg = CONFIG_DEFAULT;
 
@@ -441,7 +824,7 @@ int main(int argc, char **argv) {
         usage();
 
 
-    while ((ch = getopt(argc, argv, "aAc:C:dDEg:GhH:i:KlLmMnNP:qQ:RsS:t:TuvV:")) != -1) {
+    while ((ch = getopt(argc, argv, "aABc:C:dDEf:g:GhH:i:KlLmMnNP:qQ:RsS:t:TuU:vV:W:z:")) != -1) {
         switch(ch) {
             /* NFS ACL protocol */
             case 'a':
@@ -464,6 +847,10 @@ int main(int argc, char **argv) {
                     cfg.display_ips = 1;
                 }
                 break;
+            /* batches of targets from stdin */
+            case 'B':
+                cfg.batch = 1;
+                break;
             /* number of pings per target, parseable summary */
             case 'C':
                 if (loop) {
@@ -573,6 +960,10 @@ int main(int argc, char **argv) {
                         break;
                 }
                 break;
+            /* file of targets */
+            case 'f':
+                cfg.targets_file = optarg;
+                break;
             /* prefix to use for graphite metrics */
             case 'g':
                 strncpy(prefix, optarg, sizeof(prefix));
@@ -749,6 +1140,10 @@ int main(int argc, char **argv) {
                     fatal("Only one protocol!\n");
                 }
                 break;
+            /* serve results on a Unix socket */
+            case 'U':
+                cfg.socket_path = optarg;
+                break;
             /* verbose */
             case 'v':
                 verbose = 1;
@@ -761,6 +1156,14 @@ int main(int argc, char **argv) {
                     fatal("Illegal version %lu\n", version);
                 }
                 break;
+            /* Prometheus metrics */
+            case 'W':
+                cfg.metrics_listen = optarg;
+                break;
+            /* shared memory statistics */
+            case 'z':
+                cfg.stats_name = optarg;
+                break;
             case 'h':
             case '?':
             default:
@@ -773,6 +1176,24 @@ int main(int argc, char **argv) {
         format = ping_ping;
     }
 
+    /* keep running and connected to the targets for the socket's clients */
+    if (cfg.socket_path || cfg.metrics_listen) {
+        if (count) {
+            fatal("Can't count with -U or -W!\n");
+        }
+        loop = 1;
+        reconnect = 0;
+    }
+
+    /* each batch gets the fping summary */
+    if (cfg.batch) {
+        if (format != ping_fping) {
+            fatal("-B needs -C!\n");
+        }
+        /* the results are the only output on stdout */
+        quiet = 1;
+    }
+
     /* check if neither loop nor count were specified, default to looping */
     if (loop + count == 0) {
         loop = 1;
@@ -828,10 +1249,31 @@ int main(int argc, char **argv) {
     first = optind;
 
     /* check if we don't have any targets */
-    if (first == argc) {
+    if (cfg.batch) {
+        if (first != argc || cfg.targets_file) {
+            fatal("Can't specify targets with -B!\n");
+        }
+    } else if (first == argc && cfg.targets_file == NULL) {
         usage();
     }
 
+    /* targets from a file go first */
+    if (cfg.targets_file) {
+        input = fopen(cfg.targets_file, "r");
+        if (input == NULL) {
+            fatalx(3, "%s: %s\n", cfg.targets_file, strerror(errno));
+        }
+
+        /* only fping output stores results */
+        read_targets(input, cfg.targets_file, targets, &hints, port, multiple, timeout, format == ping_fping ? count : 0, 0, 0);
+        fclose(input);
+
+        /* only reload when looping, the fping results are sized for the original targets */
+        if (loop) {
+            signal(SIGHUP, sighup_handler);
+        }
+    }
+
     /* process the targets from the command line */
     for (index = optind; index < argc; index++) {
         if (format == ping_fping) {
@@ -847,6 +1289,16 @@ int main(int argc, char **argv) {
     targets = targets->next;
     target = targets;
 
+    /* targets come from stdin in batch mode */
+    if (cfg.batch) {
+        if (read_batch(&targets, &hints, port, multiple, timeout, count) == 0) {
+            exit(EXIT_SUCCESS);
+        }
+        target = targets;
+    } else if (targets == NULL) {
+        fatal("No targets!\n");
+    }
+
     while (target) {
         /* find the longest name for output spacing */
         maxhost = (strlen(target->display_name) > maxhost) ? strlen(target->display_name) : maxhost;
@@ -872,184 +1324,260 @@ int main(int argc, char **argv) {
         print_header(format, maxhost, prognum_offset, version);
     }
 
-    /* the main loop */
-    while(target) {
-        loop_count++;
+    if (cfg.socket_path) {
+        server = serve_unix(cfg.socket_path, &results_lock, serve_results, &targets);
+    }
+
+    /* the callback takes the lock itself, only for as long as it takes to copy the results */
+    if (cfg.metrics_listen) {
+        metrics.targets = &targets;
+        metrics.protocol = null_dispatch[prognum_offset][version].protocol;
+        metrics_server = serve_http(cfg.metrics_listen, NULL, serve_metrics, &metrics);
+    }
+
+    /* the list is published again whenever it changes */
+    if (cfg.stats_name) {
+        live_stats = stats_open(cfg.stats_name, null_dispatch[prognum_offset][version].protocol);
+        stats_targets(live_stats, targets);
+    }
+
+    /* in batch mode, ping each batch of targets and print a summary before reading the next one */
+    do {
+        target = targets;
+
+        /* the main loop */
+        while(target) {
+            loop_count++;
 
-        /* find the current number of rows in the terminal for printing the header once per screen */
-        ioctl(STDOUT_FILENO, TIOCGWINSZ, &winsz);
-        rows = winsz.ws_row;
+            /* find the current number of rows in the terminal for printing the header once per screen */
+            /* zero if the output isn't a terminal */
+            rows = ioctl(STDOUT_FILENO, TIOCGWINSZ, &winsz) == 0 ? winsz.ws_row : 0;
 
-        /* grab the starting time of each loop */
+            /* grab the starting time of each loop */
 #ifdef CLOCK_MONOTONIC_RAW
-        clock_gettime(CLOCK_MONOTONIC_RAW, &loop_start);
+            clock_gettime(CLOCK_MONOTONIC_RAW, &loop_start);
 #else
-        clock_gettime(CLOCK_MONOTONIC, &loop_start);
+            clock_gettime(CLOCK_MONOTONIC, &loop_start);
 #endif
 
-        while (target) {
-            /* reset */
-            status = NULL;
+            while (target) {
+                /* reset */
+                status = NULL;
+                timedout = 0;
 
-            /* check if we were disconnected (TCP) or if this is the first iteration */
-            if (target->client == NULL) {
-                /* try and (re)connect */
-                target->client = create_rpc_client(target->client_sock, &hints, prognum, null_dispatch[prognum_offset][version].version, timeout, src_ip);
-            }
+                /* check if we were disconnected (TCP) or if this is the first iteration */
+                if (target->client == NULL) {
+                    /* try and (re)connect */
+                    target->client = create_rpc_client(target->client_sock, &hints, prognum, null_dispatch[prognum_offset][version].version, timeout, src_ip);
+                }
 
-            /* now see if we're connected */
-            if (target->client) {
-                /* grab the wall clock time for output */
-                /* use the start time of the request */
-                /* the call_start timer is more important so do this first so we're not measuring the time this call takes */
-                clock_gettime(CLOCK_REALTIME, &wall_clock);
+                /* now see if we're connected */
+                if (target->client) {
+                    /* grab the wall clock time for output */
+                    /* use the start time of the request */
+                    /* the call_start timer is more important so do this first so we're not measuring the time this call takes */
+                    clock_gettime(CLOCK_REALTIME, &wall_clock);
 
-                /* first time marker */
-                /* the MONOTONIC clocks don't record the actual time but are good for measuring elapsed time accurately */
+                    /* first time marker */
+                    /* the MONOTONIC clocks don't record the actual time but are good for measuring elapsed time accurately */
 #ifdef CLOCK_MONOTONIC_RAW
-                clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
 #else
-                clock_gettime(CLOCK_MONOTONIC, &call_start);
+                    clock_gettime(CLOCK_MONOTONIC, &call_start);
 #endif
-                /* the actual ping */
-                /* use a dispatch table instead of switch */
-                /* doublecheck that the procedure exists, should have been checked above */
-                if (null_dispatch[prognum_offset][version].proc) {
-                    status = null_dispatch[prognum_offset][version].proc(NULL, target->client);
-                } else {
-                    fatal("Illegal version: %lu\n", version);
-                }
+                    /* the actual ping */
+                    /* use a dispatch table instead of switch */
+                    /* doublecheck that the procedure exists, should have been checked above */
+                    if (null_dispatch[prognum_offset][version].proc) {
+                        status = null_dispatch[prognum_offset][version].proc(NULL, target->client);
+                    } else {
+                        fatal("Illegal version: %lu\n", version);
+                    }
 
-                /* second time marker */
+                    /* second time marker */
 #ifdef CLOCK_MONOTONIC_RAW
-                clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
+                    clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
 #else
-                clock_gettime(CLOCK_MONOTONIC, &call_end);
+                    clock_gettime(CLOCK_MONOTONIC, &call_end);
 #endif
-            } /* else not connected */
+                } /* else not connected */
+
+                /* the socket thread (-U) reads the results */
+                pthread_mutex_lock(&results_lock);
+
+                /* count this no matter what to stop from looping in case server isn't listening */
+                target->sent++;
+                target->total_sent++;
+                total_sent++;
+
+                if (status) {
+                    target->received++;
+                    total_recv++;
+
+                    /* calculate elapsed microseconds */
+                    /* TODO make internal calcs in nanoseconds? */
+                    timespecsub(&call_end, &call_start, &call_elapsed);
+                    us = ts2us(call_elapsed);
+
+                    if (format == ping_fping) {
+                        if (us < target->min) target->min = us;
+                        if (us > target->max) target->max = us;
+                        /* calculate the average time */
+                        target->avg = (target->avg * (target->received - 1) + us) / target->received;
+
+                        /* store the result for the final output */
+                        /* one ping per target each round */
+                        target->results[loop_count - 1] = us;
+                    } else {
+                        hdr_record_value(target->histogram, us);
+                        /* TODO hdr_add()? */
+                        hdr_record_value(target->interval_histogram, us);
+                    }
+                }
 
-            /* count this no matter what to stop from looping in case server isn't listening */
-            target->sent++;
-            total_sent++;
+                pthread_mutex_unlock(&results_lock);
 
-            /* print a header for every screen of output */
-            if (!quiet && (total_sent % rows == 0)) {
-                print_header(format, maxhost, prognum_offset, version);
-            }
+                /* print a header for every screen of output */
+                if (!quiet && rows && (total_sent % rows == 0)) {
+                    print_header(format, maxhost, prognum_offset, version);
+                }
 
-            /* check for success */
-            if (status) {
-                target->received++;
-                total_recv++;
+                /* check for success */
+                if (status) {
+                    if (!quiet) {
+                        /* use the start time for the call since some calls may not return */
+                        /* if there's an error we use print_lost() but stay consistent with timing */
+                        print_result(format, maxhost, prefix, target, prognum_offset, version, wall_clock, us);
+                    }
+                /* something went wrong */
+                } else {
+                    /* use the start time since the call may have timed out */
+                    print_lost(format, prefix, target, prognum_offset, version, wall_clock);
+
+                    if (target->client) {
+                        /* TODO make a string to pass to clnt_perror */
+                        fprintf(stderr, "%s : ", target->display_name);
+                        clnt_geterr(target->client, &clnt_err);
+                        clnt_perror(target->client, null_dispatch[prognum_offset][version].name);
+                        fflush(stderr);
+
+                        timedout = clnt_err.re_status == RPC_TIMEDOUT;
+
+                        /* check for broken pipes or reset connections and try and reconnect next time */
+                        if (clnt_err.re_errno == EPIPE || ECONNRESET) {
+                            target->client = destroy_rpc_client(target->client);
+                        }
+                    } /* TODO else? */
+                }
 
-                /* calculate elapsed microseconds */
-                /* TODO make internal calcs in nanoseconds? */
-                timespecsub(&call_end, &call_start, &call_elapsed);
-                us = ts2us(call_elapsed);
+                /* this only writes to memory so it can't hold up the pings */
+                if (target->stats) {
+                    stats_update(target->stats, status != NULL, timedout, us);
+                }
 
-                if (format == ping_fping) {
-                    if (us < target->min) target->min = us;
-                    if (us > target->max) target->max = us;
-                    /* calculate the average time */
-                    target->avg = (target->avg * (target->received - 1) + us) / target->received;
+                /* check if we should print a periodic summary */
+                /* This doesn't use an actual timer, it just sees if we've sent the expected number of packets based on the configured hertz. We should be pretty close. */
+                if (cfg.summary_interval && (loop_count % (hertz * cfg.summary_interval) == 0)) {
+                    pthread_mutex_lock(&results_lock);
 
-                    /* store the result for the final output */
-                    target->results[total_sent - 1] = us;
-                } else {
-                    hdr_record_value(target->histogram, us);
-                    /* TODO hdr_add()? */
-                    hdr_record_value(target->interval_histogram, us);
+                    print_interval(format, prefix, target, prognum_offset, version, wall_clock);
+
+                    /* reset target counters */
+                    target->sent = 0;
+                    target->received = 0;
+                    if (format == ping_fping) {
+                        target->min = ULONG_MAX;
+                        target->max = 0;
+                        target->avg = 0;
+                    } else {
+                        hdr_reset(target->interval_histogram);
+                    }
+
+                    if (target->stats) {
+                        stats_reset(target->stats);
+                    }
+
+                    pthread_mutex_unlock(&results_lock);
                 }
 
-                if (!quiet) {
-                    /* use the start time for the call since some calls may not return */
-                    /* if there's an error we use print_lost() but stay consistent with timing */
-                    print_result(format, maxhost, prefix, target, prognum_offset, version, wall_clock, us);
+                /* see if we should disconnect and reconnect */
+                if (reconnect) {
+                    target->client = destroy_rpc_client(target->client);
                 }
-            /* something went wrong */
-            } else {
-                /* use the start time since the call may have timed out */
-                print_lost(format, prefix, target, prognum_offset, version, wall_clock);
 
-                if (target->client) {
-                    /* TODO make a string to pass to clnt_perror */
-                    fprintf(stderr, "%s : ", target->display_name);
-                    clnt_geterr(target->client, &clnt_err);
-                    clnt_perror(target->client, null_dispatch[prognum_offset][version].name);
-                    fflush(stderr);
-
-                    /* check for broken pipes or reset connections and try and reconnect next time */
-                    if (clnt_err.re_errno == EPIPE || ECONNRESET) {
-                        target->client = destroy_rpc_client(target->client);
-                    }
-                } /* TODO else? */
+                target = target->next;
+
+                /* pause between targets */
+                if (target && (wait_time.tv_sec || wait_time.tv_nsec)) {
+                    nanosleep(&wait_time, NULL);
+                }
+            } /* while(target) */
+
+            /* see if we've been signalled */
+            if (quitting) {
+                break;
             }
 
-            /* check if we should print a periodic summary */
-            /* This doesn't use an actual timer, it just sees if we've sent the expected number of packets based on the configured hertz. We should be pretty close. */
-            if (cfg.summary_interval && (loop_count % (hertz * cfg.summary_interval) == 0)) {
-                print_interval(format, prefix, target, prognum_offset, version, wall_clock);
-
-                /* reset target counters */
-                target->sent = 0;
-                target->received = 0;
-                if (format == ping_fping) {
-                    target->min = ULONG_MAX;
-                    target->max = 0;
-                    target->avg = 0;
+            /* at the end of the targets list, see if we need to loop */
+            if (loop || (count && loop_count < count)) {
+                /* sleep between rounds */
+                /* measure how long the current round took, and subtract that from the sleep time */
+                /* this tries to ensure that each polling round takes the same time */
+#ifdef CLOCK_MONOTONIC_RAW
+                clock_gettime(CLOCK_MONOTONIC_RAW, &loop_end);
+#else
+                clock_gettime(CLOCK_MONOTONIC, &loop_end);
+#endif
+                timespecsub(&loop_end, &loop_start, &loop_elapsed);
+                debug("Polling took %lld.%.9lds\n", (long long)loop_elapsed.tv_sec, loop_elapsed.tv_nsec);
+                /* don't sleep if we went over the sleep_time */
+                if (timespeccmp(&loop_elapsed, &sleep_time, >)) {
+                    debug("Slow poll, not sleeping\n");
                 } else {
-                    hdr_reset(target->interval_histogram);
+                    timespecsub(&sleep_time, &loop_elapsed, &sleepy);
+                    debug("Sleeping for %lld.%.9lds\n", (long long)sleepy.tv_sec, sleepy.tv_nsec);
+                    nanosleep(&sleepy, NULL);
                 }
-            }
 
-            /* see if we should disconnect and reconnect */
-            if (reconnect) {
-                target->client = destroy_rpc_client(target->client);
-            }
+                /* the new list is used from the next round */
+                if (reloading) {
+                    reloading = 0;
+                    reload_targets(&targets, &hints, port, multiple, timeout, format == ping_fping ? count : 0);
 
-            target = target->next;
+                    /* find the longest name for output spacing */
+                    maxhost = 0;
+                    for (target = targets; target; target = target->next) {
+                        maxhost = (strlen(target->display_name) > maxhost) ? strlen(target->display_name) : maxhost;
+                    }
+                }
 
-            /* pause between targets */
-            if (target && (wait_time.tv_sec || wait_time.tv_nsec)) {
-                nanosleep(&wait_time, NULL);
+                /* reset to start of target list */
+                target = targets;
             }
         } /* while(target) */
 
-        /* see if we've been signalled */
-        if (quitting) {
-            break;
-        }
 
-        /* at the end of the targets list, see if we need to loop */
-        if (loop || (count && loop_count < count)) {
-            /* sleep between rounds */
-            /* measure how long the current round took, and subtract that from the sleep time */
-            /* this tries to ensure that each polling round takes the same time */
-#ifdef CLOCK_MONOTONIC_RAW
-            clock_gettime(CLOCK_MONOTONIC_RAW, &loop_end);
-#else
-            clock_gettime(CLOCK_MONOTONIC, &loop_end);
-#endif
-            timespecsub(&loop_end, &loop_start, &loop_elapsed);
-            debug("Polling took %lld.%.9lds\n", (long long)loop_elapsed.tv_sec, loop_elapsed.tv_nsec);
-            /* don't sleep if we went over the sleep_time */
-            if (timespeccmp(&loop_elapsed, &sleep_time, >)) {
-                debug("Slow poll, not sleeping\n");
-            } else {
-                timespecsub(&sleep_time, &loop_elapsed, &sleepy);
-                debug("Sleeping for %lld.%.9lds\n", (long long)sleepy.tv_sec, sleepy.tv_nsec);
-                nanosleep(&sleepy, NULL);
-            }
+        if (cfg.batch) {
+            print_summary(format, stdout, loop_count, targets);
+            /* a blank line ends the results for the batch */
+            printf("\n");
+            fflush(stdout);
 
-            /* reset to start of target list */
-            target = targets;
+            /* start counting again for the next batch */
+            loop_count = 0;
         }
-    } /* while(target) */
+    } while (cfg.batch && !quitting && read_batch(&targets, &hints, port, multiple, timeout, count));
+
+    server = serve_stop(server);
+    metrics_server = serve_stop(metrics_server);
+    live_stats = stats_close(live_stats);
 
     fflush(stdout);
 
     /* print a format-specific summary at the end */
-    print_summary(format, total_sent, targets);
+    if (!cfg.batch) {
+        print_summary(format, stderr, loop_count, targets);
+    }
 
     /* exit with a failure if there were any missing responses */
     if (total_recv < total_sent) {
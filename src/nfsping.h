@@ -23,6 +23,7 @@
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>
 #include <errno.h>
+#include <pthread.h>
 
 /* local copies */
 /* TODO do these need to be included in all utilities? */
@@ -67,9 +68,18 @@
 /* ULLONG_MAX = 18446744073709551615 = 20 + NUL */
 #define COOKIE_MAX 21
 
+/* pool of RPC clients for threaded utilities, see rpc.h */
+struct rpc_pool;
+/* bump allocator, see arena.h */
+struct arena;
+/* live statistics in shared memory, see stats.h */
+struct stats_target;
+
 typedef struct targets {
     /* make the first field a pointer so that assigning to {0} works */
     CLIENT *client; /* RPC client */
+    /* extra connections for sending requests to this target in parallel */
+    struct rpc_pool *pool;
     char name[NI_MAXHOST]; /* from getnameinfo() */
     char *ndqf; /* reversed name, for Graphite etc */
     char ip_address[INET_ADDRSTRLEN]; /* the IP address as a string, from inet_ntop() */
@@ -79,12 +89,16 @@ typedef struct targets {
     /* for fping output when we need to store the individual results for the summary */
     unsigned long *results;
     unsigned int sent, received;
+    /* requests sent since the start, sent is reset by each -Q interval */
+    unsigned long total_sent;
     unsigned long min, max;
     float avg;
     /* histogram for each interval if using -Q */
     struct hdr_histogram *interval_histogram;
     /* histogram for all results */
     struct hdr_histogram *histogram;
+    /* live statistics in shared memory (nfsping -z), or NULL */
+    struct stats_target *stats;
     /* anonymous union to store different types of target data */
     /* TODO make for ping and fping (results etc) */
     /* TODO enum to specify type */
@@ -92,6 +106,8 @@ typedef struct targets {
         struct mount_exports *exports;
         struct nfs_fh_list   *filehandles;
     };
+    /* the end of the filehandle list so adding to it doesn't walk the whole list */
+    struct nfs_fh_list *last_fh;
 
     struct targets *next;
 } targets_t;
@@ -104,6 +120,8 @@ struct mount_exports {
     unsigned long sent, received;
     unsigned long min, max;
     float avg;
+    /* histogram of MNT times when looping */
+    struct hdr_histogram *histogram;
     JSON_Value *json_root; /* the JSON object for output */
 
     struct mount_exports *next;
@@ -133,6 +151,12 @@ typedef struct nfs_fh_list {
     nfs_fh3 nfs_fh; /* generic name so we can include v2/v4 later */
     /* directory entries */
     entrypluslink3 *entries;
+    /* memory for the entries and their names, filehandles etc */
+    struct arena *arena;
+    /* directory times when the entries were read, so unchanged directories don't have to be listed again */
+    int cached;
+    nfstime3 mtime;
+    nfstime3 ctime;
 
     struct nfs_fh_list *next;
 } nfs_fh_list;
@@ -12,9 +12,12 @@ extern int verbose;
 /* pmap_getport uses its own client so you can't specify a source IP address or timeout etc */
 /* return the port in network byte order */
 /* protocol can be PMAP_IPPROTO_TCP or PMAP_IPPROTO_UDP */
+/* the generated pmapproc_getport_2() returns a static result which isn't thread safe, so call clnt_call() directly */
 uint16_t get_rpc_port(CLIENT *client, long unsigned prognum, long unsigned version, long unsigned protocol) {
-    u_long *res = NULL;
+    u_long res = 0;
     uint16_t port = 0;
+    /* the same as the generated code, the client's own timeout is used instead if it has one */
+    struct timeval timeout = { 25, 0 };
     pmap pmap_args = {
         .pm_prog = prognum,
         .pm_vers = version,
@@ -25,11 +28,12 @@ uint16_t get_rpc_port(CLIENT *client, long unsigned prognum, long unsigned versi
     char ip_address[INET_ADDRSTRLEN];
 
     if (client) {
-        res = pmapproc_getport_2(&pmap_args, client);
-
-        if (res) {
+        if (clnt_call(client, PMAPPROC_GETPORT,
+            (xdrproc_t) xdr_pmap, (caddr_t) &pmap_args,
+            (xdrproc_t) xdr_u_long, (caddr_t) &res,
+            timeout) == RPC_SUCCESS) {
             /* convert to network byte order */
-            port = htons(*res);
+            port = htons(res);
             /* RPC succeeded, but program isn't registered */
             if (port == 0) {
                 /* get the server address out of the client */
@@ -210,3 +214,138 @@ CLIENT *create_rpc_client(struct sockaddr_in *client_sock, struct addrinfo *hint
 
     return client;
 }
+
+
+/* make a new (empty) pool of connections to a server */
+/* connections are only made when they're checked out with rpc_pool_get() */
+/* max = 0 means there's no limit on the number of connections */
+/* exits if it can't be allocated */
+struct rpc_pool *rpc_pool_new(struct sockaddr_in *client_sock, struct addrinfo *hints, unsigned long prognum, unsigned long version, struct timeval timeout, struct sockaddr_in src_ip, unsigned int max, int auth_sys) {
+    struct rpc_pool *pool = calloc(1, sizeof(struct rpc_pool));
+
+    if (pool == NULL) {
+        fatalx(3, "Couldn't allocate memory for connection pool!\n");
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->available, NULL);
+    pool->client_sock = *client_sock;
+    pool->socktype = hints->ai_socktype;
+    pool->prognum = prognum;
+    pool->version = version;
+    pool->timeout = timeout;
+    pool->src_ip = src_ip;
+    pool->auth_sys = auth_sys;
+    pool->max = max;
+
+    return pool;
+}
+
+
+/* check out a connection from a pool */
+/* reuses an idle connection if there is one, otherwise connects to the server */
+/* if the pool is at its maximum size, wait until another thread returns a connection */
+/* returns NULL if a new connection couldn't be made */
+CLIENT *rpc_pool_get(struct rpc_pool *pool) {
+    CLIENT *client = NULL;
+    struct sockaddr_in client_sock;
+    struct addrinfo hints = { 0 };
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (pool->idle == 0 && pool->max && pool->busy >= pool->max) {
+        pthread_cond_wait(&pool->available, &pool->lock);
+    }
+
+    pool->busy++;
+
+    if (pool->idle) {
+        client = pool->clients[--pool->idle];
+        pthread_mutex_unlock(&pool->lock);
+        return client;
+    }
+
+    /* make a new connection, use a copy of the address because create_rpc_client() changes the port if using the portmapper */
+    client_sock = pool->client_sock;
+    pthread_mutex_unlock(&pool->lock);
+
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = pool->socktype;
+
+    /* don't hold the lock while connecting so other threads can use idle connections */
+    client = create_rpc_client(&client_sock, &hints, pool->prognum, pool->version, pool->timeout, pool->src_ip);
+
+    pthread_mutex_lock(&pool->lock);
+
+    if (client) {
+        /* remember the port from the portmapper so we only have to ask once */
+        pool->client_sock.sin_port = client_sock.sin_port;
+
+        if (pool->auth_sys) {
+            /* don't use default AUTH_NONE */
+            auth_destroy(client->cl_auth);
+            client->cl_auth = authunix_create_default();
+        }
+    } else {
+        /* give the slot back */
+        pool->busy--;
+        pthread_cond_signal(&pool->available);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+
+    return client;
+}
+
+
+/* return a connection to the pool */
+/* if the connection had an error (ie a broken TCP connection) close it instead of reusing it */
+void rpc_pool_put(struct rpc_pool *pool, CLIENT *client, int broken) {
+    CLIENT **clients;
+
+    pthread_mutex_lock(&pool->lock);
+
+    pool->busy--;
+
+    if (client) {
+        if (broken) {
+            destroy_rpc_client(client);
+        } else {
+            /* grow the stack of idle connections if needed */
+            if (pool->idle == pool->size) {
+                clients = realloc(pool->clients, (pool->size + 8) * sizeof(CLIENT *));
+                if (clients) {
+                    pool->clients = clients;
+                    pool->size += 8;
+                }
+            }
+
+            if (pool->idle < pool->size) {
+                pool->clients[pool->idle++] = client;
+            } else {
+                destroy_rpc_client(client);
+            }
+        }
+    }
+
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+
+/* close all idle connections and free the pool */
+/* all connections should have been returned first */
+struct rpc_pool *rpc_pool_destroy(struct rpc_pool *pool) {
+    if (pool) {
+        while (pool->idle) {
+            destroy_rpc_client(pool->clients[--pool->idle]);
+        }
+
+        free(pool->clients);
+        pthread_cond_destroy(&pool->available);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+    }
+
+    return NULL;
+}
@@ -1,8 +1,37 @@
 #ifndef RPC_H
 #define RPC_H
 
+/* a pool of RPC clients connected to the same server */
+/* CLIENT handles aren't thread safe, so each thread needs its own connection to have requests outstanding in parallel */
+/* the maximum size of the pool limits the number of parallel requests to the server */
+struct rpc_pool {
+    pthread_mutex_t lock;
+    pthread_cond_t  available;
+    /* copied so creating new connections doesn't touch the target */
+    struct sockaddr_in client_sock;
+    int socktype;
+    unsigned long prognum;
+    unsigned long version;
+    struct timeval timeout;
+    struct sockaddr_in src_ip;
+    /* use AUTH_SYS instead of the default AUTH_NONE */
+    int auth_sys;
+    /* maximum number of connections, 0 = unlimited */
+    unsigned int max;
+    /* number of connections currently checked out */
+    unsigned int busy;
+    /* stack of idle connections */
+    unsigned int idle;
+    unsigned int size;
+    CLIENT **clients;
+};
+
 CLIENT *create_rpc_client(struct sockaddr_in *client_sock, struct addrinfo *hints, unsigned long prognum, unsigned long version, struct timeval timeout, struct sockaddr_in src_ip);
 CLIENT *destroy_rpc_client(CLIENT *client);
 uint16_t get_rpc_port(CLIENT *client, long unsigned prognum, long unsigned version, long unsigned protocol);
+struct rpc_pool *rpc_pool_new(struct sockaddr_in *client_sock, struct addrinfo *hints, unsigned long prognum, unsigned long version, struct timeval timeout, struct sockaddr_in src_ip, unsigned int max, int auth_sys);
+CLIENT *rpc_pool_get(struct rpc_pool *pool);
+void rpc_pool_put(struct rpc_pool *pool, CLIENT *client, int broken);
+struct rpc_pool *rpc_pool_destroy(struct rpc_pool *pool);
 
 #endif /* RPC_H */
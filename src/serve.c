@@ -0,0 +1,422 @@
+/*
+ * Serve results to other programs
+ *
+ * A long running process keeps its targets, RPC clients and histograms between rounds, so other programs can ask it
+ * for the latest results instead of starting a new process (and doing all of the DNS and portmapper lookups again)
+ * each time. A client connects to a Unix socket and the current results are written back to it before the connection
+ * is closed, there's no request to parse. Or a monitoring system can scrape them over HTTP from /metrics.
+ *
+ * The results are written into memory while holding the caller's lock and only sent once it has been released, so a
+ * slow client can't hold up the thread that is doing the pinging.
+ */
+
+#include "serve.h"
+#include "util.h"
+#include <sys/un.h>
+
+/* globals */
+extern int verbose;
+
+/* histogram buckets in seconds, from 100us up to the longest timeout anyone is likely to use */
+static const double serve_buckets[] = { 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+/* summary quantiles */
+static const double serve_quantiles[] = { 0.5, 0.9, 0.99 };
+
+/* how long to wait for a client to send its request or read the results */
+#define SERVE_TIMEOUT { .tv_sec = 1, .tv_usec = 0 }
+/* the most of an HTTP request that's read, only the first line is used */
+#define SERVE_REQUEST 4096
+
+/* local prototypes */
+static int serve_request(struct serve *, int);
+static void serve_write(struct serve *, int, const char *, size_t);
+static void serve_client(struct serve *, int);
+static void *serve_worker(void *);
+static void serve_start(struct serve *);
+static struct serve *serve_new(const char *, pthread_mutex_t *, serve_t, void *);
+static double serve_sum(const struct hdr_histogram *);
+
+
+/* read an HTTP request and check that it's for the metrics */
+/* returns the HTTP status code to send back */
+static int serve_request(struct serve *server, int client) {
+    char request[SERVE_REQUEST];
+    size_t len = 0;
+    ssize_t n;
+    char *path;
+
+    /* only wait for the end of the first line */
+    while (len < sizeof(request) - 1) {
+        n = read(client, request + len, sizeof(request) - 1 - len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+        request[len] = '\0';
+        if (strchr(request, '\n')) {
+            break;
+        }
+    }
+    request[len] = '\0';
+
+    if (strncmp(request, "GET ", 4) != 0) {
+        debug("%s: bad request\n", server->path);
+        return len ? 405 : 400;
+    }
+
+    /* ignore any query string */
+    path = request + 4;
+    if (strncmp(path, "/metrics", 8) != 0 || (path[8] != ' ' && path[8] != '?' && path[8] != '\r' && path[8] != '\n')) {
+        return 404;
+    }
+
+    return 200;
+}
+
+
+/* write a buffer to a client, giving up if it stops reading */
+static void serve_write(struct serve *server, int client, const char *buffer, size_t size) {
+    size_t sent = 0;
+    ssize_t n;
+
+    while (sent < size) {
+        n = write(client, buffer + sent, size - sent);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            debug("%s: %s\n", server->path, strerror(errno));
+            break;
+        }
+        sent += n;
+    }
+}
+
+
+/* write the results to a connected client */
+static void serve_client(struct serve *server, int client) {
+    struct timeval timeout = SERVE_TIMEOUT;
+    char *buffer = NULL;
+    size_t size = 0;
+    char header[256];
+    int status = 200;
+    int len;
+    FILE *out;
+
+    /* don't wait forever for a client that isn't sending or reading */
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (server->http) {
+        status = serve_request(server, client);
+    }
+
+    out = open_memstream(&buffer, &size);
+    if (out == NULL) {
+        perror("open_memstream");
+        return;
+    }
+
+    if (status == 200) {
+        if (server->lock) {
+            pthread_mutex_lock(server->lock);
+        }
+        server->callback(out, server->arg);
+        if (server->lock) {
+            pthread_mutex_unlock(server->lock);
+        }
+    } else {
+        fprintf(out, "%i\n", status);
+    }
+
+    /* this sets buffer and size */
+    fclose(out);
+
+    if (server->http) {
+        len = snprintf(header, sizeof(header),
+            "HTTP/1.0 %i %s\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n"
+            "\r\n",
+            status, status == 200 ? "OK" : status == 404 ? "Not Found" : status == 405 ? "Method Not Allowed" : "Bad Request",
+            size);
+        serve_write(server, client, header, len);
+    }
+
+    serve_write(server, client, buffer, size);
+
+    free(buffer);
+}
+
+
+/* accept clients until the thread is cancelled */
+static void *serve_worker(void *arg) {
+    struct serve *server = arg;
+    int client;
+
+    while (1) {
+        /* accept() is where the thread can be cancelled */
+        client = accept(server->sock, NULL, NULL);
+
+        if (client == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror(server->path);
+            }
+            continue;
+        }
+
+        /* don't get cancelled while holding the lock */
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+        serve_client(server, client);
+        close(client);
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+    }
+
+    return NULL;
+}
+
+
+static struct serve *serve_new(const char *path, pthread_mutex_t *lock, serve_t callback, void *arg) {
+    struct serve *server = calloc(1, sizeof(struct serve));
+
+    if (server == NULL) {
+        fatalx(3, "Couldn't allocate memory for server!\n");
+    }
+
+    server->path = strdup(path);
+    if (server->path == NULL) {
+        fatalx(3, "Couldn't allocate memory for server!\n");
+    }
+    server->lock = lock;
+    server->callback = callback;
+    server->arg = arg;
+
+    return server;
+}
+
+
+/* listen on the bound socket and start the thread */
+static void serve_start(struct serve *server) {
+    sigset_t all, old;
+
+    if (listen(server->sock, SOMAXCONN) == -1) {
+        fatalx(3, "%s: %s\n", server->path, strerror(errno));
+    }
+
+    /* leave the signals to the main thread so they still interrupt its sleeps */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    if (pthread_create(&server->thread, NULL, serve_worker, server) != 0) {
+        fatalx(3, "Couldn't create thread!\n");
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    debug("Listening on %s\n", server->path);
+}
+
+
+/* listen on a Unix socket and start a thread to answer clients */
+/* any existing file at the path is removed first, so a socket left over from a previous run doesn't get in the way */
+/* the callback is called with the lock held for each client */
+struct serve *serve_unix(const char *path, pthread_mutex_t *lock, serve_t callback, void *arg) {
+    struct serve *server;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fatalx(3, "%s: socket path too long!\n", path);
+    }
+    strcpy(addr.sun_path, path);
+
+    server = serve_new(path, lock, callback, arg);
+
+    server->sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server->sock == -1) {
+        fatalx(3, "socket: %s\n", strerror(errno));
+    }
+
+    unlink(path);
+
+    if (bind(server->sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fatalx(3, "%s: %s\n", path, strerror(errno));
+    }
+
+    serve_start(server);
+
+    return server;
+}
+
+
+/* listen for HTTP on a TCP port, given as "port" for all addresses or "address:port" */
+/* GET /metrics calls the callback, and its output is sent back as the body */
+/* a scrape can take a while to format so the callback can be given a NULL lock and copy what it needs itself */
+struct serve *serve_http(const char *listen_on, pthread_mutex_t *lock, serve_t callback, void *arg) {
+    struct serve *server;
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_addr.s_addr = htonl(INADDR_ANY),
+    };
+    const char *port = strrchr(listen_on, ':');
+    char ip[INET_ADDRSTRLEN];
+    unsigned long number;
+    char *end;
+    int on = 1;
+
+    if (port) {
+        if ((size_t)(port - listen_on) >= sizeof(ip)) {
+            fatalx(3, "%s: invalid address!\n", listen_on);
+        }
+        memcpy(ip, listen_on, port - listen_on);
+        ip[port - listen_on] = '\0';
+        if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+            fatalx(3, "%s: invalid address!\n", listen_on);
+        }
+        port++;
+    } else {
+        port = listen_on;
+    }
+
+    number = strtoul(port, &end, 10);
+    if (*port == '\0' || *end != '\0' || number == 0 || number > 65535) {
+        fatalx(3, "%s: invalid port!\n", listen_on);
+    }
+    addr.sin_port = htons(number);
+
+    server = serve_new(listen_on, lock, callback, arg);
+    server->http = 1;
+
+    server->sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->sock == -1) {
+        fatalx(3, "socket: %s\n", strerror(errno));
+    }
+
+    /* so it can be restarted straight away */
+    setsockopt(server->sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if (bind(server->sock, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        fatalx(3, "%s: %s\n", listen_on, strerror(errno));
+    }
+
+    serve_start(server);
+
+    return server;
+}
+
+
+/* write a Prometheus label value with quotes, backslashes and newlines escaped */
+void serve_label(FILE *out, const char *value) {
+    for (; *value; value++) {
+        switch (*value) {
+            case '\\':
+                fputs("\\\\", out);
+                break;
+            case '"':
+                fputs("\\\"", out);
+                break;
+            case '\n':
+                fputs("\\n", out);
+                break;
+            default:
+                fputc(*value, out);
+        }
+    }
+}
+
+
+/* copy a histogram so it can be read without holding the lock */
+/* they're a single allocation so this is one memcpy(), free() the copy */
+struct hdr_histogram *serve_copy(struct hdr_histogram *histogram) {
+    size_t size = hdr_get_memory_size(histogram);
+    struct hdr_histogram *copy = malloc(size);
+
+    if (copy == NULL) {
+        fatalx(3, "Couldn't allocate memory for histogram!\n");
+    }
+    memcpy(copy, histogram, size);
+
+    return copy;
+}
+
+
+/* the histogram only has counts, so add up each recorded value's count times the middle of its range */
+/* returns seconds */
+static double serve_sum(const struct hdr_histogram *histogram) {
+    struct hdr_iter iter;
+    double sum = 0;
+
+    hdr_iter_recorded_init(&iter, histogram);
+    while (hdr_iter_next(&iter)) {
+        sum += iter.count * (double)hdr_median_equivalent_value(histogram, iter.value);
+    }
+
+    return sum / 1000000.0;
+}
+
+
+/* write a Prometheus histogram from an HDR histogram of response times in us */
+/* labels are already formatted and escaped, like host="a",ip="b" */
+void serve_histogram(FILE *out, const char *metric, const char *labels, const struct hdr_histogram *histogram) {
+    struct hdr_iter iter;
+    int64_t cumulative = 0;
+    size_t i = 0;
+
+    /* the buckets are cumulative, so each one gets everything up to its limit */
+    hdr_iter_recorded_init(&iter, histogram);
+    while (hdr_iter_next(&iter)) {
+        while (i < sizeof(serve_buckets) / sizeof(serve_buckets[0]) && iter.value > serve_buckets[i] * 1000000) {
+            fprintf(out, "%s_bucket{%s,le=\"%g\"} %" PRId64 "\n", metric, labels, serve_buckets[i], cumulative);
+            i++;
+        }
+        cumulative += iter.count;
+    }
+    for (; i < sizeof(serve_buckets) / sizeof(serve_buckets[0]); i++) {
+        fprintf(out, "%s_bucket{%s,le=\"%g\"} %" PRId64 "\n", metric, labels, serve_buckets[i], cumulative);
+    }
+
+    fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %" PRId64 "\n", metric, labels, histogram->total_count);
+    fprintf(out, "%s_sum{%s} %.6f\n", metric, labels, serve_sum(histogram));
+    fprintf(out, "%s_count{%s} %" PRId64 "\n", metric, labels, histogram->total_count);
+}
+
+
+/* write a Prometheus summary of the quantiles of an HDR histogram of response times in us */
+void serve_summary(FILE *out, const char *metric, const char *labels, const struct hdr_histogram *histogram) {
+    size_t i;
+
+    for (i = 0; i < sizeof(serve_quantiles) / sizeof(serve_quantiles[0]); i++) {
+        /* there aren't any quantiles without results */
+        if (histogram->total_count) {
+            fprintf(out, "%s{%s,quantile=\"%g\"} %.6f\n", metric, labels, serve_quantiles[i],
+                hdr_value_at_percentile(histogram, serve_quantiles[i] * 100) / 1000000.0);
+        } else {
+            fprintf(out, "%s{%s,quantile=\"%g\"} NaN\n", metric, labels, serve_quantiles[i]);
+        }
+    }
+
+    fprintf(out, "%s_sum{%s} %.6f\n", metric, labels, serve_sum(histogram));
+    fprintf(out, "%s_count{%s} %" PRId64 "\n", metric, labels, histogram->total_count);
+}
+
+
+/* stop the thread and remove the socket, returns NULL */
+struct serve *serve_stop(struct serve *server) {
+    if (server) {
+        pthread_cancel(server->thread);
+        pthread_join(server->thread, NULL);
+
+        close(server->sock);
+        if (server->http == 0) {
+            unlink(server->path);
+        }
+
+        free(server->path);
+        free(server);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,31 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "nfsping.h"
+
+/* writes the current results to a client, called with the lock held if there is one */
+typedef void (*serve_t)(FILE *, void *);
+
+struct serve {
+    /* listening socket */
+    int sock;
+    /* the socket file, removed when the server is stopped, or the address for HTTP */
+    char *path;
+    /* answer HTTP requests for /metrics instead of writing the results straight away */
+    int http;
+    /* protects whatever the callback reads, or NULL if the callback does its own locking */
+    pthread_mutex_t *lock;
+    serve_t callback;
+    void *arg;
+    pthread_t thread;
+};
+
+struct serve *serve_unix(const char *, pthread_mutex_t *, serve_t, void *);
+struct serve *serve_http(const char *, pthread_mutex_t *, serve_t, void *);
+void serve_label(FILE *, const char *);
+struct hdr_histogram *serve_copy(struct hdr_histogram *);
+void serve_histogram(FILE *, const char *, const char *, const struct hdr_histogram *);
+void serve_summary(FILE *, const char *, const char *, const struct hdr_histogram *);
+struct serve *serve_stop(struct serve *);
+
+#endif /* SERVE_H */
@@ -0,0 +1,336 @@
+/*
+ * Sort directory listings
+ *
+ * The entries stay where they are in the listing's arena. An array of pointers (for names) or of keys and pointers
+ * (for numbers) is sorted instead and the list is linked back together in the new order. The arrays come from the
+ * same arena so they are thrown away with the listing.
+ *
+ * Numbers are sorted with an LSD radix sort, which only looks at each key eight times no matter how many entries
+ * there are, and skips bytes that are the same in every key. Names are sorted with a merge sort split across
+ * threads. Both are stable so entries with the same key stay in the order the server returned them.
+ */
+
+#include "sort.h"
+
+/* below this many entries a range is sorted with insertion sort */
+#define SORT_INSERTION 16
+/* don't start a thread for less than this many entries */
+#define SORT_CHUNK 65536
+
+/* a range of the array for a thread to sort or merge */
+struct sort_range {
+    pthread_t thread;
+    entrypluslink3 **entries;
+    entrypluslink3 **tmp;
+    size_t lo;
+    size_t mid;
+    size_t hi;
+};
+
+/* local prototypes */
+static uint64_t entry_key(entrypluslink3 *, enum sort_keys);
+static struct sort_item *radix_sort(struct sort_item *, struct sort_item *, size_t);
+static int compare_names(entrypluslink3 *, entrypluslink3 *);
+static void merge(entrypluslink3 **, entrypluslink3 **, size_t, size_t, size_t);
+static void merge_sort(entrypluslink3 **, entrypluslink3 **, size_t, size_t);
+static void *sort_worker(void *);
+static void *merge_worker(void *);
+static void sort_names(entrypluslink3 **, entrypluslink3 **, size_t, unsigned int);
+
+
+/* parse a sort key name from the command line */
+/* returns sort_none if it's unknown */
+enum sort_keys sort_key(const char *key) {
+    if (strcmp(key, "name") == 0) {
+        return sort_name;
+    } else if (strcmp(key, "size") == 0) {
+        return sort_size;
+    } else if (strcmp(key, "mtime") == 0) {
+        return sort_mtime;
+    } else if (strcmp(key, "inode") == 0) {
+        return sort_inode;
+    }
+
+    return sort_none;
+}
+
+
+/* the number to sort an entry by, entries without attributes sort as 0 */
+static uint64_t entry_key(entrypluslink3 *current, enum sort_keys key) {
+    struct fattr3 *attributes = &current->name_attributes.post_op_attr_u.attributes;
+
+    if (key == sort_inode) {
+        /* this is in the entry even without attributes */
+        return current->fileid;
+    }
+
+    if (current->name_attributes.attributes_follow == 0) {
+        return 0;
+    }
+
+    if (key == sort_size) {
+        return attributes->size;
+    }
+
+    /* sort_mtime, seconds then nanoseconds */
+    return ((uint64_t)attributes->mtime.seconds << 32) | attributes->mtime.nseconds;
+}
+
+
+/* LSD radix sort one byte at a time */
+/* returns whichever of the two arrays ends up holding the sorted items */
+static struct sort_item *radix_sort(struct sort_item *items, struct sort_item *tmp, size_t count) {
+    size_t histogram[8][256] = { { 0 } };
+    size_t offset, total;
+    struct sort_item *src = items;
+    struct sort_item *dst = tmp;
+    struct sort_item *swap;
+    unsigned int byte, i;
+    size_t n;
+
+    /* count every byte of every key in one pass */
+    for (n = 0; n < count; n++) {
+        for (byte = 0; byte < 8; byte++) {
+            histogram[byte][(items[n].key >> (byte * 8)) & 0xff]++;
+        }
+    }
+
+    for (byte = 0; byte < 8; byte++) {
+        /* every key has the same value for this byte, nothing to do */
+        if (histogram[byte][(items[0].key >> (byte * 8)) & 0xff] == count) {
+            continue;
+        }
+
+        /* turn the counts into starting positions */
+        total = 0;
+        for (i = 0; i < 256; i++) {
+            offset = histogram[byte][i];
+            histogram[byte][i] = total;
+            total += offset;
+        }
+
+        for (n = 0; n < count; n++) {
+            dst[histogram[byte][(src[n].key >> (byte * 8)) & 0xff]++] = src[n];
+        }
+
+        swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    return src;
+}
+
+
+static int compare_names(entrypluslink3 *a, entrypluslink3 *b) {
+    return strcmp(a->name, b->name);
+}
+
+
+/* merge two sorted runs [lo, mid) and [mid, hi) of src into dst */
+/* takes from the left run on ties to keep the sort stable */
+static void merge(entrypluslink3 **src, entrypluslink3 **dst, size_t lo, size_t mid, size_t hi) {
+    size_t left = lo;
+    size_t right = mid;
+    size_t out = lo;
+
+    while (left < mid && right < hi) {
+        if (compare_names(src[right], src[left]) < 0) {
+            dst[out++] = src[right++];
+        } else {
+            dst[out++] = src[left++];
+        }
+    }
+
+    while (left < mid) {
+        dst[out++] = src[left++];
+    }
+
+    while (right < hi) {
+        dst[out++] = src[right++];
+    }
+}
+
+
+/* sort [lo, hi) of entries in place using the same range of tmp */
+static void merge_sort(entrypluslink3 **entries, entrypluslink3 **tmp, size_t lo, size_t hi) {
+    entrypluslink3 *moving;
+    size_t mid, i, j;
+
+    if (hi - lo <= SORT_INSERTION) {
+        for (i = lo + 1; i < hi; i++) {
+            moving = entries[i];
+            for (j = i; j > lo && compare_names(moving, entries[j - 1]) < 0; j--) {
+                entries[j] = entries[j - 1];
+            }
+            entries[j] = moving;
+        }
+        return;
+    }
+
+    mid = lo + (hi - lo) / 2;
+    merge_sort(entries, tmp, lo, mid);
+    merge_sort(entries, tmp, mid, hi);
+
+    /* already in order */
+    if (compare_names(entries[mid], entries[mid - 1]) >= 0) {
+        return;
+    }
+
+    merge(entries, tmp, lo, mid, hi);
+    memcpy(&entries[lo], &tmp[lo], (hi - lo) * sizeof(entrypluslink3 *));
+}
+
+
+static void *sort_worker(void *arg) {
+    struct sort_range *range = arg;
+
+    merge_sort(range->entries, range->tmp, range->lo, range->hi);
+
+    return NULL;
+}
+
+
+static void *merge_worker(void *arg) {
+    struct sort_range *range = arg;
+
+    merge(range->entries, range->tmp, range->lo, range->mid, range->hi);
+    memcpy(&range->entries[range->lo], &range->tmp[range->lo], (range->hi - range->lo) * sizeof(entrypluslink3 *));
+
+    return NULL;
+}
+
+
+/* sort chunks of the array in parallel then merge pairs of neighbouring chunks in parallel until there's one left */
+static void sort_names(entrypluslink3 **entries, entrypluslink3 **tmp, size_t count, unsigned int threads) {
+    /* one range per thread, this doesn't need to be big */
+    struct sort_range ranges[64];
+    size_t chunks, chunk, width, i;
+    unsigned int started;
+
+    chunks = count / SORT_CHUNK + 1;
+    if (chunks > threads) {
+        chunks = threads;
+    }
+    if (chunks > sizeof(ranges) / sizeof(ranges[0])) {
+        chunks = sizeof(ranges) / sizeof(ranges[0]);
+    }
+
+    if (chunks <= 1) {
+        merge_sort(entries, tmp, 0, count);
+        return;
+    }
+
+    chunk = (count + chunks - 1) / chunks;
+
+    for (i = 0; i < chunks; i++) {
+        ranges[i].entries = entries;
+        ranges[i].tmp = tmp;
+        ranges[i].lo = i * chunk < count ? i * chunk : count;
+        ranges[i].hi = (i + 1) * chunk < count ? (i + 1) * chunk : count;
+
+        if (pthread_create(&ranges[i].thread, NULL, sort_worker, &ranges[i]) != 0) {
+            /* just do it here */
+            sort_worker(&ranges[i]);
+            ranges[i].thread = pthread_self();
+        }
+    }
+
+    for (i = 0; i < chunks; i++) {
+        if (!pthread_equal(ranges[i].thread, pthread_self())) {
+            pthread_join(ranges[i].thread, NULL);
+        }
+    }
+
+    /* each round merges runs of width chunks into runs twice as wide */
+    for (width = chunk; width < count; width *= 2) {
+        started = 0;
+
+        for (i = 0; i + width < count; i += width * 2) {
+            ranges[started].entries = entries;
+            ranges[started].tmp = tmp;
+            ranges[started].lo = i;
+            ranges[started].mid = i + width;
+            ranges[started].hi = i + width * 2 < count ? i + width * 2 : count;
+
+            if (pthread_create(&ranges[started].thread, NULL, merge_worker, &ranges[started]) != 0) {
+                merge_worker(&ranges[started]);
+                ranges[started].thread = pthread_self();
+            }
+            started++;
+        }
+
+        for (i = 0; i < started; i++) {
+            if (!pthread_equal(ranges[i].thread, pthread_self())) {
+                pthread_join(ranges[i].thread, NULL);
+            }
+        }
+    }
+}
+
+
+/* sort a list of entries and return the new head of the list */
+/* size and mtime sort largest/newest first like ls -S and ls -t, reverse flips the order */
+/* threads is the most threads to use for sorting names */
+entrypluslink3 *sort_entries(entrypluslink3 *list, enum sort_keys key, int reverse, unsigned int threads, struct arena *arena) {
+    entrypluslink3 **entries, **tmp;
+    struct sort_item *items, *sorted;
+    entrypluslink3 *current;
+    entrypluslink3 dummy = { .next = NULL };
+    size_t count = 0;
+    size_t i;
+
+    for (current = list; current; current = current->next) {
+        count++;
+    }
+
+    if (count < 2 || key == sort_none) {
+        return list;
+    }
+
+    entries = arena_alloc(arena, count * sizeof(entrypluslink3 *));
+    if (entries == NULL) {
+        return list;
+    }
+
+    if (key == sort_name) {
+        tmp = arena_alloc(arena, count * sizeof(entrypluslink3 *));
+        if (tmp == NULL) {
+            return list;
+        }
+
+        for (i = 0, current = list; current; current = current->next) {
+            entries[i++] = current;
+        }
+
+        sort_names(entries, tmp, count, threads ? threads : 1);
+    } else {
+        items = arena_alloc(arena, count * sizeof(struct sort_item));
+        sorted = arena_alloc(arena, count * sizeof(struct sort_item));
+        if (items == NULL || sorted == NULL) {
+            return list;
+        }
+
+        for (i = 0, current = list; current; current = current->next) {
+            /* flip the bits to sort size and mtime descending and still keep ties in server order */
+            items[i].key = key == sort_inode ? entry_key(current, key) : ~entry_key(current, key);
+            items[i++].entry = current;
+        }
+
+        sorted = radix_sort(items, sorted, count);
+
+        for (i = 0; i < count; i++) {
+            entries[i] = sorted[i].entry;
+        }
+    }
+
+    /* link the list back together in the new order */
+    current = &dummy;
+    for (i = 0; i < count; i++) {
+        current->next = entries[reverse ? count - i - 1 : i];
+        current = current->next;
+    }
+    current->next = NULL;
+
+    return dummy.next;
+}
@@ -0,0 +1,24 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include "nfsping.h"
+#include "arena.h"
+
+enum sort_keys {
+    sort_none,
+    sort_name,
+    sort_size,
+    sort_mtime,
+    sort_inode,
+};
+
+/* a numeric sort key and the entry it came from */
+struct sort_item {
+    uint64_t key;
+    entrypluslink3 *entry;
+};
+
+enum sort_keys sort_key(const char *);
+entrypluslink3 *sort_entries(entrypluslink3 *, enum sort_keys, int, unsigned int, struct arena *);
+
+#endif /* SORT_H */
@@ -0,0 +1,207 @@
+/*
+ * Live statistics in shared memory
+ *
+ * nfsping publishes the counters for each target in a file under /dev/shm so other programs can read them while
+ * it's running without parsing its output. The probe loop only writes to memory, there aren't any system calls
+ * and it never waits for a reader. See stats.h for how a reader should take a consistent copy.
+ */
+
+#include "stats.h"
+#include "util.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+/* local prototypes */
+static void stats_begin(volatile uint32_t *);
+static void stats_end(volatile uint32_t *);
+static void stats_resize(struct stats *, uint32_t);
+
+
+/* make a sequence counter odd before changing what it protects */
+static void stats_begin(volatile uint32_t *seq) {
+    (*seq)++;
+    __sync_synchronize();
+}
+
+
+/* and even again afterwards */
+static void stats_end(volatile uint32_t *seq) {
+    __sync_synchronize();
+    (*seq)++;
+}
+
+
+/* the histogram bucket for a response time */
+unsigned int stats_bucket(unsigned long us) {
+    unsigned int bucket = 0;
+
+    while (us && bucket < STATS_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    return bucket;
+}
+
+
+/* create a segment in /dev/shm, replacing any old one with the same name */
+/* the protocol name is only for readers to display */
+/* prints an error and exits if it can't be made */
+struct stats *stats_open(const char *segment, const char *protocol) {
+    struct stats *stats = calloc(1, sizeof(struct stats));
+
+    if (stats == NULL) {
+        fatalx(3, "Couldn't allocate memory for stats!\n");
+    }
+
+    /* shm_open() wants a leading slash */
+    stats->name = malloc(strlen(segment) + 2);
+    if (stats->name == NULL) {
+        fatalx(3, "Couldn't allocate memory for stats!\n");
+    }
+    sprintf(stats->name, "%s%s", segment[0] == '/' ? "" : "/", segment);
+
+    stats->fd = shm_open(stats->name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (stats->fd == -1) {
+        fatalx(3, "%s: %s\n", stats->name, strerror(errno));
+    }
+
+    stats_resize(stats, 0);
+
+    memcpy(stats->header->magic, STATS_MAGIC, sizeof(STATS_MAGIC));
+    stats->header->version = STATS_VERSION;
+    stats->header->record_size = sizeof(struct stats_target);
+    stats->header->buckets = STATS_BUCKETS;
+    stats->header->pid = getpid();
+    strncpy(stats->header->protocol, protocol, sizeof(stats->header->protocol) - 1);
+
+    return stats;
+}
+
+
+/* make the segment big enough for a number of records, and map it again if it changed */
+static void stats_resize(struct stats *stats, uint32_t capacity) {
+    size_t size = sizeof(struct stats_header) + capacity * sizeof(struct stats_target);
+
+    if (stats->header && size <= stats->size) {
+        return;
+    }
+
+    if (ftruncate(stats->fd, size) == -1) {
+        fatalx(3, "%s: %s\n", stats->name, strerror(errno));
+    }
+
+    if (stats->header) {
+        stats->header = mremap(stats->header, stats->size, size, MREMAP_MAYMOVE);
+    } else {
+        stats->header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, stats->fd, 0);
+    }
+
+    if (stats->header == MAP_FAILED) {
+        fatalx(3, "%s: %s\n", stats->name, strerror(errno));
+    }
+
+    stats->size = size;
+    stats->targets = (struct stats_target *)(stats->header + 1);
+    stats->header->capacity = capacity;
+}
+
+
+/* give each target in the list a record, in the same order */
+/* targets that already had a record keep their counters, it's called again whenever the list changes */
+void stats_targets(struct stats *stats, targets_t *targets) {
+    struct stats_target *saved;
+    targets_t *target;
+    uint32_t count = 0;
+    uint32_t i;
+
+    for (target = targets; target; target = target->next) {
+        count++;
+    }
+
+    /* copy the existing records first since they'll move around */
+    saved = calloc(count ? count : 1, sizeof(struct stats_target));
+    if (saved == NULL) {
+        fatalx(3, "Couldn't allocate memory for stats!\n");
+    }
+    for (target = targets, i = 0; target; target = target->next, i++) {
+        if (target->stats) {
+            saved[i] = *target->stats;
+        }
+    }
+
+    stats_begin(&stats->header->seq);
+
+    stats_resize(stats, count);
+
+    for (target = targets, i = 0; target; target = target->next, i++) {
+        target->stats = &stats->targets[i];
+        *target->stats = saved[i];
+
+        /* start at an even number so readers don't wait */
+        target->stats->seq &= ~1;
+        strncpy(target->stats->name, target->display_name, STATS_NAME - 1);
+        target->stats->name[STATS_NAME - 1] = '\0';
+        strncpy(target->stats->ip_address, target->ip_address, INET_ADDRSTRLEN);
+    }
+
+    stats->header->count = count;
+
+    stats_end(&stats->header->seq);
+
+    free(saved);
+}
+
+
+/* count a request, and its response time if it got one */
+void stats_update(struct stats_target *record, int received, int timeout, unsigned long us) {
+    stats_begin(&record->seq);
+
+    record->sent++;
+
+    if (received) {
+        record->received++;
+        record->last = us;
+        record->buckets[stats_bucket(us)]++;
+    } else if (timeout) {
+        record->timeouts++;
+    }
+
+    stats_end(&record->seq);
+}
+
+
+/* clear the histogram at the end of an interval */
+void stats_reset(struct stats_target *record) {
+    stats_begin(&record->seq);
+    memset(record->buckets, 0, sizeof(record->buckets));
+    stats_end(&record->seq);
+}
+
+
+/* take a consistent copy of a record from another process, trying again while the writer is changing it */
+void stats_snapshot(const struct stats_target *record, struct stats_target *copy) {
+    uint32_t seq;
+
+    do {
+        seq = record->seq;
+        __sync_synchronize();
+        memcpy(copy, (const void *)record, sizeof(struct stats_target));
+        __sync_synchronize();
+    } while ((seq & 1) || seq != record->seq);
+}
+
+
+/* unmap and remove the segment, returns NULL */
+struct stats *stats_close(struct stats *stats) {
+    if (stats) {
+        munmap(stats->header, stats->size);
+        close(stats->fd);
+        shm_unlink(stats->name);
+        free(stats->name);
+        free(stats);
+    }
+
+    return NULL;
+}
@@ -0,0 +1,70 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include "nfsping.h"
+
+#define STATS_MAGIC "NFSSTAT"
+#define STATS_VERSION 1
+/* bucket 0 counts responses under 1us, bucket n counts responses from 2^(n-1) up to 2^n us */
+/* the last bucket also counts anything slower */
+#define STATS_BUCKETS 32
+/* longer names are truncated */
+#define STATS_NAME 256
+
+/*
+ * The segment is a header followed by an array of fixed size records, one per target. The header and each record
+ * are protected by their own sequence counter. The writer makes the counter odd before changing anything and even
+ * again afterwards, so it never waits for a reader. A reader copies the header or a record and tries again if the
+ * counter was odd or changed while it was copying.
+ *
+ * The header's counter changes when the target list changes. Records can move and the segment can grow then, so a
+ * reader should check that the header's counter is the same after copying the records, and map the file again if
+ * the capacity is bigger than its mapping.
+ */
+struct stats_header {
+    char magic[8];
+    uint32_t version;
+    /* sizeof(struct stats_target), so a reader can check it agrees about the layout */
+    uint32_t record_size;
+    uint32_t buckets;
+    volatile uint32_t seq;
+    /* records in use */
+    uint32_t count;
+    /* records the segment has room for */
+    uint32_t capacity;
+    /* the writer's process ID */
+    uint32_t pid;
+    char protocol[16];
+};
+
+struct stats_target {
+    volatile uint32_t seq;
+    char name[STATS_NAME];
+    char ip_address[INET_ADDRSTRLEN];
+    uint64_t sent;
+    uint64_t received;
+    uint64_t timeouts;
+    /* the most recent response time in us */
+    uint64_t last;
+    /* response times since the last interval summary (-Q) */
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+/* a segment being written */
+struct stats {
+    char *name;
+    int fd;
+    struct stats_header *header;
+    struct stats_target *targets;
+    size_t size;
+};
+
+struct stats *stats_open(const char *, const char *);
+void stats_targets(struct stats *, targets_t *);
+void stats_update(struct stats_target *, int, int, unsigned long);
+void stats_reset(struct stats_target *);
+void stats_snapshot(const struct stats_target *, struct stats_target *);
+unsigned int stats_bucket(unsigned long);
+struct stats *stats_close(struct stats *);
+
+#endif /* STATS_H */
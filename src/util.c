@@ -4,6 +4,7 @@
 
 /* globals */
 volatile sig_atomic_t quitting = 0;
+extern int verbose;
 
 
 /* handle control-c */
@@ -113,19 +114,108 @@ int nfs_perror(nfsstat3 status, const char *s) {
 }
 
 
+/* hex digit values plus one, so zero marks a character that isn't a hex digit */
+static const unsigned char hex_values[256] = {
+    ['0'] = 1, ['1'] = 2, ['2'] = 3, ['3'] = 4, ['4'] = 5, ['5'] = 6, ['6'] = 7, ['7'] = 8, ['8'] = 9, ['9'] = 10,
+    ['a'] = 11, ['b'] = 12, ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16,
+    ['A'] = 11, ['B'] = 12, ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+
+/* convert len characters of hex into len / 2 bytes */
+/* returns the number of bytes, or -1 if the length is odd or there's a character that isn't a hex digit */
+int hex_to_bytes(const char *hex, size_t len, char *out) {
+    const unsigned char *in = (const unsigned char *)hex;
+    unsigned char high, low;
+    size_t i;
+
+    if (len % 2) {
+        return -1;
+    }
+
+    for (i = 0; i < len / 2; i++) {
+        high = hex_values[in[i * 2]];
+        low  = hex_values[in[i * 2 + 1]];
+
+        if (high == 0 || low == 0) {
+            return -1;
+        }
+
+        out[i] = ((high - 1) << 4) | (low - 1);
+    }
+
+    return len / 2;
+}
+
+
+/* check the fields of a filehandle and add it to its target, making a new target for a new IP address */
+/* last is the target of the previous filehandle, if this is from the same server the list doesn't need to be searched */
+/* the strings have to be NUL terminated except for the hex filehandle */
+static targets_t *add_fh(targets_t *head, targets_t *last, const char *ip, const char *host, const char *path, const char *hex, size_t hex_len, uint16_t port, struct timeval timeout, unsigned long count) {
+    targets_t *current;
+    struct nfs_fh_list *fh;
+    struct sockaddr_in sock;
+    char fh_val[FHSIZE3];
+    int fh_len;
+
+    /* convert the IP string back into a network address */
+    if (inet_pton(AF_INET, ip, &sock.sin_addr) != 1) {
+        fprintf(stderr, "Invalid IP address: %s\n", ip);
+        return NULL;
+    }
+
+    if (strlen(path) >= MNTPATHLEN) {
+        fprintf(stderr, "Path too long: %s\n", path);
+        return NULL;
+    }
+
+    /* hex takes two characters for each byte */
+    if (hex_len == 0 || hex_len > FHSIZE3 * 2 || (fh_len = hex_to_bytes(hex, hex_len, fh_val)) < 0) {
+        fprintf(stderr, "Invalid filehandle: %.*s\n", (int)hex_len, hex);
+        return NULL;
+    }
+
+    /* see if there's already a target for this IP, or make a new one */
+    if (last && last->client_sock->sin_addr.s_addr == sock.sin_addr.s_addr) {
+        current = last;
+    } else {
+        current = find_or_make_target(head, &sock, port, timeout, count);
+    }
+
+    /* don't do any DNS resolution, so the hostname is used for display only */
+    /* TODO compare it to the IP address from JSON input and error if they don't match? */
+    if (strcmp(current->name, host) != 0) {
+        strncpy(current->name, host, NI_MAXHOST - 1);
+
+        /* default to using the hostname */
+        current->display_name = current->name;
+
+        /* reverse the hostname */
+        current->ndqf = reverse_fqdn(current->name);
+    }
+
+    /* allocate a new filehandle struct */
+    fh = nfs_fh_list_new(current, count);
+
+    /* path is just used for display */
+    strcpy(fh->path, path);
+
+    fh->nfs_fh.data.data_len = fh_len;
+    fh->nfs_fh.data.data_val = malloc(fh_len);
+    memcpy(fh->nfs_fh.data.data_val, fh_val, fh_len);
+
+    return current;
+}
+
+
 /* break up a JSON filehandle into parts */
 /* this uses parson */
 /* port should be in host byte order (ie 2049) */
 targets_t *parse_fh(targets_t *head, char *input, uint16_t port, struct timeval timeout, unsigned long count) {
-    unsigned int i;
-    const char *tmp;
-    u_int fh_len = 0;
+    const char *ip, *host, *path, *hex;
     JSON_Value  *root_value;
     JSON_Object *filehandle;
-    targets_t *current = NULL;
     targets_t *retval = NULL; /* return this */
-    struct nfs_fh_list *fh;
-    struct sockaddr_in sock;
 
     /* sanity check */
     if (strlen(input) == 0) {
@@ -134,96 +224,309 @@ targets_t *parse_fh(targets_t *head, char *input, uint16_t port, struct timeval
     }
 
     root_value = json_parse_string(input);
-    /* TODO if root isn't object, bail */
+    /* returns NULL if root isn't an object */
     filehandle = json_value_get_object(root_value);
 
-    /* first find the IP address so we can find or create a new target */
-    tmp = json_object_get_string(filehandle, "ip");
+    ip   = json_object_get_string(filehandle, "ip");
+    host = json_object_get_string(filehandle, "host");
+    path = json_object_get_string(filehandle, "path");
+    hex  = json_object_get_string(filehandle, "filehandle");
 
-    if (tmp) {
-        /* convert the IP string back into a network address */
-        if (inet_pton(AF_INET, tmp, &sock.sin_addr)) {
-            /* see if there's already a target for this IP, or make a new one */
-            current = find_or_make_target(head, &sock, port, timeout, count);
-
-            /* TODO reverse DNS lookup? */
+    if (ip == NULL) {
+        fprintf(stderr, "No ip found!\n");
+    } else if (host == NULL) {
+        /* TODO if there isn't a hostname, try and resolve it from the IP? */
+        fprintf(stderr, "No host found!\n");
+    } else if (path == NULL) {
+        fprintf(stderr, "No path found!\n");
+    } else if (hex == NULL) {
+        fprintf(stderr, "No filehandle found!\n");
+    } else {
+        retval = add_fh(head, NULL, ip, host, path, hex, strlen(hex), port, timeout, count);
+    }
 
-            /* then find the hostname */
-            /* don't do any DNS resolution, so the hostname is used for display only */
-            tmp = json_object_get_string(filehandle, "host");
+    json_value_free(root_value);
 
-            /* TODO if there isn't a hostname, try and resolve it from the IP? */
-            /* TODO compare it to the IP address from JSON input and error if they don't match? */
+    return retval;
+}
 
-            if (tmp) {
-                /* TODO check length against NI_MAXHOST */
-                strncpy(current->name, tmp, NI_MAXHOST);
 
-                /* default to using the hostname */
-                current->display_name = current->name;
+/* a string value in a line of JSON input, pointing into the input buffer */
+struct json_span {
+    char *start;
+    size_t len;
+    /* has backslash escapes */
+    int escaped;
+    /* has \u escapes which aren't handled here */
+    int unicode;
+};
+
+/* the fields that make up a filehandle in the output of nfsmount, nfsls etc */
+struct fh_fields {
+    struct json_span ip;
+    struct json_span host;
+    struct json_span path;
+    struct json_span filehandle;
+};
+
+
+static char *skip_space(char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) {
+        p++;
+    }
 
-                /* reverse the hostname */
-                current->ndqf = reverse_fqdn(current->name);
+    return p;
+}
 
-                /* path is just used for display */
-                tmp = json_object_get_string(filehandle, "path");
 
-                if (tmp) {
-                    /* allocate a new filehandle struct */
-                    fh = nfs_fh_list_new(current, count);
+/* find the end of a JSON string, p points after the opening quote and is left after the closing quote */
+/* returns -1 if the string isn't terminated */
+static int scan_string(char **p, const char *end, struct json_span *span) {
+    char *c = *p;
 
-                    /* TODO check length aginst MNTPATHLEN */
-                    strncpy(fh->path, tmp, MNTPATHLEN);
+    span->start = c;
+    span->escaped = 0;
+    span->unicode = 0;
 
-                    /* the root filehandle in hex */
-                    tmp = json_object_get_string(filehandle, "filehandle");
+    while (c < end && *c != '"') {
+        if (*c == '\\') {
+            span->escaped = 1;
+            if (c + 1 < end && c[1] == 'u') {
+                span->unicode = 1;
+            }
+            /* skip the escaped character */
+            c++;
+        }
+        c++;
+    }
 
-                    if (tmp) {
-                        /* TODO break this out into a function string_to_nfs_fh3() */
+    if (c >= end) {
+        return -1;
+    }
 
-                        /* hex takes two characters for each byte */
-                        fh_len = strlen(tmp) / 2;
+    span->len = c - span->start;
+    *p = c + 1;
 
-                        /* check that it's an even number */
-                        if (fh_len && fh_len <= FHSIZE3 && (strlen(tmp) % 2 == 0)) {
-                            fh->nfs_fh.data.data_len = fh_len;
-                            fh->nfs_fh.data.data_val = malloc(fh_len);
+    return 0;
+}
 
-                            /* convert from the hex string to a byte array */
-                            for (i = 0; i <= fh->nfs_fh.data.data_len; i++) {
-                                sscanf(&tmp[i * 2], "%2hhx", &fh->nfs_fh.data.data_val[i]);
-                            }
 
-                            /* set the return value */
-                            retval = current;
-                        } else {
-                            fprintf(stderr, "Invalid filehandle: %s\n", tmp);
-                        }
-                    } else {
-                        fprintf(stderr, "No filehandle found!\n");
-                    }
-                } else {
-                    fprintf(stderr, "No path found!\n");
+/* remove backslash escapes and NUL terminate a string in place, the result is never longer than the input */
+static void unescape_span(struct json_span *span) {
+    char *in = span->start;
+    char *out = span->start;
+    char *end = span->start + span->len;
+
+    if (span->escaped) {
+        while (in < end) {
+            if (*in == '\\') {
+                in++;
+                switch (*in) {
+                    case 'b': *out = '\b'; break;
+                    case 'f': *out = '\f'; break;
+                    case 'n': *out = '\n'; break;
+                    case 'r': *out = '\r'; break;
+                    case 't': *out = '\t'; break;
+                    /* \" \\ and the \/ that parson puts in every path */
+                    default: *out = *in; break;
                 }
             } else {
-                /* TODO reverse DNS lookup? */
-                fprintf(stderr, "No host found!\n");
+                *out = *in;
+            }
+            in++;
+            out++;
+        }
+        span->len = out - span->start;
+    }
+
+    /* this overwrites the closing quote */
+    span->start[span->len] = '\0';
+}
+
+
+/* pick the fields out of a single line JSON object without building a parson tree */
+/* only handles flat objects with the filehandle fields as plain strings, returns -1 for anything else */
+static int scan_fh_fields(char *line, const char *end, struct fh_fields *fields) {
+    char *p;
+    struct json_span key, value;
+    struct json_span *field;
+
+    memset(fields, 0, sizeof(struct fh_fields));
+
+    p = skip_space(line, end);
+    if (p == end || *p != '{') {
+        return -1;
+    }
+    p++;
+
+    for (;;) {
+        p = skip_space(p, end);
+        if (p == end || *p != '"') {
+            return -1;
+        }
+        p++;
+        if (scan_string(&p, end, &key)) {
+            return -1;
+        }
+
+        p = skip_space(p, end);
+        if (p == end || *p != ':') {
+            return -1;
+        }
+        p = skip_space(p + 1, end);
+        if (p == end) {
+            return -1;
+        }
+
+        field = NULL;
+        if (key.escaped == 0) {
+            if (key.len == 2 && memcmp(key.start, "ip", 2) == 0) {
+                field = &fields->ip;
+            } else if (key.len == 4 && memcmp(key.start, "host", 4) == 0) {
+                field = &fields->host;
+            } else if (key.len == 4 && memcmp(key.start, "path", 4) == 0) {
+                field = &fields->path;
+            } else if (key.len == 10 && memcmp(key.start, "filehandle", 10) == 0) {
+                field = &fields->filehandle;
+            }
+        }
+
+        if (*p == '"') {
+            p++;
+            if (scan_string(&p, end, &value) || (field && value.unicode)) {
+                return -1;
+            }
+            if (field) {
+                *field = value;
             }
+        } else if (field || *p == '{' || *p == '[') {
+            /* leave anything unexpected to parson */
+            return -1;
         } else {
-            fprintf(stderr, "Invalid IP address: %s\n", tmp);
+            /* numbers, true, false and null */
+            while (p < end && *p != ',' && *p != '}' && *p != ' ') {
+                p++;
+            }
+        }
+
+        p = skip_space(p, end);
+        if (p < end && *p == ',') {
+            p++;
+        } else if (p < end && *p == '}') {
+            break;
+        } else {
+            return -1;
         }
-    } else {
-        fprintf(stderr, "No ip found!\n");
     }
 
-    /* cleanup if we allocated a result but failed to set a return value */
-    if (retval == NULL && current) {
-        /* TODO need a free_target() function! */
-        if (current->client_sock) free(current->client_sock);
-        free(current);
+    /* nothing else on the line */
+    if (skip_space(p + 1, end) != end) {
+        return -1;
     }
 
-    return retval;
+    if (fields->ip.start == NULL || fields->host.start == NULL || fields->path.start == NULL || fields->filehandle.start == NULL) {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+/* read JSON filehandles one per line from a stream until EOF, the same as calling parse_fh() on each line */
+/* the input is read in large blocks and the usual fields are picked out directly, lines in any other form are passed to parson */
+/* returns the number of filehandles added */
+unsigned long read_fhs(FILE *in, targets_t *head, uint16_t port, struct timeval timeout, unsigned long count) {
+    size_t size = FH_INPUT_BLOCK;
+    char *buf = malloc(size);
+    /* bytes in the buffer */
+    size_t used = 0;
+    size_t bytes;
+    char *line, *newline, *end;
+    struct fh_fields fields;
+    targets_t *last = NULL;
+    targets_t *current;
+    unsigned long lines = 0, added = 0;
+    int eof = 0;
+    struct timespec start, finish, elapsed;
+    double seconds;
+
+    if (buf == NULL) {
+        fatalx(3, "Couldn't allocate memory for input!\n");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (eof == 0) {
+        /* leave room to terminate the last line */
+        bytes = fread(buf + used, 1, size - used - 1, in);
+        if (bytes == 0) {
+            eof = 1;
+        }
+        used += bytes;
+
+        line = buf;
+        end = buf + used;
+
+        while (line < end) {
+            newline = memchr(line, '\n', end - line);
+
+            if (newline == NULL) {
+                /* the last line might not have a newline */
+                if (eof) {
+                    newline = end;
+                } else {
+                    break;
+                }
+            }
+
+            lines++;
+            *newline = '\0';
+
+            current = NULL;
+            if (scan_fh_fields(line, newline, &fields) == 0) {
+                unescape_span(&fields.ip);
+                unescape_span(&fields.host);
+                unescape_span(&fields.path);
+                current = add_fh(head, last, fields.ip.start, fields.host.start, fields.path.start,
+                    fields.filehandle.start, fields.filehandle.len, port, timeout, count);
+            } else if (skip_space(line, newline) != newline) {
+                current = parse_fh(head, line, port, timeout, count);
+            }
+
+            if (current) {
+                last = current;
+                added++;
+            }
+
+            line = newline + 1;
+        }
+
+        /* move a partial line to the start of the buffer */
+        if (line < end) {
+            used = end - line;
+            memmove(buf, line, used);
+
+            /* a line longer than the buffer */
+            if (used == size - 1) {
+                size *= 2;
+                buf = realloc(buf, size);
+                if (buf == NULL) {
+                    fatalx(3, "Couldn't allocate memory for input!\n");
+                }
+            }
+        } else {
+            used = 0;
+        }
+    }
+
+    free(buf);
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    timespecsub(&finish, &start, &elapsed);
+    seconds = elapsed.tv_sec + elapsed.tv_nsec / 1e9;
+    debug("Read %lu filehandles from %lu lines in %.3fs (%.0f lines/s)\n", added, lines, seconds, seconds > 0 ? lines / seconds : 0);
+
+    return added;
 }
 
 
@@ -507,8 +810,8 @@ targets_t *append_target(targets_t **head, targets_t *new_target) {
 /* create a new empty filehandle struct at the end of the current filehandle list in a target */
 /* return a pointer to the newly added filehandle */
 nfs_fh_list *nfs_fh_list_new(targets_t *target, unsigned long count) {
-    /* head of the list */
-    nfs_fh_list *current = target->filehandles;
+    /* start from the end of the list if we know it */
+    nfs_fh_list *current = target->last_fh ? target->last_fh : target->filehandles;
     nfs_fh_list *new_fh = calloc(1, sizeof(struct nfs_fh_list));
 
     /* set this so that the first comparison will always be smaller */
@@ -522,7 +825,7 @@ nfs_fh_list *nfs_fh_list_new(targets_t *target, unsigned long count) {
     }
    
     if (current) {
-        /* find the last fh in the list */
+        /* find the last fh in the list, last_fh is behind if filehandles were added some other way */
         while (current->next) {
             current = current->next;
         }
@@ -532,6 +835,8 @@ nfs_fh_list *nfs_fh_list_new(targets_t *target, unsigned long count) {
         target->filehandles = new_fh;
     }
 
+    target->last_fh = new_fh;
+
     return new_fh;
 }
 
@@ -600,6 +905,33 @@ targets_t *find_or_make_target(targets_t *head, struct sockaddr_in *ip_address,
 }
 
 
+/* free a target and everything it owns, including its RPC client */
+/* the filehandles, exports and connection pool aren't freed, only nfsping removes targets */
+/* returns the next target in the list */
+targets_t *free_target(targets_t *target) {
+    targets_t *next = target->next;
+
+    if (target->client) {
+        auth_destroy(target->client->cl_auth);
+        clnt_destroy(target->client);
+    }
+
+    /* ndqf can point at one of the other names */
+    if (target->ndqf != target->name && target->ndqf != target->ip_address) {
+        free(target->ndqf);
+    }
+
+    free(target->client_sock);
+    free(target->results);
+    /* the histograms are a single allocation */
+    free(target->histogram);
+    free(target->interval_histogram);
+    free(target);
+
+    return next;
+}
+
+
 /* convert a timeval to microseconds */
 unsigned long tv2us(struct timeval tv) {
     return tv.tv_sec * 1000000 + tv.tv_usec;
@@ -4,9 +4,14 @@
 #include "nfsping.h"
 #include "parson/parson.h"
 
+/* size of the blocks read from stdin by read_fhs(), grows for longer lines */
+#define FH_INPUT_BLOCK (1024 * 1024)
+
 void sigint_handler(int);
 int nfs_perror(nfsstat3, const char *);
 targets_t *parse_fh(targets_t *, char *, uint16_t, struct timeval, unsigned long);
+unsigned long read_fhs(FILE *, targets_t *, uint16_t, struct timeval, unsigned long);
+int hex_to_bytes(const char *, size_t, char *);
 char *nfs_fh3_to_string(nfs_fh3);
 char* reverse_fqdn(char *);
 struct mount_exports *init_export(struct targets *, char *, unsigned long);
@@ -17,6 +22,7 @@ targets_t *append_target(targets_t **, targets_t *);
 nfs_fh_list *nfs_fh_list_new(targets_t *, unsigned long);
 targets_t *find_target_by_ip(targets_t *, struct sockaddr_in *);
 targets_t *find_or_make_target(targets_t *, struct sockaddr_in *, uint16_t, struct timeval, unsigned long);
+targets_t *free_target(targets_t *);
 unsigned long tv2us(struct timeval);
 unsigned long tv2ms(struct timeval);
 void ms2tv(struct timeval *, unsigned long);
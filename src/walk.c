@@ -0,0 +1,476 @@
+/*
+ * Recursively walk directory trees with a pool of threads
+ *
+ * Each directory is a task. Listing a directory with READDIRPLUS gives us the filehandles of its subdirectories
+ * which are queued as new tasks straight away, so the number of directories being listed at once is only limited
+ * by the number of threads and the size of each server's connection pool, not by a single chain of round trips.
+ *
+ * Each thread works through its own queue depth first and steals from the other end of another thread's queue when
+ * it runs out, which tends to steal directories near the top of the tree with the most work under them.
+ */
+
+#include "walk.h"
+#include "rpc.h"
+#include "util.h"
+
+/* globals */
+extern volatile sig_atomic_t quitting;
+extern int verbose;
+
+/* each thread's index into the array of queues */
+struct walk_thread {
+    pthread_t thread;
+    struct walk *walk;
+    unsigned int index;
+};
+
+/* local prototypes */
+static struct walk_task *walk_task_new(targets_t *, nfs_fh3 *, const char *, const char *, unsigned int);
+static void walk_task_free(struct walk_task *);
+static void walk_push(struct walk *, unsigned int, struct walk_task *);
+static struct walk_task *walk_pop(struct walk_deque *);
+static struct walk_task *walk_steal(struct walk_deque *);
+static struct walk_task *walk_next(struct walk *, unsigned int);
+static int walk_queued(struct walk *);
+static void walk_list(struct walk *, unsigned int, struct walk_task *);
+static void *walk_worker(void *);
+
+
+/* make a new task for a directory */
+/* the path is the parent's path plus the child directory's name (if any) with a trailing slash */
+struct walk_task *walk_task_new(targets_t *target, nfs_fh3 *fh, const char *path, const char *child, unsigned int depth) {
+    struct walk_task *task = calloc(1, sizeof(struct walk_task));
+    size_t path_len = strlen(path);
+    size_t name_len = child ? strlen(child) : 0;
+
+    if (task == NULL) {
+        return NULL;
+    }
+
+    task->target = target;
+    task->depth = depth;
+
+    task->fh.data.data_len = fh->data.data_len;
+    task->fh.data.data_val = malloc(fh->data.data_len);
+    if (task->fh.data.data_val == NULL) {
+        walk_task_free(task);
+        return NULL;
+    }
+    memcpy(task->fh.data.data_val, fh->data.data_val, fh->data.data_len);
+
+    /* room for a separator, a trailing slash and the NUL */
+    task->path = malloc(path_len + name_len + 3);
+    if (task->path == NULL) {
+        walk_task_free(task);
+        return NULL;
+    }
+    memcpy(task->path, path, path_len);
+    if (path_len == 0 || path[path_len - 1] != '/') {
+        task->path[path_len++] = '/';
+    }
+    if (name_len) {
+        memcpy(task->path + path_len, child, name_len);
+        path_len += name_len;
+        task->path[path_len++] = '/';
+    }
+    task->path[path_len] = '\0';
+
+    return task;
+}
+
+
+void walk_task_free(struct walk_task *task) {
+    free(task->fh.data.data_val);
+    free(task->path);
+    free(task);
+}
+
+
+/* add a task to the tail of a thread's queue and wake up an idle thread to steal it */
+void walk_push(struct walk *walk, unsigned int index, struct walk_task *task) {
+    struct walk_deque *deque = &walk->deques[index];
+    struct walk_task **tasks;
+    size_t i;
+
+    /* count it before anyone can see it so the walk can't finish while it's queued */
+    __sync_fetch_and_add(&walk->pending, 1);
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count == deque->size) {
+        /* double the size and unwrap the circular buffer */
+        tasks = malloc((deque->size ? deque->size * 2 : 64) * sizeof(struct walk_task *));
+        if (tasks == NULL) {
+            fatalx(3, "Couldn't allocate memory for directory queue!\n");
+        }
+        for (i = 0; i < deque->count; i++) {
+            tasks[i] = deque->tasks[(deque->head + i) % deque->size];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->head = 0;
+        deque->size = deque->size ? deque->size * 2 : 64;
+    }
+
+    deque->tasks[(deque->head + deque->count) % deque->size] = task;
+    deque->count++;
+
+    pthread_mutex_unlock(&deque->lock);
+
+    /* the idle threads check the queues again with idle_lock held before sleeping, so they can't miss this */
+    if (__sync_fetch_and_add(&walk->sleeping, 0)) {
+        pthread_mutex_lock(&walk->idle_lock);
+        pthread_cond_signal(&walk->idle);
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+}
+
+
+/* the owning thread takes the newest task */
+struct walk_task *walk_pop(struct walk_deque *deque) {
+    struct walk_task *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count) {
+        deque->count--;
+        task = deque->tasks[(deque->head + deque->count) % deque->size];
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
+
+
+/* other threads take the oldest task */
+struct walk_task *walk_steal(struct walk_deque *deque) {
+    struct walk_task *task = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->count) {
+        task = deque->tasks[deque->head];
+        deque->head = (deque->head + 1) % deque->size;
+        deque->count--;
+    }
+
+    pthread_mutex_unlock(&deque->lock);
+
+    return task;
+}
+
+
+/* find something to do, first from our own queue then from the others */
+struct walk_task *walk_next(struct walk *walk, unsigned int index) {
+    struct walk_task *task;
+    unsigned int i;
+
+    task = walk_pop(&walk->deques[index]);
+
+    for (i = 1; task == NULL && i < walk->threads; i++) {
+        task = walk_steal(&walk->deques[(index + i) % walk->threads]);
+
+        if (task) {
+            __sync_fetch_and_add(&walk->steals, 1);
+        }
+    }
+
+    return task;
+}
+
+
+/* returns 1 if any of the queues have tasks */
+int walk_queued(struct walk *walk) {
+    struct walk_deque *deque;
+    unsigned int i;
+    int queued = 0;
+
+    for (i = 0; i < walk->threads && queued == 0; i++) {
+        deque = &walk->deques[i];
+        pthread_mutex_lock(&deque->lock);
+        queued = deque->count > 0;
+        pthread_mutex_unlock(&deque->lock);
+    }
+
+    return queued;
+}
+
+
+/* list a directory with READDIRPLUS and queue its subdirectories */
+void walk_list(struct walk *walk, unsigned int index, struct walk_task *task) {
+    CLIENT *client;
+    READDIRPLUS3res res;
+    READDIRPLUS3args args = {
+        .dir = task->fh,
+        .cookie = 0,
+        .cookieverf = { 0 },
+        .dircount = walk->dircount,
+        .maxcount = walk->maxcount,
+    };
+    entryplus3 *res_entry;
+    struct walk_task *child;
+    enum clnt_stat status;
+    const char *proc = "nfsproc3_readdirplus_3";
+    struct timespec call_start, call_end, call_elapsed;
+    unsigned long entries = 0;
+    int eof = 0;
+    int broken = 0;
+
+    client = rpc_pool_get(task->target->pool);
+
+    if (client == NULL) {
+        __sync_fetch_and_add(&walk->errors, 1);
+        return;
+    }
+
+    while (eof == 0 && quitting == 0) {
+        memset(&res, 0, sizeof(res));
+
+        debug("nfsproc3_readdirplus_3(%s, %llu)\n", task->path, (long long unsigned)args.cookie);
+
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &call_start);
+#endif
+
+        status = clnt_call(client, NFSPROC3_READDIRPLUS,
+            (xdrproc_t) xdr_READDIRPLUS3args, (caddr_t) &args,
+            (xdrproc_t) xdr_READDIRPLUS3res, (caddr_t) &res,
+            walk->timeout);
+
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &call_end);
+#endif
+
+        timespecsub(&call_end, &call_start, &call_elapsed);
+        task->usec = ts2us(call_elapsed);
+
+        if (status != RPC_SUCCESS) {
+            fprintf(stderr, "%s:%s: ", task->target->name, task->path);
+            clnt_perror(client, proc);
+            __sync_fetch_and_add(&walk->errors, 1);
+            /* reconnect next time in case it was a broken TCP connection */
+            broken = 1;
+            break;
+        }
+
+        if (res.status != NFS3_OK) {
+            fprintf(stderr, "%s:%s: ", task->target->name, task->path);
+            nfs_perror(res.status, proc);
+            __sync_fetch_and_add(&walk->errors, 1);
+            xdr_free((xdrproc_t)xdr_READDIRPLUS3res, (char *)&res);
+            break;
+        }
+
+        for (res_entry = res.READDIRPLUS3res_u.resok.reply.entries; res_entry; res_entry = res_entry->nextentry) {
+            /* our position in the directory listing should always increase */
+            if (res_entry->cookie <= args.cookie) {
+                fprintf(stderr, "directory %s:%s contains a readdirplus loop. Offending cookie: %llu\n", task->target->name, task->path, (long long unsigned)res_entry->cookie);
+                res.READDIRPLUS3res_u.resok.reply.eof = 1;
+                break;
+            }
+            args.cookie = res_entry->cookie;
+            entries++;
+
+            /* never go back up the tree */
+            if (strcmp(res_entry->name, ".") == 0 || strcmp(res_entry->name, "..") == 0) {
+                continue;
+            }
+
+            if (walk->entry(walk, task, res_entry, walk->arg) &&
+                res_entry->name_attributes.attributes_follow &&
+                res_entry->name_attributes.post_op_attr_u.attributes.type == NF3DIR &&
+                res_entry->name_handle.handle_follows &&
+                (walk->max_depth == 0 || task->depth + 1 < walk->max_depth)) {
+
+                /* directories can't have hard links, so this is a server bug or the same tree given twice on stdin */
+                if (fileid_set_add(walk->directories, task->target->client_sock->sin_addr.s_addr,
+                    res_entry->name_attributes.post_op_attr_u.attributes.fsid,
+                    res_entry->name_attributes.post_op_attr_u.attributes.fileid) == 0) {
+
+                    fprintf(stderr, "%s:%s%s/: directory already seen (fileid %llu), skipping\n", task->target->name, task->path, res_entry->name,
+                        (unsigned long long)res_entry->name_attributes.post_op_attr_u.attributes.fileid);
+                    continue;
+                }
+
+                child = walk_task_new(task->target, &res_entry->name_handle.post_op_fh3_u.handle, task->path, res_entry->name, task->depth + 1);
+
+                if (child) {
+                    /* queue it right away so idle threads can start on it while we keep reading this directory */
+                    walk_push(walk, index, child);
+                } else {
+                    fprintf(stderr, "%s:%s%s: couldn't allocate memory for directory!\n", task->target->name, task->path, res_entry->name);
+                    __sync_fetch_and_add(&walk->errors, 1);
+                }
+            }
+        }
+
+        eof = res.READDIRPLUS3res_u.resok.reply.eof;
+        memcpy(args.cookieverf, res.READDIRPLUS3res_u.resok.cookieverf, NFS3_COOKIEVERFSIZE);
+
+        xdr_free((xdrproc_t)xdr_READDIRPLUS3res, (char *)&res);
+    }
+
+    rpc_pool_put(task->target->pool, client, broken);
+
+    __sync_fetch_and_add(&walk->dirs, 1);
+    __sync_fetch_and_add(&walk->entries, entries);
+}
+
+
+/* thread that lists directories until there are none left anywhere */
+void *walk_worker(void *arg) {
+    struct walk_thread *thread = arg;
+    struct walk *walk = thread->walk;
+    struct walk_task *task;
+
+    while (1) {
+        task = walk_next(walk, thread->index);
+
+        if (task) {
+            /* after ctrl-c just empty the queues */
+            if (quitting == 0) {
+                walk_list(walk, thread->index, task);
+            }
+
+            walk_task_free(task);
+
+            /* that was the last one, wake everyone up to exit */
+            if (__sync_sub_and_fetch(&walk->pending, 1) == 0) {
+                pthread_mutex_lock(&walk->idle_lock);
+                pthread_cond_broadcast(&walk->idle);
+                pthread_mutex_unlock(&walk->idle_lock);
+            }
+
+            continue;
+        }
+
+        pthread_mutex_lock(&walk->idle_lock);
+
+        if (__sync_fetch_and_add(&walk->pending, 0) == 0) {
+            pthread_mutex_unlock(&walk->idle_lock);
+            break;
+        }
+
+        /* other threads are still listing directories which could add more work */
+        walk->sleeping++;
+        if (walk_queued(walk) == 0) {
+            pthread_cond_wait(&walk->idle, &walk->idle_lock);
+        }
+        walk->sleeping--;
+
+        pthread_mutex_unlock(&walk->idle_lock);
+    }
+
+    return NULL;
+}
+
+
+/* make a new walk with a number of threads */
+/* the callback is called for every directory entry that is found */
+struct walk *walk_new(unsigned int threads, struct timeval timeout, walk_entry_t callback, void *arg) {
+    struct walk *walk = calloc(1, sizeof(struct walk));
+    unsigned int i;
+
+    if (walk == NULL) {
+        return NULL;
+    }
+
+    walk->threads = threads ? threads : 1;
+    walk->deques = calloc(walk->threads, sizeof(struct walk_deque));
+    if (walk->deques == NULL) {
+        free(walk);
+        return NULL;
+    }
+
+    for (i = 0; i < walk->threads; i++) {
+        pthread_mutex_init(&walk->deques[i].lock, NULL);
+    }
+
+    walk->directories = fileid_set_new();
+    if (walk->directories == NULL) {
+        free(walk->deques);
+        free(walk);
+        return NULL;
+    }
+
+    pthread_mutex_init(&walk->idle_lock, NULL);
+    pthread_cond_init(&walk->idle, NULL);
+
+    walk->entry = callback;
+    walk->arg = arg;
+    walk->timeout = timeout;
+    /* TODO make the dircount/maxcount into options */
+    walk->dircount = 1024;
+    walk->maxcount = 8192;
+
+    return walk;
+}
+
+
+/* add a starting directory to the walk, before calling walk_run() */
+/* the target needs a connection pool */
+void walk_add(struct walk *walk, targets_t *target, nfs_fh3 *fh, const char *path) {
+    struct walk_task *task = walk_task_new(target, fh, path, NULL, 0);
+
+    if (task == NULL) {
+        fatalx(3, "Couldn't allocate memory for directory!\n");
+    }
+
+    walk_push(walk, walk->next_deque, task);
+    walk->next_deque = (walk->next_deque + 1) % walk->threads;
+}
+
+
+/* walk all of the directories until there are none left */
+/* returns the number of errors */
+unsigned long walk_run(struct walk *walk) {
+    struct walk_thread *threads;
+    unsigned int i;
+
+    threads = calloc(walk->threads, sizeof(struct walk_thread));
+    if (threads == NULL) {
+        fatalx(3, "Couldn't allocate memory for threads!\n");
+    }
+
+    for (i = 0; i < walk->threads; i++) {
+        threads[i].walk = walk;
+        threads[i].index = i;
+
+        if (pthread_create(&threads[i].thread, NULL, walk_worker, &threads[i]) != 0) {
+            fatalx(3, "Couldn't create thread!\n");
+        }
+    }
+
+    for (i = 0; i < walk->threads; i++) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    free(threads);
+
+    return walk->errors;
+}
+
+
+struct walk *walk_free(struct walk *walk) {
+    unsigned int i;
+
+    if (walk) {
+        for (i = 0; i < walk->threads; i++) {
+            free(walk->deques[i].tasks);
+            pthread_mutex_destroy(&walk->deques[i].lock);
+        }
+
+        free(walk->deques);
+        fileid_set_free(walk->directories);
+        pthread_cond_destroy(&walk->idle);
+        pthread_mutex_destroy(&walk->idle_lock);
+        free(walk);
+    }
+
+    return NULL;
+}
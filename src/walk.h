@@ -0,0 +1,73 @@
+#ifndef WALK_H
+#define WALK_H
+
+#include "nfsping.h"
+#include "fileid.h"
+
+struct walk;
+
+/* a directory waiting to be listed */
+struct walk_task {
+    targets_t *target;
+    /* the directory's filehandle, the data is owned by the task */
+    nfs_fh3 fh;
+    /* path of the directory including a trailing slash */
+    char *path;
+    /* 0 for directories from stdin */
+    unsigned int depth;
+    /* response time of the most recent READDIRPLUS for this directory */
+    unsigned long usec;
+    /* for the entry callback to keep its own state for the directory, starts as NULL */
+    void *data;
+};
+
+/* called from the worker threads for each entry in each READDIRPLUS reply */
+/* the entry is only valid until the callback returns */
+/* return nonzero to descend into a directory */
+typedef int (*walk_entry_t)(struct walk *, struct walk_task *, entryplus3 *, void *);
+
+/* each thread has its own double ended queue of directories */
+/* the owner pushes and pops at the tail so it works depth first, idle threads steal from the head */
+struct walk_deque {
+    pthread_mutex_t lock;
+    struct walk_task **tasks;
+    /* circular buffer */
+    size_t head;
+    size_t count;
+    size_t size;
+};
+
+struct walk {
+    unsigned int threads;
+    struct walk_deque *deques;
+    /* round robin for adding directories from the main thread */
+    unsigned int next_deque;
+    /* directories that are queued or being listed, the walk is finished when this gets to zero */
+    unsigned long pending;
+    /* idle threads sleep until there is more work */
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    unsigned int sleeping;
+    walk_entry_t entry;
+    void *arg;
+    struct timeval timeout;
+    /* maximum depth to descend, 0 = unlimited */
+    unsigned int max_depth;
+    /* directories that have been queued, so a directory that shows up inside itself isn't walked forever */
+    struct fileid_set *directories;
+    /* READDIRPLUS sizes */
+    count3 dircount;
+    count3 maxcount;
+    /* statistics */
+    unsigned long dirs;
+    unsigned long entries;
+    unsigned long errors;
+    unsigned long steals;
+};
+
+struct walk *walk_new(unsigned int, struct timeval, walk_entry_t, void *);
+void walk_add(struct walk *, targets_t *, nfs_fh3 *, const char *);
+unsigned long walk_run(struct walk *);
+struct walk *walk_free(struct walk *);
+
+#endif /* WALK_H */
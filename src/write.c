@@ -0,0 +1,571 @@
+/*
+ * Benchmark writing files on an NFS server
+ */
+
+#include "nfsping.h"
+#include "rpc.h"
+#include "util.h"
+
+/* globals */
+extern volatile sig_atomic_t quitting;
+int verbose = 0;
+
+/* global config "object" */
+static struct config {
+    /* NFS port */
+    uint16_t port;
+    /* NFS version */
+    unsigned long version;
+    /* size of each WRITE in bytes */
+    unsigned long blocksize;
+    /* number of WRITEs to send for each file */
+    unsigned long count;
+    /* send a COMMIT after this many WRITEs, 0 = only at the end */
+    unsigned long commit;
+    /* number of WRITEs outstanding at once (one connection each) */
+    unsigned int parallel;
+    stable_how stable;
+    struct timeval timeout;
+} cfg;
+
+/* default config */
+const struct config CONFIG_DEFAULT = {
+    .port      = NFS_PORT,
+    .version   = 3,
+    .blocksize = 8192,
+    .count     = 1024,
+    .commit    = 0,
+    .parallel  = 4,
+    .stable    = UNSTABLE,
+    .timeout   = NFS_TIMEOUT,
+};
+
+/* shared state for all of the threads writing a single file */
+struct write_job {
+    targets_t *target;
+    nfs_fh_list *fh;
+    /* the data to write, the same buffer is used for every request */
+    char *data;
+    /* index of the next WRITE to send */
+    unsigned long next;
+    /* number of successful WRITEs, used to trigger COMMITs */
+    unsigned long completed;
+    unsigned long long bytes;
+    unsigned long write_errors;
+    unsigned long commit_errors;
+    /* the server should only change its write verifier if it reboots and loses uncommitted data */
+    pthread_mutex_t lock;
+    int verf_set;
+    writeverf3 verf;
+    unsigned long verf_changes;
+};
+
+/* each thread has its own histograms so recording doesn't need locking */
+struct write_worker {
+    pthread_t thread;
+    struct write_job *job;
+    struct hdr_histogram *write_histogram;
+    struct hdr_histogram *commit_histogram;
+};
+
+/* local prototypes */
+static void usage(void);
+static enum clnt_stat do_write(CLIENT *, nfs_fh3 *, offset3, count3, char *, WRITE3res *);
+static enum clnt_stat do_commit(CLIENT *, nfs_fh3 *, COMMIT3res *);
+static void check_verf(struct write_job *, const char *, writeverf3);
+static enum clnt_stat commit_file(CLIENT *, struct write_job *, struct hdr_histogram *);
+static void *write_worker(void *);
+static int write_file(targets_t *, nfs_fh_list *, char *);
+static void print_latency(targets_t *, nfs_fh_list *, const char *, struct hdr_histogram *);
+
+
+void usage() {
+    struct timeval timeout = NFS_TIMEOUT;
+
+    printf("Usage: nfswrite [options]\n\
+Write to NFS files from stdin\n\n\
+    -b n     blocksize (in bytes, default %lu)\n\
+    -c n     count of write requests to send for each file (default %lu)\n\
+    -C n     send a commit after every n writes (default only at end)\n\
+    -d       DATA_SYNC writes (default UNSTABLE)\n\
+    -f       FILE_SYNC writes (default UNSTABLE)\n\
+    -h       display this help and exit\n\
+    -M       use the portmapper (default: %i)\n\
+    -p n     number of outstanding write requests (default %u)\n\
+    -S addr  set source address\n\
+    -t n     timeout (in ms, default %lu)\n\
+    -T       use TCP (default UDP)\n\
+    -v       verbose output\n",
+    CONFIG_DEFAULT.blocksize, CONFIG_DEFAULT.count, NFS_PORT, CONFIG_DEFAULT.parallel, tv2ms(timeout));
+
+    exit(3);
+}
+
+
+/* the NFS WRITE call */
+/* the generated nfsproc3_write_3() returns a static result which isn't thread safe, so call clnt_call() directly */
+/* the caller has to xdr_free() the result */
+enum clnt_stat do_write(CLIENT *client, nfs_fh3 *fh, offset3 offset, count3 count, char *data, WRITE3res *res) {
+    WRITE3args args = {
+        .file   = *fh,
+        .offset = offset,
+        .count  = count,
+        .stable = cfg.stable,
+        .data = {
+            .data_len = count,
+            .data_val = data,
+        },
+    };
+
+    memset(res, 0, sizeof(WRITE3res));
+
+    return clnt_call(client, NFSPROC3_WRITE,
+        (xdrproc_t) xdr_WRITE3args, (caddr_t) &args,
+        (xdrproc_t) xdr_WRITE3res, (caddr_t) res,
+        cfg.timeout);
+}
+
+
+/* the NFS COMMIT call for the whole file */
+/* the caller has to xdr_free() the result */
+enum clnt_stat do_commit(CLIENT *client, nfs_fh3 *fh, COMMIT3res *res) {
+    COMMIT3args args = {
+        .file   = *fh,
+        /* offset 0 and count 0 means the whole file */
+        .offset = 0,
+        .count  = 0,
+    };
+
+    memset(res, 0, sizeof(COMMIT3res));
+
+    return clnt_call(client, NFSPROC3_COMMIT,
+        (xdrproc_t) xdr_COMMIT3args, (caddr_t) &args,
+        (xdrproc_t) xdr_COMMIT3res, (caddr_t) res,
+        cfg.timeout);
+}
+
+
+/* compare a write verifier from a WRITE or COMMIT result with the first one we saw */
+/* if it changes the server has probably rebooted and thrown away uncommitted writes */
+void check_verf(struct write_job *job, const char *proc, writeverf3 verf) {
+    pthread_mutex_lock(&job->lock);
+
+    if (job->verf_set) {
+        if (memcmp(job->verf, verf, NFS3_WRITEVERFSIZE) != 0) {
+            job->verf_changes++;
+            fprintf(stderr, "%s:%s: %s: write verifier changed!\n", job->target->name, job->fh->path, proc);
+            memcpy(job->verf, verf, NFS3_WRITEVERFSIZE);
+        }
+    } else {
+        memcpy(job->verf, verf, NFS3_WRITEVERFSIZE);
+        job->verf_set = 1;
+    }
+
+    pthread_mutex_unlock(&job->lock);
+}
+
+
+/* send a COMMIT and record the response time, failures are counted in the job */
+/* returns the RPC status so the caller can tell a broken connection from an NFS error */
+enum clnt_stat commit_file(CLIENT *client, struct write_job *job, struct hdr_histogram *histogram) {
+    COMMIT3res res;
+    enum clnt_stat status;
+    const char *proc = "nfsproc3_commit_3";
+    struct timespec call_start, call_end, call_elapsed;
+    int failed = 1;
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &call_start);
+#endif
+
+    status = do_commit(client, &job->fh->nfs_fh, &res);
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &call_end);
+#endif
+
+    if (status == RPC_SUCCESS) {
+        if (res.status == NFS3_OK) {
+            timespecsub(&call_end, &call_start, &call_elapsed);
+            hdr_record_value(histogram, ts2us(call_elapsed));
+            check_verf(job, proc, res.COMMIT3res_u.resok.verf);
+            failed = 0;
+        } else {
+            fprintf(stderr, "%s:%s: ", job->target->name, job->fh->path);
+            nfs_perror(res.status, proc);
+        }
+
+        xdr_free((xdrproc_t)xdr_COMMIT3res, (char *)&res);
+    } else {
+        fprintf(stderr, "%s:%s: ", job->target->name, job->fh->path);
+        clnt_perror(client, proc);
+    }
+
+    if (failed) {
+        __sync_fetch_and_add(&job->commit_errors, 1);
+    }
+
+    return status;
+}
+
+
+/* thread that keeps sending WRITEs until the whole file has been written */
+/* all of the threads share the next offset so each one always has a request outstanding */
+void *write_worker(void *arg) {
+    struct write_worker *worker = arg;
+    struct write_job *job = worker->job;
+    CLIENT *client;
+    WRITE3res res;
+    enum clnt_stat status;
+    const char *proc = "nfsproc3_write_3";
+    struct timespec call_start, call_end, call_elapsed;
+    unsigned long index;
+    unsigned long completed;
+
+    client = rpc_pool_get(job->target->pool);
+
+    if (client == NULL) {
+        __sync_fetch_and_add(&job->write_errors, 1);
+        return NULL;
+    }
+
+    while (quitting == 0) {
+        index = __sync_fetch_and_add(&job->next, 1);
+
+        if (index >= cfg.count) {
+            break;
+        }
+
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &call_start);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &call_start);
+#endif
+
+        status = do_write(client, &job->fh->nfs_fh, index * cfg.blocksize, cfg.blocksize, job->data, &res);
+
+#ifdef CLOCK_MONOTONIC_RAW
+        clock_gettime(CLOCK_MONOTONIC_RAW, &call_end);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &call_end);
+#endif
+
+        if (status == RPC_SUCCESS) {
+            if (res.status == NFS3_OK) {
+                timespecsub(&call_end, &call_start, &call_elapsed);
+                hdr_record_value(worker->write_histogram, ts2us(call_elapsed));
+
+                __sync_fetch_and_add(&job->bytes, res.WRITE3res_u.resok.count);
+
+                if (res.WRITE3res_u.resok.count < cfg.blocksize) {
+                    fprintf(stderr, "%s:%s: short write at offset %lu (%lu bytes)\n",
+                        job->target->name, job->fh->path, index * cfg.blocksize, (unsigned long)res.WRITE3res_u.resok.count);
+                }
+
+                check_verf(job, proc, res.WRITE3res_u.resok.verf);
+
+                completed = __sync_add_and_fetch(&job->completed, 1);
+
+                /* periodic COMMIT, this isn't needed if the server has already committed the data */
+                if (cfg.commit && res.WRITE3res_u.resok.committed != FILE_SYNC && completed % cfg.commit == 0) {
+                    commit_file(client, job, worker->commit_histogram);
+                }
+            } else {
+                __sync_fetch_and_add(&job->write_errors, 1);
+                fprintf(stderr, "%s:%s: ", job->target->name, job->fh->path);
+                nfs_perror(res.status, proc);
+            }
+
+            xdr_free((xdrproc_t)xdr_WRITE3res, (char *)&res);
+        } else {
+            __sync_fetch_and_add(&job->write_errors, 1);
+            fprintf(stderr, "%s:%s: ", job->target->name, job->fh->path);
+            clnt_perror(client, proc);
+
+            /* reconnect in case it was a broken TCP connection */
+            rpc_pool_put(job->target->pool, client, 1);
+            client = rpc_pool_get(job->target->pool);
+
+            if (client == NULL) {
+                return NULL;
+            }
+        }
+    }
+
+    rpc_pool_put(job->target->pool, client, 0);
+
+    return NULL;
+}
+
+
+/* write a single file using a number of threads */
+/* returns 0 if all WRITEs and COMMITs succeeded */
+int write_file(targets_t *target, nfs_fh_list *fh, char *data) {
+    struct write_job job = {
+        .target = target,
+        .fh     = fh,
+        .data   = data,
+    };
+    struct write_worker *workers;
+    struct hdr_histogram *write_histogram, *commit_histogram;
+    struct timespec start, end, elapsed;
+    CLIENT *client;
+    unsigned int i;
+    double seconds;
+
+    workers = calloc(cfg.parallel, sizeof(struct write_worker));
+    if (workers == NULL) {
+        fatalx(3, "Couldn't allocate memory for threads!\n");
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    hdr_init(1, tv2us(cfg.timeout), 3, &write_histogram);
+    hdr_init(1, tv2us(cfg.timeout), 3, &commit_histogram);
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &start);
+#endif
+
+    for (i = 0; i < cfg.parallel; i++) {
+        workers[i].job = &job;
+        hdr_init(1, tv2us(cfg.timeout), 3, &workers[i].write_histogram);
+        hdr_init(1, tv2us(cfg.timeout), 3, &workers[i].commit_histogram);
+
+        if (pthread_create(&workers[i].thread, NULL, write_worker, &workers[i]) != 0) {
+            fatalx(3, "Couldn't create thread!\n");
+        }
+    }
+
+    for (i = 0; i < cfg.parallel; i++) {
+        pthread_join(workers[i].thread, NULL);
+
+        hdr_add(write_histogram, workers[i].write_histogram);
+        hdr_add(commit_histogram, workers[i].commit_histogram);
+        free(workers[i].write_histogram);
+        free(workers[i].commit_histogram);
+    }
+
+    /* final COMMIT so the timing includes getting all of the data to stable storage */
+    if (cfg.stable != FILE_SYNC && job.bytes) {
+        client = rpc_pool_get(target->pool);
+
+        if (client) {
+            /* only throw away the connection if the RPC failed, not for an NFS error */
+            rpc_pool_put(target->pool, client, commit_file(client, &job, commit_histogram) != RPC_SUCCESS);
+        } else {
+            job.commit_errors++;
+        }
+    }
+
+#ifdef CLOCK_MONOTONIC_RAW
+    clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &end);
+#endif
+
+    timespecsub(&end, &start, &elapsed);
+    seconds = ts2us(elapsed) / 1000000.0;
+
+    printf("%s:%s : %llu bytes in %.3f s = %.2f MB/s (write/commit errors = %lu/%lu)\n",
+        target->display_name,
+        fh->path,
+        job.bytes,
+        seconds,
+        seconds > 0 ? job.bytes / seconds / 1048576 : 0,
+        job.write_errors,
+        job.commit_errors);
+
+    print_latency(target, fh, "WRITE", write_histogram);
+    print_latency(target, fh, "COMMIT", commit_histogram);
+
+    if (job.verf_changes) {
+        fprintf(stderr, "%s:%s: write verifier changed %lu times, data may need to be rewritten!\n",
+            target->display_name, fh->path, job.verf_changes);
+    }
+
+    fflush(stdout);
+
+    free(write_histogram);
+    free(commit_histogram);
+    free(workers);
+    pthread_mutex_destroy(&job.lock);
+
+    return job.write_errors || job.commit_errors || job.verf_changes;
+}
+
+
+/* print a line of response time percentiles for one procedure */
+void print_latency(targets_t *target, nfs_fh_list *fh, const char *proc, struct hdr_histogram *histogram) {
+    /* don't print anything for procedures that weren't called */
+    if (histogram->total_count) {
+        printf("%s:%s : %-6s %7" PRId64 " %7.3f %7.3f %7.3f %7.3f %7.3f ms\n",
+            target->display_name,
+            fh->path,
+            proc,
+            histogram->total_count,
+            hdr_min(histogram) / 1000.0,
+            /* median not mean! */
+            hdr_value_at_percentile(histogram, 50.0) / 1000.0,
+            hdr_value_at_percentile(histogram, 90.0) / 1000.0,
+            hdr_value_at_percentile(histogram, 99.0) / 1000.0,
+            hdr_max(histogram) / 1000.0);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    int ch; /* getopt */
+    targets_t dummy = { 0 };
+    targets_t *targets = &dummy;
+    targets_t *current;
+    nfs_fh_list *filehandle;
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        /* default to UDP */
+        .ai_socktype = SOCK_DGRAM,
+    };
+    /* source ip address for packets */
+    struct sockaddr_in src_ip = {
+        .sin_family = AF_INET,
+        .sin_addr = 0
+    };
+    char *data;
+    unsigned long i;
+    int failed = 0;
+
+    cfg = CONFIG_DEFAULT;
+
+    while ((ch = getopt(argc, argv, "b:c:C:dfhMp:S:t:Tv")) != -1) {
+        switch(ch) {
+            /* blocksize */
+            case 'b':
+                /* TODO this maxes out at 64k for TCP and 8k for UDP */
+                cfg.blocksize = strtoul(optarg, NULL, 10);
+                if (cfg.blocksize == 0 || cfg.blocksize == ULONG_MAX) {
+                    fatal("Invalid blocksize!\n");
+                }
+                break;
+            /* number of writes */
+            case 'c':
+                cfg.count = strtoul(optarg, NULL, 10);
+                if (cfg.count == 0 || cfg.count == ULONG_MAX) {
+                    fatal("Zero count, nothing to do!\n");
+                }
+                break;
+            /* commit interval */
+            case 'C':
+                cfg.commit = strtoul(optarg, NULL, 10);
+                if (cfg.commit == ULONG_MAX) {
+                    fatal("Invalid commit interval!\n");
+                }
+                break;
+            /* DATA_SYNC */
+            case 'd':
+                if (cfg.stable == FILE_SYNC) {
+                    fatal("Can't specify both -d and -f!\n");
+                }
+                cfg.stable = DATA_SYNC;
+                break;
+            /* FILE_SYNC */
+            case 'f':
+                if (cfg.stable == DATA_SYNC) {
+                    fatal("Can't specify both -f and -d!\n");
+                }
+                cfg.stable = FILE_SYNC;
+                break;
+            /* portmapper */
+            case 'M':
+                cfg.port = 0;
+                break;
+            /* outstanding requests */
+            case 'p':
+                cfg.parallel = strtoul(optarg, NULL, 10);
+                if (cfg.parallel == 0) {
+                    fatal("Need at least one outstanding request!\n");
+                }
+                break;
+            /* source ip address for packets */
+            case 'S':
+                if (inet_pton(AF_INET, optarg, &src_ip.sin_addr) != 1) {
+                    fatal("Invalid source IP address!\n");
+                }
+                break;
+            /* timeout */
+            case 't':
+                ms2tv(&cfg.timeout, strtoul(optarg, NULL, 10));
+                if (cfg.timeout.tv_sec == 0 && cfg.timeout.tv_usec == 0) {
+                    fatal("Zero timeout!\n");
+                }
+                break;
+            /* use TCP */
+            case 'T':
+                hints.ai_socktype = SOCK_STREAM;
+                break;
+            /* verbose */
+            case 'v':
+                verbose = 1;
+                break;
+            case 'h':
+            default:
+                usage();
+        }
+    }
+
+    /* no arguments, use stdin */
+    /* don't allocate space for results */
+    read_fhs(stdin, targets, cfg.port, cfg.timeout, 0);
+
+    /* skip the dummy entry */
+    targets = targets->next;
+
+    /* make a buffer of random data so compression or deduplication on the server doesn't skew the results */
+    data = malloc(cfg.blocksize);
+    if (data == NULL) {
+        fatalx(3, "Couldn't allocate memory for data!\n");
+    }
+    srand(getpid());
+    for (i = 0; i < cfg.blocksize; i++) {
+        data[i] = rand();
+    }
+
+    /* listen for ctrl-c */
+    quitting = 0;
+    signal(SIGINT, sigint_handler);
+
+    /* don't quit on (TCP) broken pipes */
+    signal(SIGPIPE, SIG_IGN);
+
+    current = targets;
+
+    while (current && quitting == 0) {
+        /* one connection for each outstanding request */
+        current->pool = rpc_pool_new(current->client_sock, &hints, NFS_PROGRAM, cfg.version, cfg.timeout, src_ip, cfg.parallel, 1);
+
+        filehandle = current->filehandles;
+
+        while (filehandle && quitting == 0) {
+            failed |= write_file(current, filehandle, data);
+
+            filehandle = filehandle->next;
+        }
+
+        current->pool = rpc_pool_destroy(current->pool);
+
+        current = current->next;
+    }
+
+    free(data);
+
+    if (targets && failed == 0) {
+        return EXIT_SUCCESS;
+    }
+
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,110 @@
+/*
+ * Benchmark for reading JSON filehandles with read_fhs()
+ *
+ * Generates nfsmount style lines for a number of servers and times how long read_fhs() takes to ingest them. Every
+ * nfs_fh_list is over 1KB so the lines are read in chunks, freeing the targets in between, to keep 10M lines in a
+ * reasonable amount of memory.
+ *
+ * Usage: tests/read_fhs_bench [lines [chunk]]
+ */
+
+#include "src/util.h"
+
+int verbose = 0;
+
+/* number of servers the filehandles are spread over */
+#define BENCH_SERVERS 100
+
+
+/* write chunk lines starting at line number first */
+static size_t make_lines(char *buffer, size_t size, unsigned long first, unsigned long chunk) {
+    size_t len = 0;
+    unsigned long i;
+    unsigned int server;
+
+    for (i = first; i < first + chunk; i++) {
+        /* nfsmount prints all of a server's exports together */
+        server = (i - first) * BENCH_SERVERS / chunk;
+        len += snprintf(buffer + len, size - len,
+            "{\"host\":\"server%u.example.com\",\"ip\":\"10.0.%u.%u\",\"path\":\"\\/vol\\/export%lu\",\"usec\":%lu,"
+            "\"timestamp\":1500000000,\"filehandle\":\"01000701%08lx0000000000000000%08lx000000000000000000000000\",\"version\":3}\n",
+            server, server / 256, server % 256, i, i % 1000, i, i);
+    }
+
+    return len;
+}
+
+
+/* free every target and its filehandles */
+static void free_targets(targets_t *target) {
+    nfs_fh_list *fh, *next;
+
+    while (target) {
+        for (fh = target->filehandles; fh; fh = next) {
+            next = fh->next;
+            free(fh->nfs_fh.data.data_val);
+            free(fh->results);
+            free(fh);
+        }
+        target = free_target(target);
+    }
+}
+
+
+int main(int argc, char **argv) {
+    unsigned long lines = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    unsigned long chunk = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    struct timeval timeout = NFS_TIMEOUT;
+    struct timespec start, end, elapsed;
+    struct timespec total = { 0 };
+    size_t size;
+    char *buffer;
+    size_t len;
+    unsigned long done = 0;
+    unsigned long total_read = 0;
+    unsigned long n;
+    targets_t dummy;
+    FILE *in;
+    double seconds;
+
+    if (lines == 0 || chunk == 0) {
+        fprintf(stderr, "Usage: %s [lines [chunk]]\n", argv[0]);
+        return 3;
+    }
+
+    /* the longest line is about 200 bytes */
+    size = chunk * 256;
+    buffer = malloc(size);
+    if (buffer == NULL) {
+        fprintf(stderr, "Couldn't allocate memory for input!\n");
+        return 3;
+    }
+
+    while (done < lines) {
+        n = lines - done < chunk ? lines - done : chunk;
+        len = make_lines(buffer, size, done, n);
+
+        in = fmemopen(buffer, len, "r");
+        memset(&dummy, 0, sizeof(dummy));
+
+        /* only time read_fhs(), not making the input or freeing the results */
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        total_read += read_fhs(in, &dummy, NFS_PORT, timeout, 0);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        timespecsub(&end, &start, &elapsed);
+        timespecadd(&total, &elapsed, &total);
+
+        fclose(in);
+        free_targets(dummy.next);
+        done += n;
+    }
+
+    free(buffer);
+
+    seconds = total.tv_sec + total.tv_nsec / 1e9;
+    printf("read_fhs: %lu/%lu lines in %.3fs (%.0f lines/s)\n", total_read, lines, seconds,
+        seconds > 0 ? total_read / seconds : 0);
+
+    return total_read == lines ? 0 : 1;
+}
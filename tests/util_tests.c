@@ -1,7 +1,15 @@
 #include "minunit.h"
 #include "src/util.h"
+#include "src/crc32c.h"
+#include "src/arena.h"
+#include "src/idcache.h"
+#include "src/fileid.h"
+#include "src/fhdb.h"
+#include "src/stats.h"
+#include "src/serve.h"
 
 int tests_run = 0;
+int verbose = 0;
 
 static char *test_reverse_fqdn() {
     char *fqdn = "www.test.com";
@@ -43,11 +51,270 @@ static char *test_nfs_perror_toobig_low() {
     return 0;
 }
 
+static char *test_crc32c_check() {
+    /* the standard check value for CRC-32C */
+    const char *check = "123456789";
+
+    mu_assert("error, wrong crc32c!", crc32c(0, check, strlen(check)) == 0xe3069283);
+    return 0;
+}
+
+static char *test_crc32c_stream_out_of_order() {
+    char buf[10000];
+    struct crc32c_stream stream;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = i * 7;
+    }
+
+    /* blocks arrive 3, 1, 2 */
+    crc32c_stream_init(&stream);
+    crc32c_stream_add(&stream, 7000, 3000, crc32c(0, buf + 7000, 3000));
+    crc32c_stream_add(&stream, 0, 1001, crc32c(0, buf, 1001));
+    mu_assert("error, out of order block not held!", stream.next == 1001 && stream.pending);
+    crc32c_stream_add(&stream, 1001, 5999, crc32c(0, buf + 1001, 5999));
+
+    mu_assert("error, blocks not combined!", stream.next == sizeof(buf) && stream.pending == NULL);
+    mu_assert("error, combined crc32c doesn't match!", stream.crc == crc32c(0, buf, sizeof(buf)));
+    return 0;
+}
+
+static char *test_arena() {
+    struct arena *arena = arena_new(1024);
+    char *small, *big;
+    unsigned int i;
+
+    /* odd sizes shouldn't break alignment */
+    for (i = 0; i < 100; i++) {
+        small = arena_alloc(arena, i * 3 + 1);
+        mu_assert("error, arena allocation not aligned!", ((uintptr_t)small % sizeof(union arena_align)) == 0);
+    }
+
+    /* bigger than a chunk */
+    big = arena_calloc(arena, 4096);
+    mu_assert("error, big allocation not zeroed!", big[0] == 0 && big[4095] == 0);
+
+    small = arena_strdup(arena, "hello");
+    mu_assert("error, arena_strdup!", strcmp(small, "hello") == 0);
+
+    arena_reset(arena);
+    mu_assert("error, arena not reset!", arena->allocated == 0 && arena->chunks && arena->chunks->next == NULL);
+
+    arena_free(arena);
+    return 0;
+}
+
+static char *test_idcache() {
+    unsigned long lookups;
+
+    /* this uid is very unlikely to exist, it should be cached as a number */
+    mu_assert("error, missing uid not returned as a number!", strcmp(idcache_user(4000000000u), "4000000000") == 0);
+    lookups = idcache_lookups();
+    mu_assert("error, missing uid looked up again!", strcmp(idcache_user(4000000000u), "4000000000") == 0 && idcache_lookups() == lookups);
+    mu_assert("error, uid 0 isn't root!", strcmp(idcache_user(0), "root") == 0);
+    return 0;
+}
+
+static char *test_fileid_set() {
+    struct fileid_set *set = fileid_set_new();
+    uint64_t i;
+
+    /* enough to grow the table a few times */
+    for (i = 0; i < 10000; i++) {
+        mu_assert("error, new fileid not added!", fileid_set_add(set, 1, 42, i) == 1);
+    }
+
+    mu_assert("error, fileid added twice!", fileid_set_add(set, 1, 42, 1234) == 0 && fileid_set_add(set, 1, 42, 0) == 0);
+    mu_assert("error, same fileid on another filesystem not added!", fileid_set_add(set, 1, 43, 1234) == 1);
+    mu_assert("error, same fileid on another server not added!", fileid_set_add(set, 2, 42, 1234) == 1);
+    mu_assert("error, zero fileid!", fileid_set_add(set, 1, 0, 0) == 1 && fileid_set_add(set, 1, 0, 0) == 0);
+    mu_assert("error, wrong fileid count!", fileid_set_count(set) == 10003);
+
+    fileid_set_free(set);
+    return 0;
+}
+
+static char *test_fhdb() {
+    char file[] = "/tmp/fhdb_test.XXXXXX";
+    struct fhdb_writer *writer = fhdb_writer_new();
+    struct fhdb *db;
+    const struct fhdb_record *record;
+    struct in_addr ip1, ip2;
+    targets_t dummy = { 0 };
+    struct timeval timeout = NFS_TIMEOUT;
+    int fd = mkstemp(file);
+
+    mu_assert("error, couldn't make temporary file!", fd != -1);
+    close(fd);
+
+    inet_pton(AF_INET, "10.0.0.1", &ip1);
+    inet_pton(AF_INET, "10.0.0.2", &ip2);
+
+    /* added out of order */
+    fhdb_add(writer, ip2, "two", "/b", "\x01\x02\x03", 3);
+    fhdb_add(writer, ip1, "one", "/z", "\x04", 1);
+    fhdb_add(writer, ip1, "one", "/a", "\x05\x06", 2);
+    mu_assert("error, database not written!", fhdb_write(writer, file) == 0);
+    writer = fhdb_writer_free(writer);
+
+    db = fhdb_open(file);
+    unlink(file);
+    mu_assert("error, database not opened!", db != NULL);
+    mu_assert("error, wrong record count!", db->header->count == 3);
+
+    record = fhdb_find(db, ip1, "/z");
+    mu_assert("error, record not found!", record && record->fh_len == 1 && record->fh[0] == 4);
+    mu_assert("error, wrong hostname!", strcmp(fhdb_string(db, record->host), "one") == 0);
+    record = fhdb_find(db, ip2, "/b");
+    mu_assert("error, record not found!", record && record->fh_len == 3 && memcmp(record->fh, "\x01\x02\x03", 3) == 0);
+    mu_assert("error, missing record found!", fhdb_find(db, ip2, "/a") == NULL);
+
+    /* sorted by server then path */
+    fhdb_load(db, &dummy, NFS_PORT, timeout, 0);
+    mu_assert("error, wrong targets!", dummy.next && dummy.next->next && dummy.next->next->next == NULL);
+    mu_assert("error, wrong target name!", strcmp(dummy.next->name, "one") == 0);
+    mu_assert("error, wrong filehandle order!", strcmp(dummy.next->filehandles->path, "/a") == 0 &&
+        strcmp(dummy.next->filehandles->next->path, "/z") == 0);
+    mu_assert("error, wrong filehandle!", dummy.next->next->filehandles->nfs_fh.data.data_len == 3);
+
+    db = fhdb_close(db);
+    return 0;
+}
+
+static char *test_stats() {
+    struct stats *stats = stats_open("nfsping_test", "nfsv3");
+    struct stats_target copy;
+    targets_t dummy = { 0 };
+    struct sockaddr_in ip = { 0 };
+    struct timeval timeout = NFS_TIMEOUT;
+    targets_t *first, *second;
+
+    mu_assert("error, wrong bucket!", stats_bucket(0) == 0 && stats_bucket(1) == 1 && stats_bucket(1023) == 10 &&
+        stats_bucket(1024) == 11 && stats_bucket(ULONG_MAX) == STATS_BUCKETS - 1);
+
+    inet_pton(AF_INET, "10.0.0.1", &ip.sin_addr);
+    first = find_or_make_target(&dummy, &ip, NFS_PORT, timeout, 0);
+    first->display_name = first->ip_address;
+    stats_targets(stats, dummy.next);
+    mu_assert("error, wrong count!", stats->header->count == 1 && first->stats == &stats->targets[0]);
+
+    stats_update(first->stats, 1, 0, 1000);
+    stats_update(first->stats, 0, 1, 0);
+    stats_snapshot(first->stats, &copy);
+    mu_assert("error, wrong counters!", copy.sent == 2 && copy.received == 1 && copy.timeouts == 1 && copy.last == 1000);
+    mu_assert("error, wrong histogram!", copy.buckets[10] == 1);
+    mu_assert("error, wrong name!", strcmp(copy.name, "10.0.0.1") == 0 && (copy.seq & 1) == 0);
+
+    /* a new target in front keeps the counters of the old one */
+    inet_pton(AF_INET, "10.0.0.2", &ip.sin_addr);
+    second = find_or_make_target(&dummy, &ip, NFS_PORT, timeout, 0);
+    second->display_name = second->ip_address;
+    dummy.next = second;
+    second->next = first;
+    first->next = NULL;
+    stats_targets(stats, dummy.next);
+    stats_snapshot(first->stats, &copy);
+    mu_assert("error, counters lost!", stats->header->count == 2 && first->stats == &stats->targets[1] && copy.sent == 2);
+    mu_assert("error, new target not empty!", second->stats->sent == 0);
+
+    stats_reset(first->stats);
+    mu_assert("error, histogram not reset!", first->stats->buckets[10] == 0 && first->stats->sent == 2);
+
+    stats = stats_close(stats);
+    free_target(second);
+    free_target(first);
+    return 0;
+}
+
+static char *test_serve_histogram() {
+    struct hdr_histogram *histogram;
+    char *buffer = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&buffer, &size);
+
+    hdr_init(1, 1000000, 3, &histogram);
+    hdr_record_value(histogram, 50);
+    hdr_record_value(histogram, 100);
+    hdr_record_value(histogram, 2000);
+
+    serve_label(out, "a\"b\\c\n");
+    fputc('|', out);
+    serve_histogram(out, "t", "x=\"1\"", histogram);
+    fclose(out);
+
+    mu_assert("error, label not escaped!", strncmp(buffer, "a\\\"b\\\\c\\n|", 10) == 0);
+    /* the buckets are cumulative and include their upper limit */
+    mu_assert("error, wrong buckets!", strstr(buffer, "t_bucket{x=\"1\",le=\"0.0001\"} 2\n") &&
+        strstr(buffer, "t_bucket{x=\"1\",le=\"0.001\"} 2\n") && strstr(buffer, "t_bucket{x=\"1\",le=\"0.0025\"} 3\n") &&
+        strstr(buffer, "t_bucket{x=\"1\",le=\"+Inf\"} 3\n") && strstr(buffer, "t_count{x=\"1\"} 3\n"));
+    mu_assert("error, wrong sum!", strstr(buffer, "t_sum{x=\"1\"} 0.002150\n"));
+
+    free(buffer);
+    free(histogram);
+    return 0;
+}
+
+static char *test_hex_to_bytes() {
+    char out[4];
+
+    mu_assert("error, hex not decoded!", hex_to_bytes("00fFa9", 6, out) == 3 && memcmp(out, "\x00\xff\xa9", 3) == 0);
+    mu_assert("error, odd length decoded!", hex_to_bytes("abc", 3, out) == -1);
+    mu_assert("error, invalid hex decoded!", hex_to_bytes("0g", 2, out) == -1);
+    return 0;
+}
+
+static char *test_read_fhs() {
+    char input[] =
+        "{\"host\":\"one\",\"ip\":\"10.0.0.1\",\"path\":\"\\/a\\/b\",\"usec\":12,\"filehandle\":\"0102\",\"version\":3}\n"
+        /* a different order and spacing */
+        "{ \"filehandle\" : \"03\", \"path\" : \"/c\", \"ip\" : \"10.0.0.2\", \"host\" : \"two\" }\n"
+        "\n"
+        /* nested values go through parson */
+        "{\"host\":\"one\",\"ip\":\"10.0.0.1\",\"path\":\"/d\",\"filehandle\":\"04\",\"extra\":{\"x\":[1]}}\n"
+        /* errors */
+        "{\"host\":\"one\",\"ip\":\"10.0.0.1\",\"path\":\"/e\",\"filehandle\":\"0x\"}\n"
+        "{\"host\":\"one\",\"ip\":\"10.0.0.300\",\"path\":\"/f\",\"filehandle\":\"05\"}\n"
+        "not json\n"
+        /* no newline at the end */
+        "{\"host\":\"two\",\"ip\":\"10.0.0.2\",\"path\":\"/g\",\"filehandle\":\"06\"}";
+    FILE *in = fmemopen(input, strlen(input), "r");
+    targets_t dummy = { 0 };
+    struct timeval timeout = NFS_TIMEOUT;
+    targets_t *one, *two;
+
+    mu_assert("error, wrong number of filehandles!", read_fhs(in, &dummy, NFS_PORT, timeout, 0) == 4);
+    fclose(in);
+
+    one = dummy.next;
+    mu_assert("error, wrong targets!", one && one->next && one->next->next == NULL);
+    two = one->next;
+    mu_assert("error, wrong hostnames!", strcmp(one->name, "one") == 0 && strcmp(two->name, "two") == 0);
+    mu_assert("error, path not unescaped!", strcmp(one->filehandles->path, "/a/b") == 0);
+    mu_assert("error, wrong filehandle!", one->filehandles->nfs_fh.data.data_len == 2 &&
+        memcmp(one->filehandles->nfs_fh.data.data_val, "\x01\x02", 2) == 0);
+    mu_assert("error, parson line missing!", one->filehandles->next && strcmp(one->filehandles->next->path, "/d") == 0 &&
+        one->filehandles->next->next == NULL);
+    mu_assert("error, wrong filehandles for second target!", strcmp(two->filehandles->path, "/c") == 0 &&
+        strcmp(two->filehandles->next->path, "/g") == 0 && two->last_fh == two->filehandles->next);
+    return 0;
+}
+
 static char *all_tests() {
     mu_run_test(test_reverse_fqdn);
     mu_run_test(test_nfs_perror_nfs3ok);
     mu_run_test(test_nfs_perror_toobig);
     mu_run_test(test_nfs_perror_toobig_low);
+    mu_run_test(test_crc32c_check);
+    mu_run_test(test_crc32c_stream_out_of_order);
+    mu_run_test(test_arena);
+    mu_run_test(test_idcache);
+    mu_run_test(test_fileid_set);
+    mu_run_test(test_fhdb);
+    mu_run_test(test_stats);
+    mu_run_test(test_serve_histogram);
+    mu_run_test(test_hex_to_bytes);
+    mu_run_test(test_read_fhs);
     return 0;
 }
 